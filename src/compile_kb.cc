@@ -12,6 +12,9 @@
 #include <boost/program_options.hpp>
 #include <boost/tokenizer.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
 
 
 // timer
@@ -110,13 +113,14 @@ void show_bfs_path(string & str) {
 		cout << path_str[1] << " not present!";
 		return;
 	}
-	kb.bfs(u, p);
-	Kb::vertex_descriptor w = v;
-	while(w != u) {
-		print_iquery_v(g, w, 0, 1);
-		w = p[w];
+	if (!kb.shortest_path(u, v, p, PathWorkspace::local())) {
+		cout << path_str[1] << " not reachable from " << path_str[0] << "!";
+		return;
+	}
+	for(vector<Kb::vertex_descriptor>::reverse_iterator it = p.rbegin(), end = p.rend();
+		it != end; ++it) {
+		print_iquery_v(g, *it, 0, 1);
 	}
-	print_iquery_v(g, u, 0, 1);
 }
 
 void show_neighbours(string & str) {
@@ -204,6 +208,55 @@ void subg(const string & initV, size_t N) {
 	cout << "}\n";
 }
 
+// Subgraph around the vertices of a file (- for stdin), up to depth edges
+// away from them. Written in text format to stdout, or as a binary graph
+// to out_fname (if not empty).
+
+void khop(const string & fname, size_t depth, size_t N,
+		  const string & out_fname, const string & note) {
+
+	Kb & kb = Kb::instance();
+
+	ifstream fi;
+	if (fname != "-") {
+		fi.open(fname.c_str(), ifstream::in);
+		if (!fi) {
+			cerr << "[E] khop: can not open " << fname << "\n";
+			exit(1);
+		}
+	}
+	istream & is = (fname == "-") ? cin : fi;
+
+	vector<Kb::vertex_descriptor> seeds;
+	string name;
+	size_t missing = 0;
+	while(is >> name) {
+		Kb::vertex_descriptor u;
+		bool aux;
+		tie(u, aux) = kb.get_vertex_by_name(name);
+		if (!aux) {
+			if (glVars::debug::warning) cerr << "[W] khop: " << name << " not in KB\n";
+			++missing;
+			continue;
+		}
+		seeds.push_back(u);
+	}
+	if (missing)
+		cerr << "[W] khop: " << missing << " vertices not in KB\n";
+
+	KbSubgraph sg;
+	kb.khop_subgraph(seeds, depth, sg, SubgraphWorkspace::local(), N);
+	if (!out_fname.size()) {
+		kb.write_subgraph_txt(cout, sg);
+		return;
+	}
+	Kb::version_t sub = kb.subgraph_kb(sg);
+	sub->add_comment(note);
+	sub->write_to_binfile(out_fname);
+	if (glVars::verbose)
+		cerr << "Wrote subgraph of " << sg.size() << " vertices and " << sg.edge_size() << " edges to " << out_fname << "\n";
+}
+
 void sPath(const string & sPathV) {
 
 	string source;
@@ -225,6 +278,175 @@ void sPath(const string & sPathV) {
 	}
 }
 
+// Batch shortest paths (--sPaths_file). Every line is a query as in
+// --sPaths (source#target#target...), and the output is the same as
+// running --sPaths for every query in turn. Queries are read in chunks;
+// the queries of a chunk are grouped by source, so that each source is
+// searched once for all its targets, and groups are solved in parallel.
+
+struct sPathQuery {
+	Kb::vertex_descriptor src;
+	bool ok;                                         // src is in the KB
+	vector<Kb::vertex_descriptor> tgts;              // in --sPaths order
+	vector<vector<Kb::vertex_descriptor> > paths;    // from src to target
+};
+
+// queries with the same source
+struct sPathGroup {
+	Kb::vertex_descriptor src;
+	vector<size_t> queries;
+};
+
+// A bidirectional search (Kb::shortest_path) visits few vertices, a bfs
+// from the source visits up to all of them. A group is solved with one
+// bidirectional search per target unless it has more than 1 target per
+// spaths_bidir_ratio vertices; then one bfs reaches all targets.
+static const size_t spaths_bidir_ratio = 512;
+
+static void spaths_group(const Kb & kb, const sPathGroup & group,
+						 vector<sPathQuery> & queries) {
+
+	Kb::vertex_descriptor u = group.src;
+	vector<Kb::vertex_descriptor> tgts;
+	for(size_t i = 0; i < group.queries.size(); ++i) {
+		const vector<Kb::vertex_descriptor> & T = queries[group.queries[i]].tgts;
+		tgts.insert(tgts.end(), T.begin(), T.end());
+	}
+	sort(tgts.begin(), tgts.end());
+	tgts.erase(unique(tgts.begin(), tgts.end()), tgts.end());
+
+	// path of every (different) target, empty if not reachable
+	vector<vector<Kb::vertex_descriptor> > tpaths(tgts.size());
+	if (tgts.size() * spaths_bidir_ratio <= kb.size()) {
+		PathWorkspace & ws = PathWorkspace::local();
+		for(size_t j = 0; j < tgts.size(); ++j)
+			kb.shortest_path(u, tgts[j], tpaths[j], ws);
+	} else {
+		BfsWorkspace & ws = BfsWorkspace::local();
+		kb.bfs(u, tgts, ws);
+		for(size_t j = 0; j < tgts.size(); ++j) {
+			Kb::vertex_descriptor v = tgts[j];
+			if (!ws.reached(v)) continue;
+			vector<Kb::vertex_descriptor> & P = tpaths[j];
+			while(v != u) {
+				P.push_back(v);
+				v = ws.parent(v);
+			}
+			P.push_back(u);
+			reverse(P.begin(), P.end());
+		}
+	}
+	for(size_t i = 0; i < group.queries.size(); ++i) {
+		sPathQuery & q = queries[group.queries[i]];
+		for(size_t j = 0; j < q.tgts.size(); ++j) {
+			size_t k = lower_bound(tgts.begin(), tgts.end(), q.tgts[j]) - tgts.begin();
+			if (tpaths[k].empty()) continue; // not reachable
+			q.paths.push_back(tpaths[k]);
+		}
+	}
+}
+
+static void spaths_worker(const Kb * kb, const vector<sPathGroup> * groups,
+						  vector<sPathQuery> * queries, size_t T, size_t t) {
+	for(size_t i = t; i < groups->size(); i += T)
+		spaths_group(*kb, (*groups)[i], *queries);
+}
+
+static void spaths_chunk(vector<sPathQuery> & queries, size_t threads) {
+
+	Kb & kb = Kb::instance();
+
+	vector<sPathGroup> groups;
+	boost::unordered_map<Kb::vertex_descriptor, size_t> group_idx;
+	for(size_t i = 0; i < queries.size(); ++i) {
+		if (!queries[i].ok) continue;
+		boost::unordered_map<Kb::vertex_descriptor, size_t>::iterator it;
+		bool inserted;
+		tie(it, inserted) = group_idx.insert(make_pair(queries[i].src, groups.size()));
+		if (inserted) {
+			groups.push_back(sPathGroup());
+			groups.back().src = queries[i].src;
+		}
+		groups[it->second].queries.push_back(i);
+	}
+
+	size_t T = std::max<size_t>(1, std::min(threads, groups.size()));
+	boost::thread_group helpers;
+	for(size_t t = 1; t < T; ++t)
+		helpers.create_thread(boost::bind(&spaths_worker, &kb, &groups, &queries, T, t));
+	spaths_worker(&kb, &groups, &queries, T, 0);
+	helpers.join_all();
+
+	for(size_t i = 0; i < queries.size(); ++i) {
+		const vector<vector<Kb::vertex_descriptor> > & paths = queries[i].paths;
+		for(size_t j = 0; j < paths.size(); ++j) {
+			const vector<Kb::vertex_descriptor> & P = paths[j];
+			cout << "(";
+			for(size_t k = 0; k < P.size(); ++k) {
+				if (k) cout << ",";
+				cout << kb.get_vertex_name(P[k]);
+			}
+			cout << ")\n";
+		}
+	}
+	cout.flush();
+}
+
+// names already looked up (the KB lookup goes through a std::map)
+typedef boost::unordered_map<string, pair<Kb::vertex_descriptor, bool> > spaths_names_t;
+
+static const pair<Kb::vertex_descriptor, bool> & spaths_lookup(spaths_names_t & names,
+															   const string & name) {
+	spaths_names_t::iterator it = names.find(name);
+	if (it == names.end())
+		it = names.insert(make_pair(name, Kb::instance().get_vertex_by_name(name))).first;
+	return it->second;
+}
+
+void sPath_batch(const string & fname, size_t threads, size_t chunk) {
+
+	ifstream fi;
+	if (fname != "-") {
+		fi.open(fname.c_str(), ifstream::in);
+		if (!fi) {
+			cerr << "[E] sPaths_file: can not open " << fname << "\n";
+			exit(1);
+		}
+	}
+	istream & is = (fname == "-") ? cin : fi;
+
+	spaths_names_t names;
+	vector<sPathQuery> queries;
+	string line;
+	size_t l_n = 0;
+	while(read_line_noblank(is, line, l_n)) {
+		vector<string> aux = split(line, "#");
+		if (aux.size() < 2) {
+			if (glVars::input::swallow) {
+				cerr << "[W] sPaths_file: line " << l_n << ": you must at least specify two nodes\n";
+				continue;
+			}
+			cerr << "[E] sPaths_file: line " << l_n << ": you must at least specify two nodes\n";
+			exit(1);
+		}
+		queries.push_back(sPathQuery());
+		sPathQuery & q = queries.back();
+		tie(q.src, q.ok) = spaths_lookup(names, aux[0]);
+		if (q.ok) {
+			set<string> S(aux.begin() + 1, aux.end()); // as --sPaths
+			for(set<string>::const_iterator it = S.begin(), end = S.end(); it != end; ++it) {
+				const pair<Kb::vertex_descriptor, bool> & v = spaths_lookup(names, *it);
+				if (v.second && v.first != q.src) q.tgts.push_back(v.first);
+			}
+		}
+		if (queries.size() == chunk) {
+			spaths_chunk(queries, threads);
+			queries.clear();
+		}
+	}
+	if (queries.size()) spaths_chunk(queries, threads);
+}
+
 int main(int argc, char *argv[]) {
 
 	srand(3);
@@ -242,11 +464,21 @@ int main(int argc, char *argv[]) {
 	// subgraph options
 	string subg_init;
 	size_t subgN = 100;
+	string khop_file;
+	size_t khop_depth = 1;
+	size_t khopN = 0;
+
+	// landmark index options
+	size_t landmarkN = 0;
+	Kb::landmark_method_t landmark_method = Kb::landmarks_degree;
 
 	string fullname_out("kb_wnet.bin");
 	string kb_file;
 	string query_vertex;
 	string sPathV;
+	string sPath_file;
+	size_t sPath_threads = 1;
+	size_t sPath_chunk = 10000;
 
 	glVars::kb::v1_kb = false; // Use v2 format
 	glVars::kb::filter_src = false; // by default, don't filter relations by src
@@ -287,6 +519,8 @@ int main(int argc, char *argv[]) {
 		("minput", "Do not die when dealing with malformed input.")
 		("nopos", "Don't filter words by Part of Speech when reading dict.")
 		("note", value<string>(), "Add a comment to the graph.")
+		("landmarks", value<size_t>(), "Store a landmark distance index with this many landmarks (e.g. 16) in the graph. Shortest path queries (--sPaths, iquery) use it to tell unconnected vertices without searching. It takes 4 bytes per vertex and landmark.")
+		("landmarks_method", value<string>(), "How landmarks are chosen: degree (highest degree vertices, default) or farthest (each landmark as far as possible from the previous ones).")
 		;
 
 	options_description po_desc_query("Options for querying over binary graphs");
@@ -297,7 +531,13 @@ int main(int argc, char *argv[]) {
 		("iquery,Q", "Interactively query graph.")
 		("subG,S", value<string>(), "Get a subgraph starting at this vertex. See subG_depth.")
 		("subG_N", value<size_t>(), "Max. number of nodes in subgraph (see --subG). Default is 100.")
+		("khop", value<string>(), "Get the subgraph around the vertices in this file (- for stdin), separated by blanks: the vertices at most --khop_depth edges away from them, and all edges among those. Written to stdout in text format, or to a binary graph if --output is given.")
+		("khop_depth", value<size_t>(), "Max. number of edges from --khop vertices (default is 1, 0 means no limit).")
+		("khop_N", value<size_t>(), "Max. number of vertices of --khop subgraphs (default is no limit).")
 		("sPaths", value<string>(), "Get shortest paths. Value is a vector of nodes, separated by character '#'. First node is source.")
+		("sPaths_file", value<string>(), "Get shortest paths of many queries, one per line of this file (- for stdin), each in --sPaths format. Output is the same as with --sPaths for every query in turn.")
+		("sPaths_threads", value<size_t>(), "Number of threads for --sPaths_file (default is 1).")
+		("sPaths_chunk", value<size_t>(), "Queries of --sPaths_file are read and solved in chunks of this many lines (default is 10000). Queries with the same source in a chunk share one search.")
 		("dict_file,D", value<string>(), "Dictionary text file. Use only when querying (--quey or --iquery) or when creating serialized dict (--serialize_dict).")
 		;
 
@@ -373,10 +613,42 @@ int main(int argc, char *argv[]) {
 			subgN = vm["subG_depth"].as<size_t>();
 		}
 
+		if (vm.count("khop")) {
+			khop_file = vm["khop"].as<string>();
+		}
+
+		if (vm.count("khop_depth")) {
+			khop_depth = vm["khop_depth"].as<size_t>();
+		}
+
+		if (vm.count("khop_N")) {
+			khopN = vm["khop_N"].as<size_t>();
+		}
+
 		if (vm.count("sPaths")) {
 			sPathV = vm["sPaths"].as<string>();
 		}
 
+		if (vm.count("sPaths_file")) {
+			sPath_file = vm["sPaths_file"].as<string>();
+		}
+
+		if (vm.count("sPaths_threads")) {
+			sPath_threads = vm["sPaths_threads"].as<size_t>();
+			if (!sPath_threads) {
+				cerr << "Error: invalid sPaths_threads of zero\n";
+				exit(1);
+			}
+		}
+
+		if (vm.count("sPaths_chunk")) {
+			sPath_chunk = vm["sPaths_chunk"].as<size_t>();
+			if (!sPath_chunk) {
+				cerr << "Error: invalid sPaths_chunk of zero\n";
+				exit(1);
+			}
+		}
+
 		if (vm.count("dict_file")) {
 			glVars::dict::text_fname = vm["dict_file"].as<string>();
 			opt_variants = true;
@@ -422,6 +694,20 @@ int main(int argc, char *argv[]) {
 		if (vm.count("output")) {
 			fullname_out = vm["output"].as<string>();
 		}
+
+		if (vm.count("landmarks")) {
+			landmarkN = vm["landmarks"].as<size_t>();
+		}
+
+		if (vm.count("landmarks_method")) {
+			string m = vm["landmarks_method"].as<string>();
+			if (m == "degree") landmark_method = Kb::landmarks_degree;
+			else if (m == "farthest") landmark_method = Kb::landmarks_farthest;
+			else {
+				cerr << "[E] --landmarks_method: unknown method " << m << " (use degree or farthest)\n";
+				exit(1);
+			}
+		}
 	}
 	catch(std::exception& e) {
 		cerr << e.what() << "\n";
@@ -490,12 +776,24 @@ int main(int argc, char *argv[]) {
 		return 0;
 	}
 
+	if(khop_file.size()) {
+		Kb::create_from_binfile(kb_file);
+		khop(khop_file, khop_depth, khopN, vm.count("output") ? fullname_out : string(), cmdline);
+		return 0;
+	}
+
 	if(sPathV.size()) {
 		Kb::create_from_binfile(kb_file);
 		sPath(sPathV);
 		return 0;
 	}
 
+	if(sPath_file.size()) {
+		Kb::create_from_binfile(kb_file);
+		sPath_batch(sPath_file, sPath_threads, sPath_chunk);
+		return 0;
+	}
+
 	if (glVars::verbose) {
 		show_global_variables(cerr);
 	}
@@ -531,6 +829,17 @@ int main(int argc, char *argv[]) {
 	}
 
 
+	if (landmarkN) {
+		if (glVars::verbose)
+			cerr << "Building landmark index" << endl;
+		try {
+			Kb::instance().build_landmarks(landmarkN, landmark_method);
+		}  catch(std::exception& e) {
+			cerr << e.what() << "\n";
+			exit(-1);
+		}
+	}
+
 	if (glVars::verbose)
 		cerr << "Writing binary file: "<< fullname_out<< endl;
 	Kb::instance().add_comment(cmdline);
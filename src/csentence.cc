@@ -4,15 +4,16 @@
 #include "kbGraph.h"
 #include "wdict.h"
 
-// Tokenizer
-#include <boost/tokenizer.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/functional/hash.hpp>
+#include <sstream>
 
 #include<boost/tuple/tuple.hpp> // for "tie"
 
 namespace ukb {
 	using namespace std;
 	using namespace boost;
+	using boost::string_view;
 
 	static CWord::cwtype cast_int_cwtype(int i) {
 		CWord::cwtype res;
@@ -49,8 +50,7 @@ namespace ukb {
 	}
 
 	void CWord::empty_synsets() {
-		std::vector<std::string>().swap(m_syns);
-		std::vector<std::pair<Kb::vertex_descriptor, float> >().swap(m_V);
+		syns_t().swap(m_V);
 		std::vector<float>().swap(m_ranks);
 		m_linkw_factor = 1;
 		m_disamb = false;
@@ -61,7 +61,6 @@ namespace ukb {
 		m_id.swap(o.m_id);
 		m_pos.swap(o.m_pos);
 		std::swap(m_weight, o.m_weight);
-		m_syns.swap(o.m_syns);
 		m_V.swap(o.m_V);
 		m_ranks.swap(o.m_ranks);
 		std::swap(m_linkw_factor, o.m_linkw_factor);
@@ -95,9 +94,7 @@ namespace ukb {
 			size_t idx = sidxV[i];
 			Kb::vertex_descriptor syn_v = entries.get_entry(idx);
 			if (!syns_S.insert(syn_v).second) continue; // Synset previously there
-			const string & syn_str = entries.get_entry_str(idx);
 			float syn_freq = entries.get_freq(idx);
-			m_syns.push_back(syn_str);
 			m_V.push_back(make_pair(syn_v, syn_freq));
 			new_c++;
 		}
@@ -112,7 +109,7 @@ namespace ukb {
 		m_linkw_factor = 1.0 / wlink;
 
 		// Update ranks
-		vector<float>(m_syns.size(), 0.0).swap(m_ranks);
+		vector<float>(m_V.size(), 0.0).swap(m_ranks);
 		return new_c;
 	}
 
@@ -128,7 +125,6 @@ namespace ukb {
 			if (!P) {
 				throw std::logic_error("CWord concept " + m_w + " not in KB");
 			}
-			m_syns.push_back(m_w);
 			m_V.push_back(make_pair(u, 1.0f));
 			m_ranks.push_back(0.0f);
 			m_linkw_factor = 1.0;
@@ -147,7 +143,7 @@ namespace ukb {
 			// empty CWord
 			empty_synsets();
 		}
-		m_disamb = (1 == m_syns.size()); // monosemous words are disambiguated
+		m_disamb = (1 == m_V.size()); // monosemous words are disambiguated
 	}
 
 	void CWord::attach_lemma(const string & lemma, const string & pos) {
@@ -166,8 +162,7 @@ namespace ukb {
 
 	size_t CWord::set_concepts(map<string, float> & C) {
 
-		std::vector<std::string> syns;
-		std::vector<std::pair<Kb::vertex_descriptor, float> > V;
+		syns_t V;
 		Kb::vertex_descriptor u;
 		bool P;
 		float total_w = 0.0f;
@@ -182,7 +177,6 @@ namespace ukb {
 				continue;
 			}
 			N++;
-			syns.push_back(it->first);
 			V.push_back(make_pair(u, it->second));
 			total_w += it->second;
 		}
@@ -193,7 +187,6 @@ namespace ukb {
 
 		// Update concepts
 		m_linkw_factor = 1.0 / total_w;
-		m_syns.swap(syns);
 		m_V.swap(V);
 		vector<float>(N, 0.0).swap(m_ranks);
 		m_disamb = (N == 1); // monosemous words are disambiguated
@@ -206,7 +199,6 @@ namespace ukb {
 			m_id = cw_.m_id;
 			m_weight = cw_.m_weight;
 			m_pos = cw_.m_pos;
-			m_syns = cw_.m_syns;
 			m_V = cw_.m_V;
 			m_ranks = cw_.m_ranks;
 			m_disamb = cw_.m_disamb;
@@ -231,8 +223,9 @@ namespace ukb {
 			o << m_pos;
 		o << "#" << m_id << "#" << m_type;
 		o << "#" << lexical_cast<string>(m_weight) << "#" << lexical_cast<string>(m_linkw_factor) << "\t";
-		for(size_t i = 0; i < m_syns.size(); i++) {
-			o << "[" << m_syns[i] << ", " << m_V[i].first << ", " << m_V[i].second << "] ";
+		Kb & kb = Kb::instance();
+		for(size_t i = 0; i < m_V.size(); i++) {
+			o << "[" << kb.get_vertex_name(m_V[i].first) << ", " << m_V[i].first << ", " << m_V[i].second << "] ";
 		}
 		return o;
 	}
@@ -250,14 +243,14 @@ namespace ukb {
 
 	void CWord::disamb_cword() {
 
-		size_t n = m_syns.size();
+		size_t n = m_V.size();
 		if (!n) return;
 		if (n == 1) {
 			m_disamb = true; // Monosemous words are disambiguated
 			return;
 		}
 
-		vector<string> syns(n);
+		syns_t syns(n);
 		vector<float> ranks(n);
 		vector<int> idx(n);
 
@@ -266,11 +259,11 @@ namespace ukb {
 		sort(idx.begin(), idx.end(), CWSort(m_ranks));
 
 		for(size_t i=0; i < n; ++i) {
-			syns[i]  = m_syns[idx[i]];
+			syns[i]  = m_V[idx[i]];
 			ranks[i] = m_ranks[idx[i]];
 		}
 		if(ranks[0] == ranks[n-1]) return; // If all ranks have same value the word is not disambiguated
-		syns.swap(m_syns);
+		syns.swap(m_V);
 		ranks.swap(m_ranks);
 		m_disamb = true;
 	}
@@ -293,20 +286,22 @@ namespace ukb {
 	}
 
 	ostream & cw_aw_print_best(ostream & o,
-							   const vector<string> & syns,
+							   const CWord::syns_t & syns,
 							   const vector<float> & ranks) {
+		Kb & kb = Kb::instance();
 		size_t n = syns.size();
-		o << " " << syns[0];
+		o << " " << kb.get_vertex_name(syns[0].first);
 		for(size_t i = 1; i != n; ++i) {
 			if (ranks[i] != ranks[0]) break;
-			o << " " << syns[i];
+			o << " " << kb.get_vertex_name(syns[i].first);
 		}
 		return o;
 	}
 
 	ostream & cw_aw_print_all(ostream & o,
-							  const vector<string> & syns,
+							  const CWord::syns_t & syns,
 							  const vector<float> & ranks) {
+		Kb & kb = Kb::instance();
 		float norm_factor = 1.0;
 		if (glVars::output::norm_ranks) {
 			float rsum = 0.0;
@@ -316,7 +311,7 @@ namespace ukb {
 			if (rsum) norm_factor *= 1.0 / rsum;
 		}
 		for(size_t i = 0; i != syns.size(); ++i) {
-			o << " " << syns[i] << "/" << ranks[i]*norm_factor;
+			o << " " << kb.get_vertex_name(syns[i].first) << "/" << ranks[i]*norm_factor;
 		}
 		return o;
 	}
@@ -324,8 +319,8 @@ namespace ukb {
 	ostream & CWord::print_cword(ostream & o, const std::string &id) const {
 
 		o << id << " ";
-		if(!glVars::output::allranks) cw_aw_print_best(o, m_syns, m_ranks);
-		else cw_aw_print_all(o, m_syns, m_ranks);
+		if(!glVars::output::allranks) cw_aw_print_best(o, m_V, m_ranks);
+		else cw_aw_print_all(o, m_V, m_ranks);
 		o << " !! " << m_w << "\n";
 		return o;
 	}
@@ -336,11 +331,16 @@ namespace ukb {
 	CSentence::CSentence(const std::string & id, const std::string & ctx_str) :
 		m_tgtN(0), m_weight(0.0), m_w_factor(0.0f), m_id(id) {
 		if (m_id.empty()) throw std::runtime_error(string("empty id"));
-		vector<string> ctx;
-		vector<CWord> V;
-		char_separator<char> sep(" \t");
-		tokenizer<char_separator<char> > tok_ctx(ctx_str, sep);
-		copy(tok_ctx.begin(), tok_ctx.end(), back_inserter(ctx));
+		// split context in tokens. Tokens point into ctx_str, no copies.
+		vector<string_view> ctx;
+		const char *p = ctx_str.data();
+		const char *str_end = p + ctx_str.size();
+		while(p != str_end) {
+			if (*p == ' ' || *p == '\t') { ++p; continue; }
+			const char *tok_beg = p;
+			while(p != str_end && *p != ' ' && *p != '\t') ++p;
+			ctx.push_back(string_view(tok_beg, p - tok_beg));
+		}
 		if (ctx.size() == 0) return;
 		try {
 			push_ctx(ctx);
@@ -351,10 +351,70 @@ namespace ukb {
 		}
 	}
 
+	// Index of the unique cwords of a context, keyed on (word, pos), that
+	// is, the same key as CWord::wpos(). Open addressing over a power of
+	// two table; the slots store positions into the CSentence unique
+	// vector, so no keys are copied.
+
+	class CWIndex {
+
+	public:
+
+		CWIndex(const vector<CWord> & V) : m_V(V), m_slots(16, npos), m_n(0) {}
+
+		// return (idx, true) if cw was not in the index (idx is then
+		// inserted), or (position of the cword equal to cw, false)
+		pair<size_t, bool> insert(const CWord & cw, size_t idx) {
+			if (2 * (m_n + 1) > m_slots.size()) rehash(2 * m_slots.size());
+			size_t mask = m_slots.size() - 1;
+			for(size_t i = hash(cw) & mask; ; i = (i + 1) & mask) {
+				size_t v = m_slots[i];
+				if (v == npos) {
+					m_slots[i] = idx;
+					m_n++;
+					return make_pair(idx, true);
+				}
+				if (equal(m_V[v], cw)) return make_pair(v, false);
+			}
+		}
+
+	private:
+
+		static size_t hash(const CWord & cw) {
+			size_t h = boost::hash_range(cw.m_w.begin(), cw.m_w.end());
+			boost::hash_combine(h, boost::hash_range(cw.m_pos.begin(), cw.m_pos.end()));
+			return h;
+		}
+
+		static bool equal(const CWord & a, const CWord & b) {
+			return a.m_w == b.m_w && a.m_pos == b.m_pos;
+		}
+
+		void rehash(size_t n) {
+			vector<size_t> slots(n, npos);
+			size_t mask = n - 1;
+			for(size_t j = 0, m = m_slots.size(); j != m; ++j) {
+				if (m_slots[j] == npos) continue;
+				size_t i = hash(m_V[m_slots[j]]) & mask;
+				while(slots[i] != npos) i = (i + 1) & mask;
+				slots[i] = m_slots[j];
+			}
+			slots.swap(m_slots);
+		}
+
+		static const size_t npos = static_cast<size_t>(-1);
+
+		const vector<CWord> & m_V;
+		vector<size_t> m_slots;
+		size_t m_n;
+	};
+
+	const size_t CWIndex::npos;
+
 	struct ctw_parse_t {
-		string lemma;
-		string pos;
-		string id;
+		string_view lemma;
+		string_view pos;
+		string_view id;
 		int dist; // See cwtype enum.
 		float w;
 
@@ -362,34 +422,112 @@ namespace ukb {
 
 	};
 
-	ctw_parse_t parse_ctw(const string & word) {
+	// Parse a (possibly signed) decimal integer. The whole string has to be
+	// consumed.
+
+	static bool parse_int(string_view str, int & res) {
+		const char *p = str.data();
+		const char *end = p + str.size();
+		bool neg = false;
+		if (p != end && (*p == '-' || *p == '+')) {
+			neg = (*p == '-');
+			++p;
+		}
+		if (p == end) return false;
+		long long n = 0;
+		for(; p != end; ++p) {
+			if (*p < '0' || *p > '9') return false;
+			n = n * 10 + (*p - '0');
+			if (n > 2147483648LL) return false;
+		}
+		if (neg) n = -n;
+		if (n > 2147483647LL) return false;
+		res = static_cast<int>(n);
+		return true;
+	}
 
-		ctw_parse_t res;
+	// Parse a float. Plain decimals ("0.5", "12", "1.5e-3", ...) whose
+	// mantissa and power of ten are exactly representable as floats are
+	// converted with one single float operation, which is correctly
+	// rounded. Anything else (long mantissas, big exponents, "inf",
+	// ...) is handed to lexical_cast.
+
+	static bool parse_float(string_view str, float & res) {
+		const char *p = str.data();
+		const char *end = p + str.size();
+		bool neg = false;
+		if (p != end && (*p == '-' || *p == '+')) {
+			neg = (*p == '-');
+			++p;
+		}
+		unsigned long m = 0;  // mantissa
+		int e = 0;            // power of ten
+		size_t digits = 0;
+		bool fast = true;
+		for(; p != end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+			m = m * 10 + (*p - '0');
+			if (m > (1UL << 24)) { fast = false; break; }
+		}
+		if (fast && p != end && *p == '.') {
+			for(++p; p != end && *p >= '0' && *p <= '9'; ++p, ++digits, --e) {
+				m = m * 10 + (*p - '0');
+				if (m > (1UL << 24)) { fast = false; break; }
+			}
+		}
+		if (fast && digits && p != end && (*p == 'e' || *p == 'E')) {
+			++p;
+			int exp = 0;
+			if (!parse_int(string_view(p, end - p), exp) || exp > 100 || exp < -100) fast = false;
+			else e += exp;
+			p = end;
+		}
+		if (fast && digits && p == end && e >= -10 && e <= 10) {
+			static const float pow10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+										   1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+			float f = static_cast<float>(m);
+			f = e < 0 ? f / pow10[-e] : f * pow10[e];
+			res = neg ? -f : f;
+			return true;
+		}
+		try {
+			res = lexical_cast<float>(str);
+		} catch (boost::bad_lexical_cast &) {
+			return false;
+		}
+		return true;
+	}
+
+	static ctw_parse_t parse_ctw(string_view word) {
 
-		char_separator<char> wsep("#", "", keep_empty_tokens);
-		tokenizer<char_separator<char> > wtok(word, wsep);
-		tokenizer<char_separator<char> >::iterator it = wtok.begin();
-		tokenizer<char_separator<char> >::iterator end = wtok.end();
-		if (it == end) return res; // empty line
-		vector<string> fields;
-		copy(it, end, back_inserter(fields));
-		size_t m = fields.size();
+		ctw_parse_t res;
+		string_view fields[5];
+		size_t m = 0;
+		const char *p = word.data();
+		const char *end = p + word.size();
+		for(;;) {
+			const char *f = p;
+			while(p != end && *p != '#') ++p;
+			if (m == 5) {
+				m++;
+				break;
+			}
+			fields[m++] = string_view(f, p - f);
+			if (p == end) break;
+			++p;
+		}
 		if (m != 4 && m != 5) {
-			throw std::logic_error(word + " : too few fields.");
+			throw std::logic_error(word.to_string() + " : too few fields.");
 		}
 		res.lemma = fields[0];
 		res.pos = fields[1];
 		res.id = fields[2];
-		try {
-			res.dist = lexical_cast<int>(fields[3]);
-			if (m == 5)
-				res.w = lexical_cast<float>(fields[4]);
-		} catch (boost::bad_lexical_cast &) {
-			throw std::logic_error(word + " : Parsing error.");
+		if (!parse_int(fields[3], res.dist) ||
+			(m == 5 && !parse_float(fields[4], res.w))) {
+			throw std::logic_error(word.to_string() + " : Parsing error.");
 		}
 
 		if (res.w < 0.0) {
-			throw std::logic_error(word + " : Negative weight.");
+			throw std::logic_error(word.to_string() + " : Negative weight.");
 		}
 		return res;
 	}
@@ -397,21 +535,21 @@ namespace ukb {
 
 	// NOTE: destroys new_cw
 	void CSentence::push_cw(CWord & new_cw,
-							 map<string, size_t > & CW,
+							 CWIndex & CW,
 							 bool is_nopv) {
-		map<string, size_t >::iterator cwit;
+		size_t idx;
 		bool P;
 		string id = new_cw.id();
 		CWord::cwtype type = new_cw.type();
 		bool is_tgtword = new_cw.is_tgtword();
 		float w = new_cw.m_weight;
 
-		tie(cwit, P) = CW.insert(make_pair(new_cw.wpos(), m_vuniq.size()));
+		tie(idx, P) = CW.insert(new_cw, m_vuniq.size());
 		if (P) {
 			m_vuniq.push_back(CWord());
 			m_vuniq.back().swap(new_cw);
 		} else {
-			CWord & old = m_vuniq[cwit->second];
+			CWord & old = m_vuniq[idx];
 			// check type compatibility
 			bool old_is_nopv = old.type() == CWord::cw_tgtword_nopv || old.type() == CWord::cw_ctxword_nopv;
 			if ((is_nopv && !old_is_nopv) ||
@@ -422,19 +560,19 @@ namespace ukb {
 				old.m_type = type;
 			old.m_weight += w; // aggregate weights
 		}
-		m_tokens.push_back(cwtoken_t(id, type, cwit->second));
+		m_tokens.push_back(cwtoken_t(id, type, idx));
 		if (is_tgtword) m_tgtN++;
 		m_weight += w;
 	}
 
-	void CSentence::push_ctx(const vector<string> & ctx) {
+	void CSentence::push_ctx(const vector<string_view> & ctx) {
 
-		map<string, size_t > CW; // words inserted so far
+		CWIndex CW(m_vuniq); // words inserted so far
 		bool last_is_nopv = false;
 		CWord last_nopv;
 		map<string, float> nopv_concepts;
-		vector<string>::const_iterator end = ctx.end();
-		for(vector<string>::const_iterator it = ctx.begin();
+		vector<string_view>::const_iterator end = ctx.end();
+		for(vector<string_view>::const_iterator it = ctx.begin();
 			it != end or last_is_nopv; ++it) {
 			try {
 				if (it == end) {
@@ -448,16 +586,16 @@ namespace ukb {
 				}
 				ctw_parse_t ctwp = parse_ctw(*it);
 				if (ctwp.lemma.size() == 0) {
-					throw std::logic_error(*it + " has no lemma.");
+					throw std::logic_error(it->to_string() + " has no lemma.");
 				}
 				string pos("");
 				CWord::cwtype cw_type = cast_int_cwtype(ctwp.dist);
 				if (cw_type == CWord::cw_error) {
-					throw std::logic_error(*it + " fourth field is invalid.");
+					throw std::logic_error(it->to_string() + " fourth field is invalid.");
 				}
 				if (glVars::input::filter_pos & (cw_type == CWord::cw_ctxword || cw_type == CWord::cw_tgtword)) {
-					if (!ctwp.pos.size()) throw std::logic_error(*it + " has no POS.");
-					pos = ctwp.pos;
+					if (!ctwp.pos.size()) throw std::logic_error(it->to_string() + " has no POS.");
+					pos = ctwp.pos.to_string();
 				}
 				if(!glVars::input::weight)
 					ctwp.w = 1.0;
@@ -466,7 +604,7 @@ namespace ukb {
 					// there is a nopv element 'active'
 					if (cw_type == CWord::cw_concept) {
 						// attach concept to nopv
-						nopv_concepts.insert(make_pair(ctwp.lemma, ctwp.w));
+						nopv_concepts.insert(make_pair(ctwp.lemma.to_string(), ctwp.w));
 						continue;
 					}
 					last_is_nopv = false;
@@ -480,7 +618,7 @@ namespace ukb {
 				}
 
 				// last_is_nopv == false
-				CWord new_cw(ctwp.lemma, ctwp.id, pos, cw_type, ctwp.w);
+				CWord new_cw(ctwp.lemma.to_string(), ctwp.id.to_string(), pos, cw_type, ctwp.w);
 				if (cw_type == CWord::cw_tgtword_nopv or cw_type == CWord::cw_ctxword_nopv) {
 					// New nopv cword
 					new_cw.swap(last_nopv);
@@ -546,6 +684,50 @@ namespace ukb {
 		return o;
 	}
 
+	// The key has the unique CWords (word, pos, type, weight and synsets with
+	// their link weights) followed by the tokens pointing to them. Synsets are
+	// part of the key because the concepts of some CWords (types 3 and 4)
+	// come from the context, not from the dictionary. Everything else in the
+	// CSentence is derived from these and the KB.
+
+	static void key_append_float(string & key, float f) {
+		key.append(reinterpret_cast<const char *>(&f), sizeof(float));
+	}
+
+	static void key_append_size(string & key, size_t n) {
+		key.append(reinterpret_cast<const char *>(&n), sizeof(size_t));
+	}
+
+	std::string CSentence::canonical_key() const {
+		string key;
+		for(vector<CWord>::const_iterator it = m_vuniq.begin(), end=m_vuniq.end();
+			it != end; ++it) {
+			key += it->m_w;
+			key += '\t';
+			key += it->m_pos;
+			key += '\t';
+			key += static_cast<char>('0' + it->m_type);
+			key_append_float(key, it->m_weight);
+			key_append_size(key, it->m_V.size());
+			for(CWord::const_iterator sit = it->begin(), send = it->end();
+				sit != send; ++sit) {
+				key_append_size(key, sit->first);
+				key_append_float(key, sit->second);
+			}
+			key += '\n';
+		}
+		key += '\n';
+		for(vector<cwtoken_t>::const_iterator it = m_tokens.begin(), end = m_tokens.end();
+			it != end; ++it) {
+			key += it->id;
+			key += '\t';
+			key += static_cast<char>('0' + it->t);
+			key += lexical_cast<string>(it->idx);
+			key += '\n';
+		}
+		return key;
+	}
+
 	std::ostream & CSentence::print_csent(std::ostream & o) const {
 
 		if (!m_tgtN) return o;
@@ -585,7 +767,7 @@ namespace ukb {
 
 	size_t update_pv_cw(const vector<pair<Kb::vertex_descriptor, float> > & m_V,
 						float factor,
-						vector<float> & pv) {
+						Kb::sparse_pv_t & pv) {
 
 		// Sum edge weights
 
@@ -594,24 +776,50 @@ namespace ukb {
 		for(vector<pair<Kb::vertex_descriptor, float> >::const_iterator it = m_V.begin(), end = m_V.end();
 			it != end; ++it) {
 			inserted++;
-			pv[it->first] += it->second * factor;
+			pv.push_back(make_pair(it->first, it->second * factor));
 		}
 		return inserted;
 	}
 
+	struct sparse_pv_less {
+		bool operator()(const pair<Kb::vertex_descriptor, float> & a,
+						const pair<Kb::vertex_descriptor, float> & b) const {
+			return a.first < b.first;
+		}
+	};
+
+	// Sort a sparse pv by vertex and collapse repeated vertices into one
+	// entry. The weights of repeated vertices are added if 'add' is set,
+	// otherwise the last weight is kept. The order of insertion is
+	// preserved among repeated vertices.
+
+	static void sparse_pv_compact(Kb::sparse_pv_t & pv, bool add) {
+
+		if (pv.empty()) return;
+		std::stable_sort(pv.begin(), pv.end(), sparse_pv_less());
+		Kb::sparse_pv_t::iterator out = pv.begin();
+		for(Kb::sparse_pv_t::iterator it = pv.begin() + 1, end = pv.end();
+			it != end; ++it) {
+			if (it->first != out->first) {
+				*(++out) = *it;
+			} else if (add) {
+				out->second += it->second;
+			} else {
+				out->second = it->second;
+			}
+		}
+		pv.erase(++out, pv.end());
+	}
+
 	// Get personalization vector giving an csentence. onlyC variant.
+	//
+	// The pv is sparse, it has one entry per synset of the context.
 
 	int pv_from_cs_onlyC(const CSentence & cs,
-						 vector<float> & pv,
+						 Kb::sparse_pv_t & pv,
 						 CSentence::const_iterator exclude_word_it) {
 
-		Kb & kb = ukb::Kb::instance();
-
-		if (kb.size() == pv.size()) {
-			std::fill(pv.begin(), pv.end(), 0.0);
-		} else {
-			vector<float> (kb.size(), 0.0).swap(pv);
-		}
+		pv.clear();
 
 		Kb::vertex_descriptor u;
 		int inserted_i = 0;
@@ -624,7 +832,7 @@ namespace ukb {
 			float cw_w = cw.get_weight() * cs.weigth_factor();
 			if (cw.type() == CWord::cw_concept) {
 				u = cw.V_vector().at(0).first;
-				pv[u] += cw_w;
+				pv.push_back(make_pair(u, cw_w));
 				inserted_i++;
 			} else {
 				inserted_i += update_pv_cw(cw.V_vector(),
@@ -632,6 +840,7 @@ namespace ukb {
 										   pv);
 			}
 		}
+		sparse_pv_compact(pv, true);
 		return inserted_i;
 	}
 
@@ -642,9 +851,56 @@ namespace ukb {
 	// Initial V is computed by activating the words of the context
 
 	bool calculate_kb_ppr(const CSentence & cs,
-						  vector<float> & ranks) {
+						  vector<float> & ranks,
+						  PrankWorkspace & ws) {
 
-		return calculate_kb_ppr_by_word(cs, cs.uend(), ranks);
+		return calculate_kb_ppr_by_word(cs, cs.uend(), ranks, ws);
+	}
+
+	void calculate_kb_ppr_batch(const vector<const CSentence *> & css,
+								vector<vector<float> > & ranks,
+								vector<bool> & ok,
+								PrankWorkspace & ws) {
+
+		Kb & kb = ukb::Kb::instance();
+		size_t n = css.size();
+		if (ws.batch_pv.size() < n) ws.batch_pv.resize(n);
+		if (ranks.size() < n) ranks.resize(n);
+		ok.assign(n, false);
+
+		vector<const Kb::sparse_pv_t *> pvs;
+		vector<vector<float> *> out;
+		double t0 = prank_clock_us();
+		for(size_t i = 0; i < n; ++i) {
+			if (!pv_from_cs_onlyC(*css[i], ws.batch_pv[i], css[i]->uend())) continue;
+			ok[i] = true;
+			pvs.push_back(&ws.batch_pv[i]);
+			out.push_back(&ranks[i]);
+		}
+		ws.stats.pv_us += prank_clock_us() - t0;
+		kb.pageRank_ppv_batch(pvs, out, ws);
+		if (glVars::csentence::disamb_minus_static) {
+			const vector<float> & staticV = kb.static_prank();
+			for(size_t j = 0; j < out.size(); ++j) {
+				vector<float> & r = *out[j];
+				for(size_t i = 0, m = staticV.size(); i != m; ++i) {
+					r[i] = staticV[i] - r[i];
+				}
+			}
+		}
+	}
+
+	std::string ppr_settings_key() {
+		ostringstream o;
+		o << glVars::prank::use_weight << " " << glVars::prank::num_iterations << " "
+		  << glVars::prank::threshold << " " << glVars::prank::damping << " "
+		  << glVars::prank::impl << " " << glVars::prank::nibble_epsilon << " "
+		  << glVars::csentence::concepts_in << " " << glVars::csentence::disamb_minus_static << " "
+		  << glVars::csentence::mult_priors << " " << glVars::dict::use_weight << " "
+		  << glVars::dict::weight_smoothfactor << " " << glVars::input::filter_pos << " "
+		  << glVars::input::weight << " " << glVars::rAlg << " " << glVars::dGraph::max_depth << " "
+		  << glVars::dGraph::bfs_max_depth;
+		return o.str();
 	}
 
 	// given a word (pointed by tgtw_it),
@@ -656,14 +912,17 @@ namespace ukb {
 
 	bool calculate_kb_ppr_by_word(const CSentence & cs,
 								  CSentence::const_iterator tgtw_it,
-								  vector<float> & ranks) {
+								  vector<float> & ranks,
+								  PrankWorkspace & ws) {
 
 		Kb & kb = ukb::Kb::instance();
-		vector<float> pv;
+		Kb::sparse_pv_t & pv = ws.pv;
+		double t0 = prank_clock_us();
 		int aux = pv_from_cs_onlyC(cs, pv, tgtw_it);
+		ws.stats.pv_us += prank_clock_us() - t0;
 		// Execute PageRank
 		if (aux) {
-			kb.pageRank_ppv(pv, ranks);
+			kb.pageRank_ppv(pv, ranks, ws);
 			if (glVars::csentence::disamb_minus_static) {
 				const vector<float> & staticV = kb.static_prank();
 				for(size_t i = 0, n = staticV.size();
@@ -682,41 +941,39 @@ namespace ukb {
 	// (normalized) rank
 	//
 
-	bool calculate_kb_ppv_csentence(CSentence & cs, vector<float> & res) {
+	bool calculate_kb_ppv_csentence(CSentence & cs, vector<float> & res,
+									PrankWorkspace & ws) {
 
 		if (!cs.has_tgtwords()) return false; // no target words
 
 		Kb & kb = ukb::Kb::instance();
-		bool aux;
 
 		// Initialize result vector
 		vector<float> (kb.size(), 0.0).swap(res);
 
-		// Initialize PPV vector
-		vector<float> ppv(kb.size(), 0.0);
+		// PPV vector (sparse)
+		Kb::sparse_pv_t & ppv = ws.pv;
+		ppv.clear();
 
 		vector<CWord>::iterator cw_it = cs.ubegin();
 		vector<CWord>::iterator cw_end = cs.uend();
 		float K = 0.0;
 		for(; cw_it != cw_end; ++cw_it) {
 			for(size_t i = 0; i != cw_it->size(); ++i) {
-				Kb::vertex_descriptor u;
-				tie(u, aux) = kb.get_vertex_by_name(cw_it->syn(i));
-				if (aux) {
-					ppv[u] = cw_it->rank(i);
-					K += cw_it->rank(i);
-				}
+				ppv.push_back(make_pair(cw_it->syn(i), cw_it->rank(i)));
+				K += cw_it->rank(i);
 			}
 		}
 
 		if (K == 0.0) return false;
+		sparse_pv_compact(ppv, false);
 		// Normalize PPV vector
 		float div = 1.0 / K;
-		for(vector<float>::iterator rit = ppv.begin(); rit != ppv.end(); ++rit)
-			*rit *= div;
+		for(Kb::sparse_pv_t::iterator rit = ppv.begin(); rit != ppv.end(); ++rit)
+			rit->second *= div;
 
 		// Execute PageRank
-		kb.pageRank_ppv(ppv, res);
+		kb.pageRank_ppv(ppv, res, ws);
 		return true;
 	}
 
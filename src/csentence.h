@@ -8,10 +8,12 @@
 #include <vector>
 #include <iosfwd>
 #include <boost/graph/graph_traits.hpp>
+#include <boost/utility/string_view.hpp>
 
 namespace ukb {
 
 	class CSentence; // forward declaration
+	class CWIndex;
 
 	class CWord {
 
@@ -45,12 +47,16 @@ namespace ukb {
 			cw_error
 		};
 
-		typedef std::vector<std::string>::const_iterator const_iterator;
-		typedef std::vector<std::string>::iterator iterator;
-		typedef std::vector<std::string>::reference reference;
-		typedef std::vector<std::string>::const_reference const_reference;
-		typedef std::vector<std::string>::value_type value_type;
-		typedef std::vector<std::string>::size_type size_type;
+		// CWord synsets are KB vertices, each with its link weight. Synset
+		// names are only resolved when printing.
+
+		typedef std::vector<std::pair<Kb::vertex_descriptor, float> > syns_t;
+		typedef syns_t::const_iterator const_iterator;
+		typedef syns_t::iterator iterator;
+		typedef syns_t::reference reference;
+		typedef syns_t::const_reference const_reference;
+		typedef syns_t::value_type value_type;
+		typedef syns_t::size_type size_type;
 
 		explicit CWord() : m_weight(1.0), m_linkw_factor(1.0), m_type(cw_error), m_disamb(false) {};
 		CWord(const std::string & w_, const std::string & id, const std::string & pos, cwtype type, float wght_ = 1.0);
@@ -66,14 +72,14 @@ namespace ukb {
 		// set concepts attached to the cword (used in tgt_noppv type cwords)
 		size_t set_concepts(std::map<std::string, float> & C);
 
-		iterator begin() {return m_syns.begin();}
-		iterator end() {return m_syns.end();}
-		const_iterator begin() const {return m_syns.begin();}
-		const_iterator end() const {return m_syns.end();}
+		iterator begin() {return m_V.begin();}
+		iterator end() {return m_V.end();}
+		const_iterator begin() const {return m_V.begin();}
+		const_iterator end() const {return m_V.end();}
 
-		size_type size() const {return m_syns.size(); }
+		size_type size() const {return m_V.size(); }
 
-		const std::string & syn(size_t i) const { return m_syns[i];}
+		Kb::vertex_descriptor syn(size_t i) const { return m_V[i].first;}
 		float rank(size_t i) const { return m_ranks[i];}
 
 		std::string word() const { return m_w; }
@@ -88,7 +94,7 @@ namespace ukb {
 
 		bool is_tgtword() const;
 		bool is_disambiguated() const { return m_disamb; }
-		bool is_monosemous() const { return (1 == m_syns.size()); }
+		bool is_monosemous() const { return (1 == m_V.size()); }
 		bool is_synset() const { return m_type == cw_concept; }
 
 		bool has_concept(const std::string & str);
@@ -96,11 +102,11 @@ namespace ukb {
 		cwtype type() const { return m_type; }
 
 		void empty_synsets();
-		const std::vector<std::pair<Kb::vertex_descriptor, float> > & V_vector() const { return m_V; }
+		const syns_t & V_vector() const { return m_V; }
 
 		template <typename Map>
 		void rank_synsets(Map rankMap, bool use_prior) {
-			size_t n = m_syns.size();
+			size_t n = m_V.size();
 			size_t i;
 			if (!n) return; // No synsets
 			if (rankMap.size() == 0) return; // No ranks
@@ -115,11 +121,11 @@ namespace ukb {
 		void rank_synsets(G & g, Map rankMap) {
 			typename G::vertex_t u;
 			bool P;
-			size_t n = m_syns.size();
+			size_t n = m_V.size();
 			size_t i;
 			if (!n) return; // No synsets
 			for(i = 0; i != n; ++i) {
-				boost::tie(u, P) = g.get_vertex_by_name(m_syns[i]);
+				boost::tie(u, P) = g.get_vertex(m_V[i].first);
 				m_ranks[i] = P ? rankMap[u] : 0.0f;
 			}
 		}
@@ -131,6 +137,7 @@ namespace ukb {
 
 		std::ostream & print_cword(std::ostream & o, const std::string & id) const;
 		friend class CSentence;
+		friend class CWIndex;
 
 		// Debug
 
@@ -147,8 +154,7 @@ namespace ukb {
 		std::string m_id;
 		std::string m_pos; // 'n', 'v', 'a', 'r' or 0 (no pos)
 		float m_weight;     // Initial weight for PPV
-		std::vector<std::string> m_syns;
-		std::vector<std::pair<Kb::vertex_descriptor, float> > m_V;
+		syns_t m_V;
 		std::vector<float> m_ranks;
 		float m_linkw_factor; // 1 / (sum of all link weights)
 		cwtype m_type;
@@ -181,6 +187,12 @@ namespace ukb {
 		size_type size() const {return m_vuniq.size();}
 		size_type has_tgtwords() const { return m_tgtN; }
 		std::string id() const {return m_id;}
+		void set_id(const std::string & id) { m_id = id; }
+
+		// A string identifying the parsed context, regardless of its id and
+		// of the formatting of the input. Contexts with the same key give
+		// the same results.
+		std::string canonical_key() const;
 		float weigth_factor() const { return m_w_factor; }
 
 		void write_to_binfile (const std::string & fName) const;
@@ -190,9 +202,9 @@ namespace ukb {
 		std::ostream & debug(std::ostream & o) const;
 	private:
 
-		void push_ctx(const std::vector<std::string> & ctx);
+		void push_ctx(const std::vector<boost::string_view> & ctx);
 		void push_cw(CWord & new_cw,
-					 std::map<std::string, size_t > & CW,
+					 CWIndex & CW,
 					 bool is_nopv);
 
 		struct cwtoken_t {
@@ -211,25 +223,45 @@ namespace ukb {
 		std::string m_id;
 	};
 
+	// PageRank over the KB. Scratch vectors are taken from ws (by default,
+	// the workspace of the calling thread).
+
 	bool calculate_kb_ppr(const CSentence & cs,
-						  std::vector<float> & res);
+						  std::vector<float> & res,
+						  PrankWorkspace & ws = PrankWorkspace::local());
 
 	bool calculate_kb_ppr_by_word(const CSentence & cs,
 								  CSentence::const_iterator tgtw_it,
-								  std::vector<float> & ranks);
+								  std::vector<float> & ranks,
+								  PrankWorkspace & ws = PrankWorkspace::local());
+
+	// Batched calculate_kb_ppr: ranks[i] and ok[i] get the ranks and the
+	// return value of calculate_kb_ppr for css[i]. The PageRank of the whole
+	// batch is computed at once (see Kb::pageRank_ppv_batch).
+
+	void calculate_kb_ppr_batch(const std::vector<const CSentence *> & css,
+								std::vector<std::vector<float> > & ranks,
+								std::vector<bool> & ok,
+								PrankWorkspace & ws = PrankWorkspace::local());
 
 	int calculate_kb_ppr_by_word_and_disamb(CSentence & cs);
 
-	bool calculate_kb_ppv_csentence(CSentence & cs, std::vector<float> & res);
+	bool calculate_kb_ppv_csentence(CSentence & cs, std::vector<float> & res,
+									PrankWorkspace & ws = PrankWorkspace::local());
 
 	bool disamb_csentence_kb(CSentence & cs,
 							 const std::vector<float> & ranks);
 
 
+	// A string describing the global settings which affect the results of
+	// PageRank over contexts (used as part of cache keys)
+
+	std::string ppr_settings_key();
+
 	// Functions for calculating initial PV given a CSentence
 
 	int pv_from_cs_onlyC(const CSentence & cs,
-						 std::vector<float> & pv,
+						 Kb::sparse_pv_t & pv,
 						 CSentence::const_iterator exclude_word_it);
 
 }
@@ -1,7 +1,6 @@
 #include "disambGraph.h"
 #include "common.h"
 #include "kbGraph.h"
-#include "dfsa.h"
 #include "csentence.h"
 #include "prank.h"
 #include "globalVars.h"
@@ -18,11 +17,6 @@
 #include <ostream>
 
 
-// graphviz
-
-#include <boost/graph/graphviz.hpp>
-#include <boost/graph/filtered_graph.hpp>
-
 // bfs
 
 #include <boost/graph/visitors.hpp>
@@ -37,6 +31,10 @@
 
 #include <boost/graph/graph_utility.hpp> // for boost::make_list
 
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+
 namespace ukb {
 
 	using namespace std;
@@ -47,74 +45,128 @@ namespace ukb {
 	// Disamb fill functions
 
 
-	DisambGraph::DisambGraph() {
+	DisambGraph::DisambGraph() : m_csr_ok(false) {
 	}
 
 	void DisambGraph::add_dgraph_edge(Dis_vertex_t u, Dis_vertex_t v, float w) {
 
-		Dis_edge_t e;
-		bool existP;
-
 		if (u == v)
 			throw runtime_error("Can't insert self loop !");
-
-		map<Kb::vertex_descriptor, Dis_vertex_t>::iterator it;
-
-		tie(e, existP) = edge(u, v, g);
-		if(!existP) {
-			// new edge
-			tie(e, existP) = add_edge(u, v, g);
-			put(edge_weight, g, e, w);
-		} else {
-			// edge already there. Increase freq.
-			put(edge_weight, g, e, get(edge_weight, g, e) + w);
-		}
+		m_triples.push_back(edge_t(u, v, w));
+		m_csr_ok = false;
 	}
 
-	Dis_vertex_t DisambGraph::add_dgraph_vertex(const string & str) {
+	Dis_vertex_t DisambGraph::add_dgraph_vertex(Kb::vertex_descriptor u) {
 
-		boost::unordered_map<string, Dis_vertex_t>::iterator map_it;
+		boost::unordered_map<Kb::vertex_descriptor, Dis_vertex_t>::iterator map_it;
 		bool insertedP;
-		tie(map_it, insertedP) = synsetMap.insert(make_pair(str, Dis_vertex_t()));
+		tie(map_it, insertedP) = m_vmap.insert(make_pair(u, m_kbv.size()));
 		if (insertedP) {
-			Dis_vertex_t v = add_vertex(g);
-			put(vertex_name, g, v, str);
-			map_it->second = v;
+			m_kbv.push_back(u);
+			m_csr_ok = false;
 		}
 		return map_it->second;
 	}
 
-	void DisambGraph::fill_graph(Kb::vertex_descriptor src,
-								 Kb::vertex_descriptor tgt,
-								 const std::vector<Kb::vertex_descriptor> & parents) {
+	void DisambGraph::materialize() const {
 
-		//   if (tgt == 81369) {
-		//     int deb=0;
-		//     deb++;
-		//   }
+		if (m_csr_ok) return;
+
+		// merge repeated edges (in any direction). Weights are added in
+		// insertion order.
+		for(vector<edge_t>::const_iterator it = m_triples.begin(), end = m_triples.end();
+			it != end; ++it) {
+			pair<Dis_vertex_t, Dis_vertex_t> key(std::min(it->u, it->v), std::max(it->u, it->v));
+			boost::unordered_map<pair<Dis_vertex_t, Dis_vertex_t>, size_t>::iterator idx_it;
+			bool insertedP;
+			tie(idx_it, insertedP) = m_edge_idx.insert(make_pair(key, m_edges.size()));
+			if (insertedP) {
+				m_edges.push_back(*it);
+			} else {
+				m_edges[idx_it->second].w += it->w;
+			}
+		}
+		vector<edge_t>().swap(m_triples);
+
+		// CSR, with the edges of every vertex in insertion order
+		size_t N = m_kbv.size();
+		m_offsets.assign(N + 1, 0);
+		for(vector<edge_t>::const_iterator it = m_edges.begin(), end = m_edges.end();
+			it != end; ++it) {
+			++m_offsets[it->u + 1];
+			++m_offsets[it->v + 1];
+		}
+		for(size_t i = 0; i < N; ++i)
+			m_offsets[i + 1] += m_offsets[i];
+		m_adj.resize(m_offsets[N]);
+		m_w.resize(m_offsets[N]);
+		vector<size_t> pos(m_offsets.begin(), m_offsets.end() - 1);
+		for(vector<edge_t>::const_iterator it = m_edges.begin(), end = m_edges.end();
+			it != end; ++it) {
+			size_t i = pos[it->u]++;
+			m_adj[i] = it->v;
+			m_w[i] = it->w;
+			i = pos[it->v]++;
+			m_adj[i] = it->u;
+			m_w[i] = it->w;
+		}
+		m_csr_ok = true;
+	}
+
+	// parents of a multi-source bfs, with the interface of a parents vector
+
+	struct msbfs_parents {
+		msbfs_parents(MsBfsWorkspace & ws, size_t i) : m_ws(ws), m_i(i) {}
+		Kb::vertex_descriptor operator[](Kb::vertex_descriptor v) const { return m_ws.parent(m_i, v); }
+		MsBfsWorkspace & m_ws;
+		size_t m_i;
+	};
+
+	// parents of a dijkstra, with the interface of a parents vector
+
+	struct dijkstra_parents {
+		dijkstra_parents(const DijkstraWorkspace & ws) : m_ws(ws) {}
+		Kb::vertex_descriptor operator[](Kb::vertex_descriptor v) const { return m_ws.parent(v); }
+		const DijkstraWorkspace & m_ws;
+	};
+
+	// path from tgt up to src in the parents tree (empty if tgt was not
+	// reached)
+
+	template<typename Parents>
+	static void tree_path(Kb::vertex_descriptor src,
+						  Kb::vertex_descriptor tgt,
+						  const Parents & parents,
+						  vector<Kb::vertex_descriptor> & path) {
 
-		vector<string> path_str;
 		Kb::vertex_descriptor pred;
-		Kb & kb = ukb::Kb::instance();
 
+		path.clear();
 		pred = parents[tgt];
 		while(tgt != pred) {
-			path_str.push_back(kb.get_vertex_name(tgt));
+			path.push_back(tgt);
 			tgt = pred;
 			pred = parents[tgt];
 		}
-		if (tgt != src) return;
-		path_str.push_back(kb.get_vertex_name(src));
+		if (tgt != src) {
+			path.clear();
+			return;
+		}
+		path.push_back(src);
+	}
+
+	void DisambGraph::add_dgraph_path(const vector<Kb::vertex_descriptor> & path) {
 
 		vector<Dis_vertex_t> path_v;
 		size_t length = 0;
-		for(vector<string>::iterator v_it = path_str.begin();
-			v_it != path_str.end();
+		for(vector<Kb::vertex_descriptor>::const_iterator v_it = path.begin();
+			v_it != path.end();
 			++v_it) {
 			Dis_vertex_t u = add_dgraph_vertex(*v_it);
 			path_v.push_back(u);
 			++length;
 		}
+		if (!length) return;
 
 		vector<Dis_vertex_t>::iterator path_it = path_v.begin();
 		vector<Dis_vertex_t>::iterator path_end = path_v.end();
@@ -129,254 +181,363 @@ namespace ukb {
 		}
 	}
 
+	// add the path from src to tgt in the parents tree
+
+	template<typename Parents>
+	static void fill_graph_path(DisambGraph & dgraph,
+								Kb::vertex_descriptor src,
+								Kb::vertex_descriptor tgt,
+								const Parents & parents) {
+		vector<Kb::vertex_descriptor> path;
+		tree_path(src, tgt, parents, path);
+		dgraph.add_dgraph_path(path);
+	}
+
+	void DisambGraph::fill_graph(Kb::vertex_descriptor src,
+								 Kb::vertex_descriptor tgt,
+								 const std::vector<Kb::vertex_descriptor> & parents) {
+		fill_graph_path(*this, src, tgt, parents);
+	}
+
+	void DisambGraph::fill_graph(Kb::vertex_descriptor src,
+								 Kb::vertex_descriptor tgt,
+								 MsBfsWorkspace & bfs, size_t i) {
+		fill_graph_path(*this, src, tgt, msbfs_parents(bfs, i));
+	}
 
-	void DisambGraph::fill_graph(const set<Kb::edge_descriptor> & E) {
+	void DisambGraph::fill_graph(Kb::vertex_descriptor src,
+								 Kb::vertex_descriptor tgt,
+								 const DijkstraWorkspace & ws) {
+		fill_graph_path(*this, src, tgt, dijkstra_parents(ws));
+	}
+
+
+	void DisambGraph::fill_graph(const vector<Kb::edge_descriptor> & E) {
 		Kb & kb = Kb::instance();
-		for(set<Kb::edge_descriptor>::const_iterator it = E.begin(), end = E.end();
+		for(vector<Kb::edge_descriptor>::const_iterator it = E.begin(), end = E.end();
 			it != end; ++it) {
 			Kb::vertex_descriptor uu = kb.edge_source(*it);
 			Kb::vertex_descriptor vv = kb.edge_target(*it);
 			if (uu == vv) continue;
-			Dis_vertex_t u = add_dgraph_vertex(kb.get_vertex_name(uu));
-			Dis_vertex_t v = add_dgraph_vertex(kb.get_vertex_name(vv));
+			Dis_vertex_t u = add_dgraph_vertex(uu);
+			Dis_vertex_t v = add_dgraph_vertex(vv);
 			add_dgraph_edge(u, v, 1.0);
 		}
 	}
 
 	////////////////////////////////////////////////////////////////////////////////
-	// vertex_id <-> strings
+	// KB vertices <-> vertices
 
+	pair<Dis_vertex_t, bool> DisambGraph::get_vertex(Kb::vertex_descriptor u) const {
+		boost::unordered_map<Kb::vertex_descriptor, Dis_vertex_t>::const_iterator it = m_vmap.find(u);
+		if (it == m_vmap.end()) return make_pair(Dis_vertex_t(), false);
+		return make_pair(it->second, true);
+	}
 
 	pair<Dis_vertex_t, bool> DisambGraph::get_vertex_by_name(const std::string & str) const {
-		boost::unordered_map<string, Dis_vertex_t>::const_iterator it = synsetMap.find(str);
-		if (it == synsetMap.end()) return make_pair(Dis_vertex_t(), false);
-		return make_pair(it->second, true);
+		Kb::vertex_descriptor u;
+		bool P;
+		tie(u, P) = Kb::instance().get_vertex_by_name(str);
+		if (!P) return make_pair(Dis_vertex_t(), false);
+		return get_vertex(u);
 	}
 
 	////////////////////////////////////////////////////////////////////////////////
 	// Reset edge weights
 
 	void DisambGraph::reset_edge_weights() {
-		graph_traits<DisambG>::edge_iterator it, end;
-		tie(it, end) = edges(g);
-		for(;it != end; ++it)
-			put(edge_weight, g, *it, 1.0);
+		materialize();
+		for(vector<edge_t>::iterator it = m_edges.begin(), end = m_edges.end(); it != end; ++it)
+			it->w = 1.0;
+		std::fill(m_w.begin(), m_w.end(), 1.0f);
 	}
 
 	////////////////////////////////////////////////////////////////
 	// Global functions
 
-	void fill_disamb_synset_bfs(const string & src_str,
-								vector<CWord>::const_iterator s_it,
-								vector<CWord>::const_iterator s_end,
-								DisambGraph & dgraph) {
+	// shortest paths from src to the synsets of words [s_it, s_end), the
+	// cost of each edge being the rank of its target
 
-		//bfs from src
-		std::vector<Kb::vertex_descriptor> parents;
-		Kb & kb = ukb::Kb::instance();
-		bool existP;
-		Kb::vertex_descriptor src, tgt;
+	void fill_disamb_synset_dijkstra(Kb::vertex_descriptor src,
+									 vector<CWord>::const_iterator s_it,
+									 vector<CWord>::const_iterator s_end,
+									 const vector<float> & ppv_ranks,
+									 DisambGraph & dgraph) {
 
-		tie(src, existP) = kb.get_vertex_by_name(src_str);
-		assert(existP);
+		Kb & kb = ukb::Kb::instance();
+		DijkstraWorkspace & ws = DijkstraWorkspace::local();
 
-		kb.bfs(src, parents);
+		vector<Kb::vertex_descriptor> targets;
+		for(vector<CWord>::const_iterator it = s_it; it != s_end; ++it) {
+			for(CWord::const_iterator tg_it = it->begin(), tg_end = it->end();
+				tg_it != tg_end; ++tg_it) {
+				targets.push_back(tg_it->first);
+			}
+		}
+		kb.dijkstra(src, targets, ppv_ranks, ws);
 
 		// insert src vertex in dgraph (fixes a bug)
-		dgraph.add_dgraph_vertex(src_str);
+		dgraph.add_dgraph_vertex(src);
 
 		//fill disamb graph
 
-		for(;s_it != s_end; ++s_it) {
-			vector<string>::const_iterator tg_it = s_it->begin();
-			vector<string>::const_iterator tg_end = s_it->end();
-			for(;tg_it != tg_end; ++tg_it) {
-				tie(tgt, existP) = kb.get_vertex_by_name(*tg_it);
-				assert(existP);
-				dgraph.fill_graph(src, tgt, parents);
-			}
+		for(vector<Kb::vertex_descriptor>::const_iterator it = targets.begin(), end = targets.end();
+			it != end; ++it) {
+			dgraph.fill_graph(src, *it, ws);
 		}
 
 	}
 
-	void fill_disamb_synset_dijkstra(const string & src_str,
-									 vector<CWord>::const_iterator s_it,
-									 vector<CWord>::const_iterator s_end,
-									 DisambGraph & dgraph) {
-
-		std::vector<Kb::vertex_descriptor> parents;
-		Kb & kb = ukb::Kb::instance();
-		bool existP;
-		Kb::vertex_descriptor src, tgt;
 
-		tie(src, existP) = kb.get_vertex_by_name(src_str);
-		assert(existP);
+	// Run work(t) for t in [0, T), each in its own thread (t = 0 in the
+	// calling thread).
 
-		kb.dijkstra(src, parents);
-
-		// insert src vertex in dgraph (fixes a bug)
-		dgraph.add_dgraph_vertex(src_str);
+	static void dgraph_run_threads(size_t T, const boost::function<void (size_t)> & work) {
+		boost::thread_group helpers;
+		for(size_t t = 1; t < T; ++t)
+			helpers.create_thread(boost::bind(work, t));
+		try {
+			work(0);
+		} catch (...) {
+			helpers.join_all();
+			throw;
+		}
+		helpers.join_all();
+	}
 
-		//fill disamb graph
+	// Number of threads for n independent searches
+	static size_t dgraph_threads(size_t n) {
+		return std::max<size_t>(1, std::min(glVars::dGraph::threads, n));
+	}
 
-		for(;s_it != s_end; ++s_it) {
-			vector<string>::const_iterator tg_it = s_it->begin();
-			vector<string>::const_iterator tg_end = s_it->end();
-			for(;tg_it != tg_end; ++tg_it) {
-				tie(tgt, existP) = kb.get_vertex_by_name(*tg_it);
-				assert(existP);
-				dgraph.fill_graph(src, tgt, parents);
+	// The bfs from srcs[i] towards *srcs_tgts[i], for the batches of
+	// MsBfsWorkspace::max_sources sources t, t + T, t + 2T ...
+	// paths[i][j] gets the path from the j-th target of srcs[i] up to
+	// srcs[i] (see tree_path).
+
+	typedef vector<vector<Kb::vertex_descriptor> > dgraph_paths_t;
+
+	static void dgraph_bfs_worker(const Kb * kb,
+								  const vector<Kb::vertex_descriptor> * srcs,
+								  const vector<const vector<Kb::vertex_descriptor> *> * srcs_tgts,
+								  vector<MsBfsWorkspace> * ws,
+								  size_t T,
+								  vector<dgraph_paths_t> * paths,
+								  size_t t) {
+		size_t B = MsBfsWorkspace::max_sources;
+		for(size_t b = t * B, m = srcs->size(); b < m; b += T * B) {
+			size_t e = std::min(m, b + B);
+			vector<Kb::vertex_descriptor> b_srcs(srcs->begin() + b, srcs->begin() + e);
+			vector<const vector<Kb::vertex_descriptor> *> b_tgts(srcs_tgts->begin() + b, srcs_tgts->begin() + e);
+			kb->bfs(b_srcs, b_tgts, (*ws)[t], glVars::dGraph::bfs_max_depth);
+			for(size_t i = b; i < e; ++i) {
+				const vector<Kb::vertex_descriptor> & tgts = *(*srcs_tgts)[i];
+				dgraph_paths_t & P = (*paths)[i];
+				P.resize(tgts.size());
+				for(size_t j = 0; j < tgts.size(); ++j)
+					tree_path((*srcs)[i], tgts[j], msbfs_parents((*ws)[t], i - b), P[j]);
 			}
 		}
+	}
 
+	BfsTreeCache & dgraph_tree_cache() {
+		static BfsTreeCache cache(glVars::dGraph::tree_cache << 20, glVars::dGraph::tree_cache_vertices);
+		return cache;
 	}
 
+	// Every synset of every word is a bfs source, and the synsets of the
+	// following words are its targets. The paths of the sources whose
+	// (cached) truncated bfs tree reaches all their targets are taken from
+	// the tree. The searches of the rest run MsBfsWorkspace::max_sources at
+	// a time (the batches shared among glVars::dGraph::threads threads).
+	// Paths are added to dgraph in the same order as with one search per
+	// synset.
 
 	void build_dgraph_bfs(const CSentence &cs, DisambGraph & dgraph) {
 
-		vector<CWord>::const_iterator cw_it = cs.ubegin();
+		const Kb & kb = ukb::Kb::instance();
+
+		vector<CWord>::const_iterator cw_begin = cs.ubegin();
 		vector<CWord>::const_iterator cw_end = cs.uend();
+		size_t wn = cw_end - cw_begin;
+		if (!wn) return;
+
+		// tgts[w]: synsets of the words after w
+		vector<vector<Kb::vertex_descriptor> > tgts(wn);
+		for(size_t w = wn - 1; w > 0; --w) {
+			vector<Kb::vertex_descriptor> & T = tgts[w - 1];
+			for(CWord::const_iterator it = cw_begin[w].begin(), end = cw_begin[w].end();
+				it != end; ++it) {
+				T.push_back(it->first);
+			}
+			T.insert(T.end(), tgts[w].begin(), tgts[w].end());
+		}
 
-		//if (cw_it == cw_end) return;
-		//cw_end--;
-		while(cw_it != cw_end) {
-			vector<string>::const_iterator sset_it = cw_it->begin();
-			vector<string>::const_iterator sset_end = cw_it->end();
-			++cw_it; // point to next word
-			for(;sset_it != sset_end; ++sset_it) {
-				//tie(src_v, existP) = kb.get_vertex_by_name(*sset_it);
-				//assert(existP);
-				fill_disamb_synset_bfs(*sset_it, cw_it, cw_end, dgraph);
+		vector<Kb::vertex_descriptor> srcs;
+		vector<const vector<Kb::vertex_descriptor> *> srcs_tgts;
+		for(size_t w = 0; w < wn; ++w) {
+			for(CWord::const_iterator it = cw_begin[w].begin(), end = cw_begin[w].end();
+				it != end; ++it) {
+				srcs.push_back(it->first);
+				srcs_tgts.push_back(&tgts[w]);
+			}
+		}
+
+		vector<dgraph_paths_t> paths(srcs.size());
+
+		// sources left for the multi-source bfs
+		vector<size_t> left;
+		BfsTreeCache & cache = dgraph_tree_cache();
+		if (cache.capacity()) {
+			BfsWorkspace & bws = BfsWorkspace::local();
+			for(size_t i = 0; i < srcs.size(); ++i) {
+				BfsTreeCache::tree_t tree = cache.get(kb, srcs[i], glVars::dGraph::bfs_max_depth, bws);
+				const vector<Kb::vertex_descriptor> & tgts = *srcs_tgts[i];
+				if (!tree || !tree->covers(tgts)) {
+					left.push_back(i);
+					continue;
+				}
+				paths[i].resize(tgts.size());
+				for(size_t j = 0; j < tgts.size(); ++j)
+					tree_path(srcs[i], tgts[j], *tree, paths[i][j]);
+			}
+		} else {
+			for(size_t i = 0; i < srcs.size(); ++i) left.push_back(i);
+		}
+
+		if (left.size()) {
+			vector<Kb::vertex_descriptor> l_srcs;
+			vector<const vector<Kb::vertex_descriptor> *> l_tgts;
+			for(size_t k = 0; k < left.size(); ++k) {
+				l_srcs.push_back(srcs[left[k]]);
+				l_tgts.push_back(srcs_tgts[left[k]]);
+			}
+			size_t batches = (l_srcs.size() + MsBfsWorkspace::max_sources - 1) / MsBfsWorkspace::max_sources;
+			size_t T = dgraph_threads(batches);
+			vector<MsBfsWorkspace> & ws = MsBfsWorkspace::local(T);
+			vector<dgraph_paths_t> l_paths(l_srcs.size());
+			dgraph_run_threads(T, boost::bind(&dgraph_bfs_worker, &kb, &l_srcs, &l_tgts, &ws, T, &l_paths, _1));
+			for(size_t k = 0; k < left.size(); ++k)
+				paths[left[k]].swap(l_paths[k]);
+		}
+
+		for(size_t i = 0; i < srcs.size(); ++i) {
+			// insert src vertex in dgraph (fixes a bug)
+			dgraph.add_dgraph_vertex(srcs[i]);
+			for(dgraph_paths_t::const_iterator it = paths[i].begin(), end = paths[i].end();
+				it != end; ++it) {
+				dgraph.add_dgraph_path(*it);
 			}
 		}
 	}
 
 	// fill dgraph with ppv ranks
-	// using edge weights in kb derived from ppv_rank
+	// using edge costs derived from ppv_rank (the KB is not modified)
 
 	void build_dgraph_bfs(const CSentence & cs, DisambGraph & dgraph,
 						   const vector<float> & ppv_ranks) {
 
-
-		// First, update kb's edge weights
-		ukb::Kb::instance().ppv_weights(ppv_ranks);
-
 		vector<CWord>::const_iterator cw_it = cs.ubegin();
 		vector<CWord>::const_iterator cw_end = cs.uend();
 
 		//if (cw_it == cw_end) return;
 		//cw_end--;
 		while(cw_it != cw_end) {
-			vector<string>::const_iterator sset_it = cw_it->begin();
-			vector<string>::const_iterator sset_end = cw_it->end();
+			CWord::const_iterator sset_it = cw_it->begin();
+			CWord::const_iterator sset_end = cw_it->end();
 			++cw_it; // point to next word
 			for(;sset_it != sset_end; ++sset_it) {
-				//tie(src_v, existP) = kb.get_vertex_by_name(*sset_it);
-				//assert(existP);
-				fill_disamb_synset_dijkstra(*sset_it, cw_it, cw_end, dgraph);
+				fill_disamb_synset_dijkstra(sset_it->first, cw_it, cw_end, ppv_ranks, dgraph);
 			}
 		}
 	}
 
-	// dfs visitor (should be in kbgraph but ...)
-
-	// implements as dfs with max depth. Here is the main idea (taken form a mail
-	// in boost.users mailing list), due to David Abrahams:
-
-	// It should be pretty easy to see how to a different visitor adaptor, sort of
-	// like time_stamper, which increments a depth count when you discover a
-	// vertex and decrements when you finish it.
-
-	// Then you create a graph adaptor that refers to the depth count, and returns
-	// an empty range for out_edges when the depth reaches your limit.  This
-	// relies on knowing a lot about the structure of the DFS implementation, but
-	// after all, the library documents it, so it should be OK to take advantage
-	// of that.
-
-
-	class dfsa_visitor : public default_dfs_visitor {
-	public:
-		dfsa_visitor(Kb::vertex_descriptor s, const set<Kb::vertex_descriptor> & S, set<Kb::edge_descriptor> & E)
-			: m_s(s), m_S(S), m_E(E), m_P(list<Kb::edge_descriptor> ()), m_S_end(S.end()) {}
-
-		void discover_vertex(Kb::vertex_descriptor u, const dfsa<Kb::boost_graph_t>& ag) {
-			if (u == m_s) return;
-			if (m_S.find(u) == m_S_end) return; // if u not in S, return
-			m_E.insert(m_P.begin(), m_P.end()); // add path to m_E
+	// Depth limited dfs (glVars::dGraph::max_depth) from every synset in
+	// S, towards the rest of S. E[i] gets the edges of the paths from S[i]
+	// (sorted, without repeats). The searches are shared among
+	// glVars::dGraph::threads threads.
+
+	static void dgraph_dfs_worker(const Kb * kb,
+								  const vector<Kb::vertex_descriptor> * S,
+								  vector<DfsWorkspace> * ws,
+								  size_t T,
+								  vector<vector<Kb::edge_descriptor> > * E,
+								  size_t t) {
+		for(size_t i = t; i < S->size(); i += T) {
+			vector<Kb::edge_descriptor> & Ei = (*E)[i];
+			kb->dfs((*S)[i], *S, (*ws)[t], glVars::dGraph::max_depth, Ei);
+			sort(Ei.begin(), Ei.end());
+			Ei.erase(unique(Ei.begin(), Ei.end()), Ei.end());
 		}
+	}
 
-		void finish_vertex(Kb::vertex_descriptor u, const dfsa<Kb::boost_graph_t>& ag) {
-			if (u == m_s) return;
-			const_cast<dfsa<Kb::boost_graph_t>&>(ag).dec_depth(); // decrease depth
-			m_P.pop_back();
-		}
+	static void dgraph_dfs(const vector<Kb::vertex_descriptor> & S,
+						   vector<vector<Kb::edge_descriptor> > & E) {
+		const Kb & kb = Kb::instance();
+		size_t T = dgraph_threads(S.size());
+		vector<DfsWorkspace> & ws = DfsWorkspace::local(T);
+		vector<vector<Kb::edge_descriptor> >(S.size()).swap(E);
+		dgraph_run_threads(T, boost::bind(&dgraph_dfs_worker, &kb, &S, &ws, T, &E, _1));
+	}
 
-		void tree_edge(Kb::edge_descriptor e, const dfsa<Kb::boost_graph_t> & ag) {
-			const_cast<dfsa<Kb::boost_graph_t>&>(ag).inc_depth(); // increase depth
-			m_P.push_back(e);
+	// whether u and v are synsets of the same word. sw has the (synset,
+	// word) pairs, sorted.
+
+	static bool dgraph_cosenses(const vector<pair<Kb::vertex_descriptor, size_t> > & sw,
+								Kb::vertex_descriptor u, Kb::vertex_descriptor v) {
+		typedef vector<pair<Kb::vertex_descriptor, size_t> >::const_iterator It;
+		It u_it = lower_bound(sw.begin(), sw.end(), make_pair(u, size_t(0)));
+		It v_it = lower_bound(sw.begin(), sw.end(), make_pair(v, size_t(0)));
+		while(u_it != sw.end() && u_it->first == u &&
+			  v_it != sw.end() && v_it->first == v) {
+			if (u_it->second == v_it->second) return true;
+			if (u_it->second < v_it->second) ++u_it;
+			else ++v_it;
 		}
-
-	private:
-		Kb::vertex_descriptor m_s;                       // source vertex
-		const set<Kb::vertex_descriptor> & m_S;          // set of target synsets
-		set<Kb::edge_descriptor> & m_E;                  // the result set of edges
-		list<Kb::edge_descriptor> m_P;                   // path of DFS so far
-		set<Kb::vertex_descriptor>::const_iterator m_S_end;
-	};
-
+		return false;
+	}
 
 	void build_dgraph_dfs_nocosenses(const CSentence &cs, DisambGraph & dgraph) {
-		set<Kb::vertex_descriptor> S;
+		vector<Kb::vertex_descriptor> S;
+		vector<pair<Kb::vertex_descriptor, size_t> > sw; // coSenses of each word in sentence
 		Kb & kb = Kb::instance();
-		dfsa<Kb::boost_graph_t> ag(kb.graph(), glVars::dGraph::max_depth);
-		vector<set<Kb::vertex_descriptor> > coSenses; // coSenses of each word in sentence
 
 		// Init S with all target synsets
+		size_t w = 0;
 		for(vector<CWord>::const_iterator cw_it = cs.ubegin(), cw_end = cs.uend();
-			cw_it != cw_end; ++cw_it) {
-			coSenses.push_back(set<Kb::vertex_descriptor>());
-			set<Kb::vertex_descriptor> & coS = coSenses.back();
+			cw_it != cw_end; ++cw_it, ++w) {
 			for(vector<pair<Kb::vertex_descriptor, float> >::const_iterator v_it = cw_it->V_vector().begin(),
 					v_end = cw_it->V_vector().end();
 				v_it != v_end; ++v_it) {
-				S.insert((*v_it).first);
-				coS.insert((*v_it).first);
+				S.push_back((*v_it).first);
+				sw.push_back(make_pair((*v_it).first, w));
 			}
 		}
+		sort(S.begin(), S.end());
+		S.erase(unique(S.begin(), S.end()), S.end());
+		sort(sw.begin(), sw.end());
+
+		vector<vector<Kb::edge_descriptor> > E;
+		dgraph_dfs(S, E);
+		vector<Kb::edge_descriptor> subg;
+		for(size_t i = 0; i < E.size(); ++i)
+			subg.insert(subg.end(), E[i].begin(), E[i].end());
+		sort(subg.begin(), subg.end());
+		subg.erase(unique(subg.begin(), subg.end()), subg.end());
 
-		std::vector<default_color_type> colors(kb.size());
-		typedef color_traits<default_color_type> Color;
-
-		set<Kb::edge_descriptor> subg;
-		for(set<Kb::vertex_descriptor>::iterator it = S.begin(), end = S.end(); it != end; ++it) { // better to start at any S (not just TW_S)
-			fill(colors.begin(), colors.end(), Color::white());
-			dfsa_visitor vis(*it, S, subg);
-			depth_first_visit(ag, *it, vis, &colors[0]);
-		}
 		// Now filter edges and discard (u,v) if they are coSenses
-		set<Kb::edge_descriptor> filtered_subg;
-		for(set<Kb::edge_descriptor>::iterator it = subg.begin(), end = subg.end();
+		vector<Kb::edge_descriptor> filtered_subg;
+		for(vector<Kb::edge_descriptor>::iterator it = subg.begin(), end = subg.end();
 			it != end; ++it) {
-			Kb::vertex_descriptor u = kb.edge_source(*it);
-			Kb::vertex_descriptor v = kb.edge_target(*it);
-			bool ok = true;
-			for(vector<set<Kb::vertex_descriptor> >::iterator coit = coSenses.begin(), coend = coSenses.end();
-				coit != coend; ++coit) {
-				if(coit->count(u) && coit->count(v)) {
-					ok = false;
-					break;
-				}
-			}
-			if (ok) filtered_subg.insert(*it);
+			if (!dgraph_cosenses(sw, kb.edge_source(*it), kb.edge_target(*it)))
+				filtered_subg.push_back(*it);
 		}
 		// fill the disambGraph with new edges
 		dgraph.fill_graph(filtered_subg);
 	}
 
 	void build_dgraph_dfs(const CSentence &cs, DisambGraph & dgraph) {
-		set<Kb::vertex_descriptor> S;
-		Kb & kb = Kb::instance();
-		dfsa<Kb::boost_graph_t> ag(kb.graph(), glVars::dGraph::max_depth);
+		vector<Kb::vertex_descriptor> S;
 
 		// Init S with all target synsets
 		for(vector<CWord>::const_iterator cw_it = cs.ubegin(), cw_end = cs.uend();
@@ -384,58 +545,56 @@ namespace ukb {
 			for(vector<pair<Kb::vertex_descriptor, float> >::const_iterator v_it = cw_it->V_vector().begin(),
 					v_end = cw_it->V_vector().end();
 				v_it != v_end; ++v_it) {
-				S.insert((*v_it).first);
+				S.push_back((*v_it).first);
 			}
 		}
-
-		std::vector<default_color_type> colors(kb.size());
-		typedef color_traits<default_color_type> Color;
-
-		for(set<Kb::vertex_descriptor>::iterator it = S.begin(), end = S.end(); it != end; ++it) {
-			fill(colors.begin(), colors.end(), Color::white());
-			set<Kb::edge_descriptor> subg;
-			dfsa_visitor vis(*it, S, subg);
-			depth_first_visit(ag, *it, vis, &colors[0]);
-			// Now  populate disambGraph with edges in subg
-			dgraph.fill_graph(subg);
-		}
+		sort(S.begin(), S.end());
+		S.erase(unique(S.begin(), S.end()), S.end());
+
+		vector<vector<Kb::edge_descriptor> > E;
+		dgraph_dfs(S, E);
+		// Now populate disambGraph with the edges of every search, in order
+		for(size_t i = 0; i < E.size(); ++i)
+			dgraph.fill_graph(E[i]);
 	}
 
 	// Convert a pv vector of Kb::vertex_descriptor to the equivalent for Dis_vertex_t
 
 	size_t pv_to_dgraph(DisambGraph & dgraph,
-						const vector<float> & pv,
+						const Kb::sparse_pv_t & pv,
 						vector<float> & pv_dgraph) {
 
 		Dis_vertex_t u;
 		bool P;
 		size_t k = 0;
-		Kb & kb = ukb::Kb::instance();
-		for(size_t i = 0, end = pv.size(); i != end; ++i) {
-			if (pv[i] == 0.0) continue;
-			tie(u, P) = dgraph.get_vertex_by_name(kb.get_vertex_name(i));
+		for(Kb::sparse_pv_t::const_iterator it = pv.begin(), end = pv.end();
+			it != end; ++it) {
+			if (it->second == 0.0) continue;
+			tie(u, P) = dgraph.get_vertex(it->first);
 			if (!P) continue;
 			++k;
-			pv_dgraph[u] = pv[i];
+			pv_dgraph[u] = it->second;
 		}
 		return k;
 	}
 
 	bool dgraph_ppr(const CSentence & cs, DisambGraph & dgraph,
 					vector<float> & ranks,
-					CSentence::const_iterator exclude_word_it) {
+					CSentence::const_iterator exclude_word_it,
+					PrankWorkspace & ws) {
 
 		// get pv pointing to Kb::boost_graph_t vertex_t
 		// transform into Dis_vertex_t
 
 		if (!cs.has_tgtwords()) return false; // no target words
 
-		vector<float> pv;
+		Kb::sparse_pv_t & pv = ws.pv;
 		size_t  pv_m = pv_from_cs_onlyC(cs, pv, exclude_word_it);
 		if (!pv_m) return false;
 
 		// create pv_dgraph (map Kb::vertex_descriptor to Dis_vertex_t)
-		vector<float> pv_dgraph(dgraph.size(), 0.0);
+		vector<float> & pv_dgraph = ws.dgraph_pv;
+		pv_dgraph.assign(dgraph.size(), 0.0);
 		size_t pv_dgraph_m = pv_to_dgraph(dgraph, pv, pv_dgraph);
 		if (!pv_dgraph_m) return false;
 
@@ -446,23 +605,26 @@ namespace ukb {
 		}
 
 		// Execute PageRank using pv_dgraph
-		dgraph.pageRank_ppv(pv_dgraph, ranks);
+		dgraph.pageRank_ppv(pv_dgraph, ranks, ws);
 		return true;
 	}
 
 	bool dgraph_ppr(const CSentence & cs, DisambGraph & dgraph,
-							  vector<float> & ranks) {
-		return dgraph_ppr(cs, dgraph, ranks, cs.uend());
+					vector<float> & ranks,
+					PrankWorkspace & ws) {
+		return dgraph_ppr(cs, dgraph, ranks, cs.uend(), ws);
 	}
 
 
 	bool dgraph_static(DisambGraph & dgraph,
-					   vector<float> & ranks) {
+					   vector<float> & ranks,
+					   PrankWorkspace & ws) {
 		size_t N = dgraph.size();
 		if (!N) return false;
 		float factor = 1 / N;
-		vector<float> pv_dgraph(dgraph.size(), factor);
-		dgraph.pageRank_ppv(pv_dgraph, ranks);
+		vector<float> & pv_dgraph = ws.dgraph_pv;
+		pv_dgraph.assign(N, factor);
+		dgraph.pageRank_ppv(pv_dgraph, ranks, ws);
 		return true;
 	}
 
@@ -477,7 +639,8 @@ namespace ukb {
 			vector<float>(N, 0.0).swap(ranks); // Initialize rank vector
 		}
 
-		prank::init_degree(dgraph.graph(), &ranks[0]);
+		for(size_t v = 0; v < N; ++v)
+			ranks[v] = dgraph.degree(v);
 		return true;
 	}
 
@@ -509,23 +672,25 @@ namespace ukb {
 
 		vector<CWord>::iterator cw_it = cs.ubegin();
 		vector<CWord>::iterator cw_end = cs.uend();
-		Dis_vertex_t v;
+		Kb & kb = Kb::instance();
 		bool P;
 
 		for(; cw_it != cw_end; ++cw_it) {
 			o << cw_it->word() << "{";
-			vector<string>::iterator syn_it = cw_it->begin();
-			vector<string>::iterator syn_end = cw_it->end();
+			CWord::iterator syn_it = cw_it->begin();
+			CWord::iterator syn_end = cw_it->end();
 			if (syn_it != syn_end) {
 				--syn_end;
 				for(; syn_it != syn_end; ++syn_it) {
-					tie(v,P) = dgraph.get_vertex_by_name(*syn_it);
+					const string & syn_str = kb.get_vertex_name(syn_it->first);
+					P = dgraph.get_vertex(syn_it->first).second;
 					assert(P);
-					o << *syn_it << " ,";
+					o << syn_str << " ,";
 				}
-				tie(v,P) = dgraph.get_vertex_by_name(*syn_end);
+				const string & syn_str = kb.get_vertex_name(syn_end->first);
+				P = dgraph.get_vertex(syn_end->first).second;
 				assert(P);
-				o << *syn_end;
+				o << syn_str;
 			}
 			o << "}" << endl;
 		}
@@ -536,47 +701,143 @@ namespace ukb {
 	/////////////////////////////////////////////////////////////////////
 	// pageRank
 	//
+	// The same power method as prank::do_pageRank, over the CSR. The graph
+	// is undirected, so the in-edges of a vertex are its out-edges, and no
+	// vertex is dangling.
+
+	struct dgraph_weight_map {
+		dgraph_weight_map(const vector<float> & w) : m_w(w) {}
+		float operator[](size_t i) const { return m_w[i]; }
+		const vector<float> & m_w;
+	};
+
+	struct dgraph_cte_weight_map {
+		float operator[](size_t i) const { return 1.0f; } // always return 1
+	};
+
+	template<typename wMap_t>
+	static size_t dgraph_init_out_coefs(const DisambGraph & dgraph,
+										vector<float> & out_coefs,
+										wMap_t wmap) {
+		const vector<size_t> & offsets = dgraph.offsets();
+		size_t N = 0;
+		for(size_t v = 0, n = dgraph.size(); v < n; ++v) {
+			if (offsets[v] == offsets[v + 1]) {
+				out_coefs[v] = -1.0; // isolated
+				continue;
+			}
+			float total_w = 0.0;
+			for(size_t i = offsets[v]; i < offsets[v + 1]; ++i)
+				total_w += wmap[i];
+			out_coefs[v] = 1.0f / total_w;
+			N++;
+		}
+		return N;
+	}
+
+	template<typename wMap_t>
+	static float dgraph_update_pRank(const DisambGraph & dgraph,
+									 float damping,
+									 const vector<float> & ppv,
+									 const vector<float> & out_coef,
+									 wMap_t wmap,
+									 const float *rank1,
+									 float *rank2) {
+		const vector<size_t> & offsets = dgraph.offsets();
+		const vector<Dis_vertex_t> & adj = dgraph.adjacency();
+		float norm = 0.0;
+		for(size_t v = 0, n = dgraph.size(); v < n; ++v) {
+			if (-1.0 == out_coef[v]) continue;
+			float rank = 0.0;
+			for(size_t i = offsets[v]; i < offsets[v + 1]; ++i) {
+				Dis_vertex_t u = adj[i];
+				rank += rank1[u] * wmap[i] * out_coef[u];
+			}
+			rank2[v] = damping * rank + (1.0 - damping) * ppv[v];
+			norm += fabs(rank2[v] - rank1[v]);
+		}
+		return norm;
+	}
+
+	template<typename wMap_t>
+	static int dgraph_do_pageRank(const DisambGraph & dgraph,
+								  size_t N,
+								  const vector<float> & ppv,
+								  wMap_t wmap,
+								  vector<float> & ranks,
+								  vector<float> & rank_tmp,
+								  int iterations,
+								  float threshold,
+								  float damping,
+								  const vector<float> & out_coef) {
+
+		if (N == 0) return 0;
+		if (iterations == 0 && threshold == 0.0)
+			throw std::runtime_error("prank error: iterations and threshold are set to zero!\n");
+		if (!iterations) iterations = std::numeric_limits<int>::max();
+
+		size_t n = dgraph.size();
+		std::fill(ranks.begin(), ranks.end(), 1.0f/static_cast<float>(N));
+
+		bool to_map_2 = true;
+		float residual = 0.0;
+		int done = 0; // number of iterations
+		while(iterations--) {
+			++done;
+			if (to_map_2)
+				residual = dgraph_update_pRank(dgraph, damping, ppv, out_coef, wmap, &ranks[0], &rank_tmp[0]);
+			else
+				residual = dgraph_update_pRank(dgraph, damping, ppv, out_coef, wmap, &rank_tmp[0], &ranks[0]);
+			to_map_2 = !to_map_2;
+			if (residual < threshold) break;
+		}
+		if (!to_map_2) {
+			for(size_t v = 0; v < n; ++v) ranks[v] = rank_tmp[v];
+		}
+		return done;
+	}
 
 	void DisambGraph::pageRank_ppv(const vector<float> & ppv_map,
-								   vector<float> & ranks) {
+								   vector<float> & ranks,
+								   PrankWorkspace & ws) {
 
-		typedef graph_traits<DisambG>::edge_descriptor edge_descriptor;
-		property_map<DisambGraph::boost_graph_t, edge_weight_t>::type weight_map = get(edge_weight, g);
-		prank::constant_property_map <edge_descriptor, float> cte_weight(1.0); // always return 1
+		double t0 = prank_clock_us();
+		materialize();
 
-		size_t N = num_vertices(g);
+		size_t N = size();
 		size_t N_no_isolated;
-		vector<float> out_coefs(N, 0.0);
+		vector<float> & out_coefs = ws.dgraph_coefs;
+		out_coefs.assign(N, 0.0);
 
 		if (N == ranks.size()) {
 			std::fill(ranks.begin(), ranks.end(), 0.0);
 		} else {
 			vector<float>(N, 0.0).swap(ranks); // Initialize rank vector
 		}
-		vector<float> rank_tmp(N, 0.0);    // auxiliary rank vector
+		vector<float> & rank_tmp = ws.dgraph_tmp; // auxiliary rank vector
+		rank_tmp.assign(N, 0.0);
 
+		int iters;
 		if (glVars::prank::use_weight) {
-			N_no_isolated = prank::init_out_coefs(g,  &out_coefs[0], weight_map);
+			N_no_isolated = dgraph_init_out_coefs(*this, out_coefs, dgraph_weight_map(m_w));
+			iters = dgraph_do_pageRank(*this, N_no_isolated, ppv_map,
+									   dgraph_weight_map(m_w), ranks, rank_tmp,
+									   glVars::prank::num_iterations,
+									   glVars::prank::threshold,
+									   glVars::prank::damping,
+									   out_coefs);
 		} else {
-			N_no_isolated = prank::init_out_coefs(g, &out_coefs[0], cte_weight);
+			N_no_isolated = dgraph_init_out_coefs(*this, out_coefs, dgraph_cte_weight_map());
+			iters = dgraph_do_pageRank(*this, N_no_isolated, ppv_map,
+									   dgraph_cte_weight_map(), ranks, rank_tmp,
+									   glVars::prank::num_iterations,
+									   glVars::prank::threshold,
+									   glVars::prank::damping,
+									   out_coefs);
 		}
-
-		if (glVars::prank::use_weight) {
-			prank::do_pageRank(g, N_no_isolated, &ppv_map[0],
-							   weight_map, &ranks[0], &rank_tmp[0],
-							   glVars::prank::num_iterations,
-							   glVars::prank::threshold,
-							   glVars::prank::damping,
-							   out_coefs);
-		} else {
-			prank::do_pageRank(g, N_no_isolated, &ppv_map[0],
-							   cte_weight, &ranks[0], &rank_tmp[0],
-							   glVars::prank::num_iterations,
-							   glVars::prank::threshold,
-							   glVars::prank::damping,
-							   out_coefs);
-		}
-
+		ws.stats.solves++;
+		ws.stats.iterations += iters;
+		ws.stats.prank_us += prank_clock_us() - t0;
 	}
 
 
@@ -597,140 +858,66 @@ namespace ukb {
 			*it *= coef;
 	}
 
-	template<typename HProp, typename AProp>
-	void hits_update_auth (DisambG & g,
-						   vector<Dis_vertex_t>::iterator vit,
-						   vector<Dis_vertex_t>::iterator end,
-						   HProp hProp, AProp aProp) {
-		// I operation
-		// x^{p} = \sum_{q:(q,p) \in E} w_{qp}*y^{q}
-
-		//typename graph_traits<G>::vertex_iterator vit, end;
-		//tie(vit, end) =  vertices(g);
-		for(; vit != end; ++vit) {
-			float auth = 0;
-			graph_traits<DisambG>::in_edge_iterator e, e_end;
-			tie(e, e_end) = in_edges(*vit, g);
-			for(; e != e_end; ++e) {
-				auth+= get(hProp, source(*e, g)) * get(edge_weight, g, *e);
-			}
-			put(aProp, *vit, auth);
+	// The graph is undirected, so the I and O operations visit the same
+	// edges:
+	//
+	// x^{p} = \sum_{q:(q,p) \in E} w_{qp}*y^{q}
+	// y^{p} = \sum_{q:(p,q) \in E} w_{pq}*x^{q}
+
+	static void hits_update(const DisambGraph & dgraph,
+							const vector<Dis_vertex_t> & V,
+							const vector<float> & from,
+							vector<float> & to) {
+		const vector<size_t> & offsets = dgraph.offsets();
+		const vector<Dis_vertex_t> & adj = dgraph.adjacency();
+		const vector<float> & w = dgraph.weights();
+		for(vector<Dis_vertex_t>::const_iterator it = V.begin(), end = V.end();
+			it != end; ++it) {
+			float r = 0.0;
+			for(size_t i = offsets[*it]; i < offsets[*it + 1]; ++i)
+				r += from[adj[i]] * w[i];
+			to[*it] = r;
 		}
 	}
 
-	template<typename HProp, typename AProp>
-	void hits_update_hub (DisambG & g,
-						  vector<Dis_vertex_t>::iterator vit,
-						  vector<Dis_vertex_t>::iterator end,
-						  HProp hProp, AProp aProp) {
-		// O operation
-		// y^{p} = \sum_{q:(p,q) \in E} w_{pq}*x^{q}
-
-		//typename graph_traits<G>::vertex_iterator vit, end;
-		//tie(vit, end) =  vertices(g);
+	void hits(DisambGraph & dgraph, vector<float> & rank) {
 
-		for(; vit != end; ++vit) {
-			float hub = 0.0;
-			graph_traits<DisambG>::out_edge_iterator e, e_end;
-			tie(e, e_end) = out_edges(*vit, g);
-			for(; e != e_end; ++e) {
-				hub+= get(aProp, target(*e, g)) * get(edge_weight, g, *e);
+		size_t N = dgraph.size();
+		vector<float> aRank(N, 0.0f);
+		vector<float> hRank(N, 0.0f);
+
+		// connected vertices
+		vector<Dis_vertex_t> V;
+		for(Dis_vertex_t v = 0; v < N; ++v)
+			if (dgraph.degree(v)) V.push_back(v);
+		if (V.size()) {
+			float init_v = sqrt((float)V.size())/V.size();
+			for(vector<Dis_vertex_t>::const_iterator it = V.begin(), end = V.end();
+				it != end; ++it) {
+				aRank[*it] = init_v;
+				hRank[*it] = init_v;
+			}
+			for(size_t i = 0; i < 50; ++i) { // 50 iterations
+				hits_update(dgraph, V, hRank, aRank);
+				hits_update(dgraph, V, aRank, hRank);
+				hits_norm(aRank);
+				hits_norm(hRank);
 			}
-			put(hProp, *vit, hub);
-		}
-	}
-
-	template<typename HProp, typename AProp>
-	void hits_init_ranks(DisambG & g,
-						 vector<Dis_vertex_t>::iterator vit,
-						 vector<Dis_vertex_t>::iterator end,
-						 HProp hProp, AProp aProp, size_t n) {
-
-		assert(n);
-		float init_v = sqrt((float)n)/n;
-
-		//graph_traits<DisambG>::vertex_iterator vit, end;
-		//tie(vit, end) =  vertices(g);
-		for(; vit != end; ++vit) {
-			put(aProp, *vit, init_v);
-			put(hProp, *vit, init_v);
-		}
-	}
-
-	void hits_iterate(DisambG & g,
-					  vector<Dis_vertex_t>::iterator vit,
-					  vector<Dis_vertex_t>::iterator end,
-					  vector<float> & hProp,
-					  vector<float> & aProp,
-					  size_t iterations) {
-
-		hits_init_ranks(g, vit, end, &hProp[0], &aProp[0], num_connected_vertices(g));
-		for(size_t i = 0; i<iterations; ++i) {
-			hits_update_auth(g, vit, end, &hProp[0], &aProp[0]);
-			hits_update_hub(g, vit, end, &hProp[0], &aProp[0]);
-			hits_norm(aProp);
-			hits_norm(hProp);
 		}
-	}
-
-	void hits(DisambG & g, vector<float> & rank) {
-
-		vector<float> aRank(num_vertices(g), 0.0f);
-		vector<float> hRank(num_vertices(g), 0.0f);
-
-		vector<Dis_vertex_t> V(num_connected_vertices(g));
-
-		graph_traits<DisambG>::vertex_iterator vIt, vItEnd;
-		tie(vIt, vItEnd) = vertices(g);
-		ukb::copy_if(vIt, vItEnd, V.begin(), vertex_is_connected<DisambG>(g));
-
-		hits_iterate(g, V.begin(), V.end(), hRank, aRank, 50); // 50 iterations
-
-		//vector<Dis_vertex_t>::const_iterator it = V.begin();
-		//vector<Dis_vertex_t>::const_iterator end = V.end();
 		rank.swap(hRank);
 	}
 
 	////////////////////////////////////////////////////////////////
 	// Streaming
 	// Note: uses template functions in common.h
+	//
+	// The format stores the synset names of the vertices, which are
+	// looked up in the KB when reading.
 
 	const size_t magic_id = 0x070517;
 
 	// read
 
-	Dis_vertex_t read_vertex_from_stream(ifstream & is,
-										 DisambG & g) {
-
-		string name;
-
-		read_atom_from_stream(is, name);
-		Dis_vertex_t v = add_vertex(g);
-		put(vertex_name, g, v, name);
-		//  put(vertex_wname, g, v, wname);
-		return v;
-	}
-
-	Dis_edge_t read_edge_from_stream(ifstream & is,
-									 DisambG & g) {
-
-		size_t sIdx;
-		size_t tIdx;
-		float freq;
-		//size_t source;
-		bool insertedP;
-		Dis_edge_t e;
-
-		read_atom_from_stream(is, tIdx);
-		read_atom_from_stream(is, sIdx);
-		read_atom_from_stream(is, freq);
-		tie(e, insertedP) = add_edge(sIdx, tIdx, g);
-		assert(insertedP);
-		put(edge_weight, g, e, freq);
-
-		return e;
-	}
-
 	void DisambGraph::read_from_stream (std::ifstream & is) {
 
 		size_t vertex_n;
@@ -742,15 +929,24 @@ namespace ukb {
 		if(id != magic_id) {
 			cerr << "Error: invalid id (filename is a disambGraph?)" << endl;
 		}
+		boost::unordered_map<string, Dis_vertex_t> synsetMap; // not needed
 		read_map_from_stream(is, synsetMap);
 		read_atom_from_stream(is, id);
 		if(id != magic_id) {
 			cerr << "Error: invalid id after reading maps" << endl;
 		}
 
+		Kb & kb = Kb::instance();
 		read_atom_from_stream(is, vertex_n);
 		for(i=0; i<vertex_n; ++i) {
-			read_vertex_from_stream(is, g);
+			string name;
+			Kb::vertex_descriptor u;
+			bool P;
+			read_atom_from_stream(is, name);
+			tie(u, P) = kb.get_vertex_by_name(name);
+			if (!P)
+				throw runtime_error("[E] reading disambGraph: " + name + " not in KB");
+			add_dgraph_vertex(u);
 		}
 
 		read_atom_from_stream(is, id);
@@ -760,19 +956,20 @@ namespace ukb {
 
 		read_atom_from_stream(is, edge_n);
 		for(i=0; i<edge_n; ++i) {
-			read_edge_from_stream(is, g);
+			size_t sIdx;
+			size_t tIdx;
+			float freq;
+			read_atom_from_stream(is, tIdx);
+			read_atom_from_stream(is, sIdx);
+			read_atom_from_stream(is, freq);
+			m_triples.push_back(edge_t(sIdx, tIdx, freq));
 		}
+		m_csr_ok = false;
 
 		read_atom_from_stream(is, id);
 		if(id != magic_id) {
 			cerr << "Error: invalid id after reading edges" << endl;
 		}
-
-		//   graph_traits<DisambG>::vertex_iterator v_it, v_end;
-		//   tie(v_it, v_end) = vertices(g);
-		//   for(; v_it != v_end; ++v_it) {
-		//     w2syns[get(vertex_name, g, *v_it)] = *v_it;
-		//   }
 	}
 
 	void DisambGraph::read_from_binfile (const string & fname) {
@@ -786,59 +983,39 @@ namespace ukb {
 
 	// write
 
-	ofstream & write_vertex_to_stream(ofstream & o,
-									  const DisambG & g,
-									  const Dis_vertex_t & v) {
-		string name;
-
-		write_atom_to_stream(o, get(vertex_name, g, v));
-		return o;
-	}
-
-	ofstream & write_edge_to_stream(ofstream & o,
-									const DisambG & g,
-									const Dis_edge_t & e) {
-
-		size_t uIdx = get(vertex_index, g, source(e,g));
-		size_t vIdx = get(vertex_index, g, target(e,g));
-		float freq = get(edge_weight, g, e);
-
-		o.write(reinterpret_cast<const char *>(&vIdx), sizeof(vIdx));
-		o.write(reinterpret_cast<const char *>(&uIdx), sizeof(uIdx));
-		o.write(reinterpret_cast<const char *>(&freq), sizeof(freq));
-
-		return o;
-	}
-
 	ofstream & DisambGraph::write_to_stream(ofstream & o) const {
 
+		Kb & kb = Kb::instance();
+
 		// First write maps
 
+		boost::unordered_map<string, Dis_vertex_t> synsetMap;
+		for(size_t v = 0; v < m_kbv.size(); ++v)
+			synsetMap[kb.get_vertex_name(m_kbv[v])] = v;
 		write_atom_to_stream(o, magic_id);
 		write_map_to_stream(o, synsetMap);
 		write_atom_to_stream(o, magic_id);
 
 		// Then the graph
 
-		size_t vertex_n = num_vertices(g);
+		size_t vertex_n = size();
 
 		write_atom_to_stream(o, vertex_n);
-		graph_traits<DisambG>::vertex_iterator v_it, v_end;
-		tie(v_it, v_end) = vertices(g);
-		for(; v_it != v_end; ++v_it) {
-			write_vertex_to_stream(o, g, *v_it);
+		for(size_t v = 0; v < vertex_n; ++v) {
+			write_atom_to_stream(o, kb.get_vertex_name(m_kbv[v]));
 		}
 
 		write_atom_to_stream(o, magic_id);
 
-		size_t edge_n = num_edges(g);
+		const vector<edge_t> & E = edges();
+		size_t edge_n = E.size();
 
 		write_atom_to_stream(o, edge_n);
-		graph_traits<DisambG>::edge_iterator e_it, e_end;
-
-		tie(e_it, e_end) = edges(g);
-		for(; e_it != e_end; ++e_it) {
-			write_edge_to_stream(o, g, *e_it);
+		for(vector<edge_t>::const_iterator it = E.begin(), end = E.end();
+			it != end; ++it) {
+			o.write(reinterpret_cast<const char *>(&it->v), sizeof(it->v));
+			o.write(reinterpret_cast<const char *>(&it->u), sizeof(it->u));
+			o.write(reinterpret_cast<const char *>(&it->w), sizeof(it->w));
 		}
 		return o;
 	}
@@ -854,63 +1031,26 @@ namespace ukb {
 	}
 
 	//////////////////////////////////////////////////////7
-	// graphviz
-
-
-	class myV_writer {
-	public:
-		myV_writer(const DisambG & g_) : g(g_) {};
-		void operator()(std::ostream& out, const Dis_vertex_t & v) const {
-			out << " [label=\"" << get(vertex_name, g, v) << "\"]";
-		}
-		const DisambG & g;
-	};
-
-	class myE_writer {
-	public:
-		myE_writer(const DisambG & g_) : g(g_) {};
-		void operator()(std::ostream& out, const Dis_edge_t & e) const {
-			out << " [weight=\"" << get(edge_weight, g, e) << "\"]";
-		}
-		const DisambG & g;
-	};
-
+	// graphviz (isolated vertices are left out)
 
-	//
-	// Predicate to make a filtered graph
-	//
-
-	template<class G>
-	struct connected_vertex {
-		G * g;
-		connected_vertex( G & g_) : g(&g_) {};
-		connected_vertex( ) {};
-		typedef typename boost::graph_traits<G>::vertex_descriptor vertex_descriptor;
-		bool operator ()(vertex_descriptor u) const {
-			return out_degree(u, *g) || in_degree(u, *g);
-		}
-	};
-
-
-	void write_dgraph_graphviz(const string & fname, DisambG & g) {
+	void write_dgraph_graphviz(const string & fname, const DisambGraph & dgraph) {
 
 		ofstream fo(fname.c_str(), ofstream::out);
 		if (!fo) {
 			cerr << "Can't create " << fname << endl;
 			exit(-1);
 		}
-		connected_vertex<DisambG> vp(g);
-		//   boost::filtered_graph<DisambG, keep_all, keep_all >
-		//     fg(g, keep_all(), keep_all());
-
-		boost::filtered_graph<DisambG, keep_all, connected_vertex<DisambG> >
-			fg(g, keep_all(), vp);
-
-		boost::write_graphviz(fo,
-							  fg,
-							  //boost::default_writer(),
-							  //make_my_writer(get(vertex_name, g), "label"),
-							  make_my_writer(get(vertex_name, g), "label"),
-							  make_my_writer(get(edge_weight, g), "weight"));
+		Kb & kb = Kb::instance();
+		fo << "graph G {\n";
+		for(Dis_vertex_t v = 0; v < dgraph.size(); ++v) {
+			if (!dgraph.degree(v)) continue;
+			fo << v << "[label=\"" << kb.get_vertex_name(dgraph.kb_vertex(v)) << "\"];\n";
+		}
+		const vector<DisambGraph::edge_t> & E = dgraph.edges();
+		for(vector<DisambGraph::edge_t>::const_iterator it = E.begin(), end = E.end();
+			it != end; ++it) {
+			fo << it->u << "--" << it->v << " [weight=\"" << it->w << "\"];\n";
+		}
+		fo << "}\n";
 	}
 }
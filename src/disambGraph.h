@@ -6,85 +6,109 @@
 #include "kbGraph.h"
 #include "csentence.h"
 
-#include <boost/graph/adjacency_list.hpp>
-
-using boost::adjacency_list;
-using boost::graph_traits;
-using boost::property;
-using boost::property_map;
-using boost::vertex_name_t;
-using boost::vertex_name;
-using boost::edge_weight_t;
-using boost::edge_weight;
-
-enum edge_freq_t    { edge_freq };
-
-namespace boost {
-	BOOST_INSTALL_PROPERTY(edge, freq);
-}
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
 
 namespace ukb {
 
-	typedef adjacency_list <
-		boost::listS,
-		boost::vecS,
-		boost::undirectedS,
-		//  boost::bidirectionalS,
-		property<vertex_name_t, std::string>,          // the synset name
-		property<edge_weight_t, float>
-		> DisambG;
+	// The disambiguation graph is an undirected graph over some vertices of
+	// the KB. Its vertices are numbered 0, 1, ... in insertion order, and
+	// are keyed by KB vertex (no names involved).
+	//
+	// Edges are collected as (u, v, w) triples while building the graph,
+	// and materialized once, when first needed, into a compact CSR
+	// adjacency. Repeated edges are merged then, adding their weights. The
+	// neighbours of each vertex keep the order in which their edges were
+	// first inserted.
 
-	typedef graph_traits<DisambG>::vertex_descriptor Dis_vertex_t;
-	typedef graph_traits<DisambG>::edge_descriptor Dis_edge_t;
-	typedef graph_traits<DisambG >::vertices_size_type Dis_vertex_size_t;
+	typedef size_t Dis_vertex_t;
 
 	class DisambGraph {
 
 	public:
 
-		typedef DisambG boost_graph_t; // the underlying graph type
-		typedef graph_traits<DisambG>::vertex_descriptor vertex_t;
-		typedef graph_traits<DisambG>::edge_descriptor edge_t;
-		typedef graph_traits<DisambG >::vertices_size_type vertex_size_t;
+		typedef Dis_vertex_t vertex_t;
 
+		struct edge_t {
+			edge_t(vertex_t u_, vertex_t v_, float w_) : u(u_), v(v_), w(w_) {}
+			vertex_t u;
+			vertex_t v;
+			float w;
+		};
 
 		DisambGraph();
 
-		size_t size() const {return num_vertices(g); }
+		size_t size() const { return m_kbv.size(); }
+		std::pair<Dis_vertex_t, bool> get_vertex(Kb::vertex_descriptor u) const;
 		std::pair<Dis_vertex_t, bool> get_vertex_by_name(const std::string & str) const;
+		Kb::vertex_descriptor kb_vertex(Dis_vertex_t u) const { return m_kbv[u]; }
 
 		void fill_graph(Kb::vertex_descriptor src,
 						Kb::vertex_descriptor tgt,
 						const std::vector<Kb::vertex_descriptor> & parents);
 
-		void fill_graph(const std::set<Kb::edge_descriptor> & E);
+		// Same, with the parents of search i of a multi-source bfs
+		void fill_graph(Kb::vertex_descriptor src,
+						Kb::vertex_descriptor tgt,
+						MsBfsWorkspace & bfs, size_t i);
+
+		// Same, with the parents of the last dijkstra in ws
+		void fill_graph(Kb::vertex_descriptor src,
+						Kb::vertex_descriptor tgt,
+						const DijkstraWorkspace & ws);
+
+		// Add the edges in E (in this order)
+		void fill_graph(const std::vector<Kb::edge_descriptor> & E);
 
-		Dis_vertex_t add_dgraph_vertex(const std::string & str);
+		Dis_vertex_t add_dgraph_vertex(Kb::vertex_descriptor u);
 		void add_dgraph_edge(Dis_vertex_t u, Dis_vertex_t v, float w = 1.0);
+		// Add the vertices of path, and edges between consecutive vertices
+		// (each of weight 1 / number of vertices)
+		void add_dgraph_path(const std::vector<Kb::vertex_descriptor> & path);
 
 		void write_to_binfile (const std::string & fName) const;
 		void read_from_binfile (const std::string & fName);
 
-		DisambG & graph() {return g;}
 		void prune() {}
 		void reset_edge_weights();
 
+		// The materialized graph. edges() has the edges in insertion order.
+		// The neighbours of u are adjacency()[i] (edge weight weights()[i])
+		// for i in [offsets()[u], offsets()[u + 1]).
+
+		const std::vector<edge_t> & edges() const { materialize(); return m_edges; }
+		const std::vector<size_t> & offsets() const { materialize(); return m_offsets; }
+		const std::vector<Dis_vertex_t> & adjacency() const { materialize(); return m_adj; }
+		const std::vector<float> & weights() const { materialize(); return m_w; }
+		size_t degree(Dis_vertex_t u) const { materialize(); return m_offsets[u + 1] - m_offsets[u]; }
+
 
-		// prank
+		// prank (scratch vectors are taken from ws)
 
 		void pageRank_ppv(const std::vector<float> & ppv_map,
-						  std::vector<float> & ranks);
+						  std::vector<float> & ranks,
+						  PrankWorkspace & ws = PrankWorkspace::local());
 
 	private:
 
 		void read_from_stream (std::ifstream & is);
 		std::ofstream & write_to_stream(std::ofstream & o) const;
 
-		//typedef std::vector<Dis_vertex_t> VertexV;
-		//std::map<std::string, VertexV> w2syns;
-		boost::unordered_map<std::string, Dis_vertex_t> synsetMap;
+		// merge the pending triples into m_edges and build the CSR
+		void materialize() const;
+
+		std::vector<Kb::vertex_descriptor> m_kbv;                          // KB vertex of each vertex
+		boost::unordered_map<Kb::vertex_descriptor, Dis_vertex_t> m_vmap; // and the other way round
+
+		mutable std::vector<edge_t> m_triples;  // pending edges
+		mutable std::vector<edge_t> m_edges;    // merged edges
+		mutable boost::unordered_map<std::pair<Dis_vertex_t, Dis_vertex_t>, size_t> m_edge_idx;
 
-		DisambG g;
+		// CSR
+		mutable std::vector<size_t> m_offsets;
+		mutable std::vector<Dis_vertex_t> m_adj;
+		mutable std::vector<float> m_w;
+		mutable bool m_csr_ok;
 	};
 
 	//////////////////////////////////////////////////////////////7
@@ -97,6 +121,10 @@ namespace ukb {
 	void build_dgraph_bfs(const CSentence & cs, DisambGraph & dgraph,
 						  const std::vector<float> & ppv_ranks);
 
+	// Cache of bfs trees of build_dgraph_bfs (glVars::dGraph::tree_cache)
+
+	BfsTreeCache & dgraph_tree_cache();
+
 	// dfs version
 
 	void build_dgraph_dfs(const CSentence &cs, DisambGraph & dgraph);
@@ -112,16 +140,18 @@ namespace ukb {
 
 	// HITS ranking
 
-	void hits(DisambG & g, std::vector<float> & ranks);
+	void hits(DisambGraph & dgraph, std::vector<float> & ranks);
 
 	// PageRank ranking
 
 	bool dgraph_ppr(const CSentence & cs, DisambGraph & dgraph,
 					std::vector<float> & ranks,
-					CSentence::const_iterator exclude_word_it);
+					CSentence::const_iterator exclude_word_it,
+					PrankWorkspace & ws = PrankWorkspace::local());
 
 	bool dgraph_ppr(const CSentence & cs, DisambGraph & dgraph,
-					std::vector<float> & ranks);
+					std::vector<float> & ranks,
+					PrankWorkspace & ws = PrankWorkspace::local());
 
 	// apply ppr to mention graph
 	bool dgraph_mention_ppr(const CSentence & cs, DisambGraph & dgraph,
@@ -134,25 +164,14 @@ namespace ukb {
 	// Static
 
 	bool dgraph_static(DisambGraph & dgraph,
-					   std::vector<float> & ranks);
+					   std::vector<float> & ranks,
+					   PrankWorkspace & ws = PrankWorkspace::local());
 
 
 	std::ostream & print_complete_csent(std::ostream & o, CSentence & cs, DisambGraph & dgraph);
 
 	// export to dot format (graphviz)
 
-	void write_dgraph_graphviz(const std::string & fname, DisambG & g);
-
-	// streaming functions for disambG type graphs
-	Dis_vertex_t read_vertex_from_stream(std::ifstream & is,
-										 DisambG & g);
-	Dis_edge_t read_edge_from_stream(std::ifstream & is,
-									 DisambG & g);
-	std::ofstream & write_vertex_to_stream(std::ofstream & o,
-										   const DisambG & g,
-										   const Dis_vertex_t & v);
-	std::ofstream & write_edge_to_stream(std::ofstream & o,
-										 const DisambG & g,
-										 const Dis_edge_t & e);
+	void write_dgraph_graphviz(const std::string & fname, const DisambGraph & dgraph);
 }
 #endif
@@ -0,0 +1,25 @@
+#!/bin/bash
+
+if [ $# -gt 0 ] ; then
+    ver=$1
+else
+    ver=$(../../compile_kb --version)
+fi
+
+echo $ver
+rootdir=../results/v${ver}
+dir=${rootdir}/main_ppv_server
+install -d $dir
+gbin=$rootdir/graph.bin
+dict=../input/dict.txt
+ctx=../input/ctx.txt
+graphSrc=../input/test_graph.txt
+sock=$(mktemp -u /tmp/ukb_dotest.XXXXXX)
+../../compile_kb -o $gbin ${graphSrc}
+../../ukb_ppv --daemon --socket $sock --nodict_weight --variants -D ${dict} -K $gbin
+# same as main_ppv pos_ files
+../../ukb_ppv --client --socket $sock --prefix pos_ -O $dir ${ctx}
+# no rank is above the threshold: empty PPVs, not errors
+../../ukb_ppv --client --socket $sock --server_threshold 0.9 --prefix empty_ -O $dir ${ctx}
+../../ukb_ppv --client --socket $sock --server_threshold 0.9 --stdout ${ctx} > $dir/empty_stdout.ppv
+../../ukb_ppv --shutdown --socket $sock
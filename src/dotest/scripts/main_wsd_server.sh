@@ -0,0 +1,27 @@
+#!/bin/bash
+
+if [ $# -gt 0 ] ; then
+    ver=$1
+else
+    ver=$(../../compile_kb --version)
+fi
+
+echo $ver
+rootdir=../results/v${ver}
+dir=${rootdir}/main_wsd_server
+install -d $dir
+gbin=$rootdir/graph.bin
+dict=../input/dict.txt
+# contexts differing only in the concepts (or their weights) of a type 3 word
+ctx=../input/ctx_concepts.txt
+graphSrc=../input/test_graph.txt
+sock=$(mktemp -u /tmp/ukb_dotest.XXXXXX)
+../../compile_kb -o $gbin ${graphSrc}
+../../ukb_wsd --nodict_weight --all --ppr -D ${dict} -K $gbin ${ctx} > $dir/wsd_ppr.txt
+../../ukb_wsd --daemon --socket $sock --cache_size 100 --nodict_weight --all --ppr -D ${dict} -K $gbin
+# the cache must not mix up the contexts: same as the local run
+../../ukb_wsd --client --socket $sock ${ctx} > $dir/wsd_ppr_cache.txt
+../../ukb_wsd --shutdown --socket $sock
+if ! cmp -s $dir/wsd_ppr.txt $dir/wsd_ppr_cache.txt ; then
+	echo "[E] main_wsd_server: cached results differ from local ones" >&2
+fi
@@ -92,6 +92,10 @@ namespace ukb {
 		namespace dGraph {
 			int max_depth = 6;
 			bool stopCosenses = false;
+			size_t bfs_max_depth = 0;
+			size_t threads = 1;
+			size_t tree_cache = 0;
+			size_t tree_cache_vertices = 10000;
 		}
 
 		// walk and print
@@ -106,6 +106,10 @@ namespace ukb {
 		namespace dGraph {
 			extern int max_depth;
 			extern bool stopCosenses;
+			extern size_t bfs_max_depth; // 0 means no limit
+			extern size_t threads;       // threads for building dgraphs
+			extern size_t tree_cache;    // MB for caching bfs trees (0 means no cache)
+			extern size_t tree_cache_vertices; // vertices of each cached tree
 		}
 
 		RankAlg get_algEnum(const std::string & alg);
@@ -12,6 +12,7 @@
 #include <map>
 #include <iterator>
 #include <algorithm>
+#include <limits>
 #include <ostream>
 
 // Tokenizer
@@ -41,11 +42,17 @@
 // dijkstra
 
 #include <boost/graph/dijkstra_shortest_paths.hpp>
+#include <boost/graph/detail/d_ary_heap.hpp>
 
 // strong components
 
 #include <boost/graph/strong_components.hpp>
 
+#include <boost/bind.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
 
 namespace ukb {
 
@@ -61,25 +68,78 @@ namespace ukb {
 
 	Kb* Kb::p_instance = 0;
 
-	Kb *Kb::create() {
+	// Versions. p_instance is the current version, owned by current_kb.
+
+	static Kb::version_t current_kb;
+	static boost::mutex current_kb_mutex;
+
+	static void no_cleanup(Kb *) {}
+	static boost::thread_specific_ptr<Kb> pinned_kb(&no_cleanup);
+
+	static size_t kb_generations = 0;
+
+	// Versions are allocated with new, so the once flags must be explicitly
+	// (value) initialized.
 
-		static Kb theKb;
-		return &theKb;
+	Kb::Kb() : m_g(NULL), m_vertexN(0), m_edgeN(0), m_out_coefs_once(), m_static_once() {
+		boost::mutex::scoped_lock lock(current_kb_mutex);
+		m_generation = ++kb_generations;
+	}
+
+	Kb *Kb::create() {
+		return new Kb;
 	}
 
 	Kb & Kb::instance() {
+		Kb *kb = pinned_kb.get();
+		if (kb) return *kb;
 		if (!p_instance) {
 			throw runtime_error("KB not initialized");
 		}
 		return *p_instance;
 	}
 
+	Kb::version_t Kb::current() {
+		boost::mutex::scoped_lock lock(current_kb_mutex);
+		return current_kb;
+	}
+
+	void Kb::set_current(const version_t & kb) {
+		boost::mutex::scoped_lock lock(current_kb_mutex);
+		current_kb = kb;
+		p_instance = kb.get();
+	}
+
+	void Kb::set_current(Kb * kb) {
+		set_current(version_t(kb, &Kb::destroy));
+	}
+
+	Kb * Kb::pin(Kb * kb) {
+		Kb *old = pinned_kb.get();
+		pinned_kb.reset(kb);
+		return old;
+	}
+
+	Kb::version_t Kb::load_binfile(const std::string & fname) {
+
+		if (!fname.size())
+			throw std::runtime_error(string("[E] loading KB: no KB name"));
+
+		ifstream fi(fname.c_str(), ifstream::binary|ifstream::in);
+		if (!fi)
+			throw std::runtime_error(string("[E] loading KB: can not open ") + fname);
+
+		version_t kb(create(), &Kb::destroy);
+		kb->read_from_stream(fi);
+		return kb;
+	}
+
 	void Kb::create_from_txt(const string & synsFileName,
 							 const std::set<std::string> & src_allowed) {
 		if (p_instance) return;
 		Kb *tenp = create();
 		tenp->read_from_txt(synsFileName, src_allowed);
-		p_instance = tenp;
+		set_current(tenp);
 	}
 
 	void Kb::create_from_txt(std::istream & is,
@@ -87,23 +147,13 @@ namespace ukb {
 		if (p_instance) return;
 		Kb *tenp = create();
 		tenp->read_from_txt(is, src_allowed);
-		p_instance = tenp;
+		set_current(tenp);
 	}
 
 	void Kb::create_from_binfile(const std::string & fname) {
 
 		if (p_instance) return;
-		Kb *tenp = create();
-
-		if (!fname.size())
-			throw std::runtime_error(string("[E] loading KB: no KB name"));
-
-		ifstream fi(fname.c_str(), ifstream::binary|ifstream::in);
-		if (!fi)
-			throw std::runtime_error(string("[E] loading KB: can not open ") + fname);
-
-		tenp->read_from_stream(fi);
-		p_instance = tenp;
+		set_current(load_binfile(fname));
 	}
 
 
@@ -145,7 +195,7 @@ namespace ukb {
 		tenp->m_notes.push_back("--");
 		tenp->m_notes.push_back("converted_to_2.0");
 
-		p_instance = tenp;
+		set_current(tenp);
 	}
 
 
@@ -209,6 +259,737 @@ namespace ukb {
 	}
 
 
+	void BfsWorkspace::new_search(size_t m) {
+		if (visited.size() != m || search == std::numeric_limits<unsigned int>::max()) {
+			// new graph, or search numbers exhausted
+			vector<unsigned int>(m, 0).swap(visited);
+			vector<unsigned int>(m, 0).swap(target);
+			parents.resize(m);
+			search = 0;
+		}
+		++search;
+		queue.clear();
+	}
+
+	BfsWorkspace & BfsWorkspace::local() {
+		static boost::thread_specific_ptr<BfsWorkspace> ws;
+		if (!ws.get()) ws.reset(new BfsWorkspace);
+		return *ws;
+	}
+
+	size_t Kb::bfs(Kb::vertex_descriptor src,
+				   const std::vector<Kb::vertex_descriptor> & targets,
+				   BfsWorkspace & ws, size_t max_depth) const {
+
+		ws.new_search(num_vertices(*m_g));
+		unsigned int s = ws.search;
+		size_t targetN = 0;
+		for(vector<Kb::vertex_descriptor>::const_iterator it = targets.begin(), end = targets.end();
+			it != end; ++it) {
+			if (ws.target[*it] == s) continue;
+			ws.target[*it] = s;
+			++targetN;
+		}
+
+		ws.visited[src] = s;
+		ws.parents[src] = src;
+		ws.queue.push_back(src);
+		size_t left = targetN;
+		if (ws.target[src] == s) --left;
+
+		// Same visiting order as breadth_first_search. Vertices
+		// queue[head, level_end) are depth edges away from src.
+		size_t head = 0;
+		size_t level_end = 1;
+		size_t depth = 0;
+		while(left && head < ws.queue.size()) {
+			if (head == level_end) {
+				++depth;
+				level_end = ws.queue.size();
+			}
+			if (max_depth && depth == max_depth) break;
+			Kb::vertex_descriptor u = ws.queue[head++];
+			graph_traits<Kb::boost_graph_t>::out_edge_iterator it, end;
+			for(tie(it, end) = out_edges(u, *m_g); it != end; ++it) {
+				Kb::vertex_descriptor v = target(*it, *m_g);
+				if (ws.visited[v] == s) continue;
+				ws.visited[v] = s;
+				ws.parents[v] = u;
+				ws.queue.push_back(v);
+				if (ws.target[v] == s && !--left) break;
+			}
+		}
+		return targetN - left;
+	}
+
+	bool Kb::bfs_tree(Kb::vertex_descriptor src, BfsWorkspace & ws,
+					  size_t max_depth, size_t max_vertices) const {
+
+		ws.new_search(num_vertices(*m_g));
+		unsigned int s = ws.search;
+
+		ws.visited[src] = s;
+		ws.parents[src] = src;
+		ws.queue.push_back(src);
+
+		// as in the targeted bfs
+		size_t head = 0;
+		size_t level_end = 1;
+		size_t depth = 0;
+		while(head < ws.queue.size()) {
+			if (head == level_end) {
+				++depth;
+				level_end = ws.queue.size();
+			}
+			if (max_depth && depth == max_depth) break;
+			Kb::vertex_descriptor u = ws.queue[head++];
+			graph_traits<Kb::boost_graph_t>::out_edge_iterator it, end;
+			for(tie(it, end) = out_edges(u, *m_g); it != end; ++it) {
+				Kb::vertex_descriptor v = target(*it, *m_g);
+				if (ws.visited[v] == s) continue;
+				if (max_vertices && ws.queue.size() == max_vertices) return false;
+				ws.visited[v] = s;
+				ws.parents[v] = u;
+				ws.queue.push_back(v);
+			}
+		}
+		return true;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Bfs tree cache
+
+	BfsTree::BfsTree(const Kb & kb, Kb::vertex_descriptor s, size_t depth,
+					 size_t max_vertices, BfsWorkspace & ws) : src(s), max_depth(depth) {
+		complete = kb.bfs_tree(src, ws, max_depth, max_vertices);
+		parents.reserve(ws.queue.size());
+		for(size_t i = 0; i < ws.queue.size(); ++i) {
+			Kb::vertex_descriptor v = ws.queue[i];
+			parents.push_back(std::make_pair(v, ws.parents[v]));
+		}
+		std::sort(parents.begin(), parents.end());
+	}
+
+	bool BfsTree::contains(Kb::vertex_descriptor v) const {
+		vector<vp_t>::const_iterator it = std::lower_bound(parents.begin(), parents.end(), vp_t(v, 0));
+		return it != parents.end() && it->first == v;
+	}
+
+	Kb::vertex_descriptor BfsTree::operator[](Kb::vertex_descriptor v) const {
+		vector<vp_t>::const_iterator it = std::lower_bound(parents.begin(), parents.end(), vp_t(v, 0));
+		if (it == parents.end() || it->first != v) return v;
+		return it->second;
+	}
+
+	bool BfsTree::covers(const std::vector<Kb::vertex_descriptor> & targets) const {
+		if (complete) return true;
+		for(vector<Kb::vertex_descriptor>::const_iterator it = targets.begin(), end = targets.end();
+			it != end; ++it) {
+			if (!contains(*it)) return false;
+		}
+		return true;
+	}
+
+	size_t BfsTree::bytes() const {
+		return sizeof(BfsTree) + parents.capacity() * sizeof(vp_t);
+	}
+
+	BfsTreeCache::BfsTreeCache(size_t capacity, size_t max_vertices)
+		: m_capacity(capacity), m_max_vertices(max_vertices), m_bytes(0), m_kb_generation(0),
+		  m_hits(0), m_misses(0) {}
+
+	BfsTreeCache::tree_t BfsTreeCache::get(const Kb & kb, Kb::vertex_descriptor src,
+										   size_t max_depth, BfsWorkspace & ws) {
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			if (m_kb_generation != kb.generation()) {
+				m_map.clear();
+				m_lru.clear();
+				m_seen.clear();
+				m_bytes = 0;
+				m_kb_generation = kb.generation();
+			}
+			map_t::iterator it = m_map.find(src);
+			if (it != m_map.end() && (*it->second)->max_depth == max_depth) {
+				m_lru.splice(m_lru.begin(), m_lru, it->second); // most recent
+				++m_hits;
+				return *it->second;
+			}
+			++m_misses;
+			if (!m_capacity) return tree_t();
+			if (m_seen.insert(src).second) {
+				// first time. Forget about old ones every now and then.
+				if (m_seen.size() > seen_max) {
+					m_seen.clear();
+					m_seen.insert(src);
+				}
+				return tree_t();
+			}
+			m_seen.erase(src);
+		}
+		// build it unlocked
+		tree_t tree(new BfsTree(kb, src, max_depth, m_max_vertices, ws));
+		boost::mutex::scoped_lock lock(m_mutex);
+		if (m_kb_generation != kb.generation()) return tree;
+		map_t::iterator it = m_map.find(src);
+		if (it != m_map.end()) {
+			m_bytes -= (*it->second)->bytes();
+			m_lru.erase(it->second);
+			m_map.erase(it);
+		}
+		m_lru.push_front(tree);
+		m_map[src] = m_lru.begin();
+		m_bytes += tree->bytes();
+		shrink();
+		return tree;
+	}
+
+	void BfsTreeCache::clear() {
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_map.clear();
+		m_lru.clear();
+		m_seen.clear();
+		m_bytes = 0;
+	}
+
+	void BfsTreeCache::stats(std::ostream & o, const std::string & prefix) {
+		boost::mutex::scoped_lock lock(m_mutex);
+		o << prefix << "_hits " << m_hits << "\n"
+		  << prefix << "_misses " << m_misses << "\n"
+		  << prefix << "_size " << m_map.size() << "\n"
+		  << prefix << "_bytes " << m_bytes << "\n"
+		  << prefix << "_capacity " << m_capacity << "\n";
+	}
+
+	void BfsTreeCache::shrink() {
+		while(m_bytes > m_capacity) {
+			m_bytes -= m_lru.back()->bytes();
+			m_map.erase(m_lru.back()->src);
+			m_lru.pop_back();
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Landmark index
+
+	// Hop distances from src (or to src, if backward) to every vertex, left
+	// in D[v*k + i]
+
+	static void landmark_bfs(const Kb::boost_graph_t & g, Kb::vertex_descriptor src, bool backward,
+							 size_t i, size_t k, vector<boost::uint16_t> & D,
+							 vector<Kb::vertex_descriptor> & queue) {
+		queue.clear();
+		queue.push_back(src);
+		D[src*k + i] = 0;
+		for(size_t head = 0; head < queue.size(); ++head) {
+			Kb::vertex_descriptor u = queue[head];
+			unsigned int d = D[u*k + i] + 1;
+			if (d >= Kb::landmark_inf)
+				throw runtime_error("[E] landmarks: paths too long");
+			if (backward) {
+				graph_traits<Kb::boost_graph_t>::in_edge_iterator it, end;
+				for(tie(it, end) = in_edges(u, g); it != end; ++it) {
+					Kb::vertex_descriptor v = source(*it, g);
+					if (D[v*k + i] != Kb::landmark_inf) continue;
+					D[v*k + i] = d;
+					queue.push_back(v);
+				}
+			} else {
+				graph_traits<Kb::boost_graph_t>::out_edge_iterator it, end;
+				for(tie(it, end) = out_edges(u, g); it != end; ++it) {
+					Kb::vertex_descriptor v = target(*it, g);
+					if (D[v*k + i] != Kb::landmark_inf) continue;
+					D[v*k + i] = d;
+					queue.push_back(v);
+				}
+			}
+		}
+	}
+
+	void Kb::build_landmarks(size_t k, landmark_method_t method) {
+
+		size_t n = m_vertexN;
+		vector<size_t> degree(n);
+		size_t candidates = 0;
+		for(size_t v = 0; v < n; ++v) {
+			degree[v] = in_degree(v, *m_g) + out_degree(v, *m_g);
+			if (degree[v]) ++candidates;
+		}
+		// isolated vertices are useless as landmarks
+		if (k > candidates) k = candidates;
+
+		vector<Kb::vertex_descriptor> L;
+		vector<boost::uint16_t> from(n * k, landmark_inf);
+		vector<boost::uint16_t> to(n * k, landmark_inf);
+		vector<Kb::vertex_descriptor> queue;
+		// distance to the closest landmark (landmarks_farthest)
+		vector<unsigned int> closest(n, landmark_inf);
+
+		if (method == landmarks_degree) {
+			vector<Kb::vertex_descriptor> V(n);
+			for(size_t v = 0; v < n; ++v) V[v] = v;
+			for(size_t i = 0; i < k; ++i) {
+				// highest degree first, ties by vertex id
+				size_t best = i;
+				for(size_t j = i + 1; j < n; ++j) {
+					if (degree[V[j]] > degree[V[best]]) best = j;
+				}
+				std::swap(V[i], V[best]);
+				L.push_back(V[i]);
+			}
+		}
+		for(size_t i = 0; i < k; ++i) {
+			if (method == landmarks_farthest) {
+				// the first is the vertex of highest degree
+				Kb::vertex_descriptor best = n;
+				for(size_t v = 0; v < n; ++v) {
+					if (!degree[v] || !closest[v]) continue;
+					if (best == n || closest[v] > closest[best] ||
+						(closest[v] == closest[best] && degree[v] > degree[best])) best = v;
+				}
+				if (best == n) break; // every vertex is a landmark
+				L.push_back(best);
+			}
+			landmark_bfs(*m_g, L[i], false, i, k, from, queue);
+			landmark_bfs(*m_g, L[i], true, i, k, to, queue);
+			if (method != landmarks_farthest) continue;
+			for(size_t v = 0; v < n; ++v) {
+				unsigned int d = std::min(from[v*k + i], to[v*k + i]);
+				if (d < closest[v]) closest[v] = d;
+			}
+		}
+		if (L.size() < k) {
+			// shrink rows to L.size() distances
+			size_t m = L.size();
+			for(size_t v = 0; v < n; ++v) {
+				for(size_t i = 0; i < m; ++i) {
+					from[v*m + i] = from[v*k + i];
+					to[v*m + i] = to[v*k + i];
+				}
+			}
+			from.resize(n * m);
+			to.resize(n * m);
+		}
+		m_landmarks.swap(L);
+		m_lm_from.swap(from);
+		m_lm_to.swap(to);
+	}
+
+	unsigned int Kb::landmark_lower(Kb::vertex_descriptor u, Kb::vertex_descriptor v) const {
+		size_t k = m_landmarks.size();
+		if (!k) return 0;
+		const boost::uint16_t *fu = &m_lm_from[u*k];
+		const boost::uint16_t *fv = &m_lm_from[v*k];
+		const boost::uint16_t *tu = &m_lm_to[u*k];
+		const boost::uint16_t *tv = &m_lm_to[v*k];
+		unsigned int lb = 0;
+		for(size_t i = 0; i < k; ++i) {
+			// d(L, v) <= d(L, u) + d(u, v)
+			if (fu[i] != landmark_inf) {
+				if (fv[i] == landmark_inf) return landmark_inf;
+				if (fv[i] > fu[i] + lb) lb = fv[i] - fu[i];
+			}
+			// d(u, L) <= d(u, v) + d(v, L)
+			if (tv[i] != landmark_inf) {
+				if (tu[i] == landmark_inf) return landmark_inf;
+				if (tu[i] > tv[i] + lb) lb = tu[i] - tv[i];
+			}
+		}
+		return lb;
+	}
+
+	void PathWorkspace::new_search(size_t m) {
+		if (fwd_seen.size() != m || search == std::numeric_limits<unsigned int>::max()) {
+			// new graph, or search numbers exhausted
+			vector<unsigned int>(m, 0).swap(fwd_seen);
+			vector<unsigned int>(m, 0).swap(bwd_seen);
+			vector<unsigned int>(m, 0).swap(on_path);
+			fwd_depth.resize(m);
+			bwd_depth.resize(m);
+			path_depth.resize(m);
+			search = 0;
+		}
+		++search;
+		fwd_front.clear();
+		bwd_front.clear();
+		meet.clear();
+		fwd_d = 0;
+		bwd_d = 0;
+	}
+
+	PathWorkspace & PathWorkspace::local() {
+		static boost::thread_specific_ptr<PathWorkspace> ws;
+		if (!ws.get()) ws.reset(new PathWorkspace);
+		return *ws;
+	}
+
+	void Kb::path_expand(bool backward, PathWorkspace & ws) const {
+
+		unsigned int s = ws.search;
+		vector<unsigned int> & seen = backward ? ws.bwd_seen : ws.fwd_seen;
+		vector<unsigned int> & depth = backward ? ws.bwd_depth : ws.fwd_depth;
+		const vector<unsigned int> & other_seen = backward ? ws.fwd_seen : ws.bwd_seen;
+		vector<Kb::vertex_descriptor> & front = backward ? ws.bwd_front : ws.fwd_front;
+		unsigned int d = (backward ? ++ws.bwd_d : ++ws.fwd_d);
+
+		ws.next_front.clear();
+		for(size_t i = 0; i < front.size(); ++i) {
+			if (backward) {
+				graph_traits<Kb::boost_graph_t>::in_edge_iterator it, end;
+				for(tie(it, end) = in_edges(front[i], *m_g); it != end; ++it) {
+					Kb::vertex_descriptor w = source(*it, *m_g);
+					if (seen[w] == s) continue;
+					seen[w] = s;
+					depth[w] = d;
+					ws.next_front.push_back(w);
+					if (other_seen[w] == s) ws.meet.push_back(w);
+				}
+			} else {
+				graph_traits<Kb::boost_graph_t>::out_edge_iterator it, end;
+				for(tie(it, end) = out_edges(front[i], *m_g); it != end; ++it) {
+					Kb::vertex_descriptor w = target(*it, *m_g);
+					if (seen[w] == s) continue;
+					seen[w] = s;
+					depth[w] = d;
+					ws.next_front.push_back(w);
+					if (other_seen[w] == s) ws.meet.push_back(w);
+				}
+			}
+		}
+		front.swap(ws.next_front);
+	}
+
+	// No path is shorter than the depths of both sides plus one until some
+	// vertex is seen from both sides. Then, the vertices seen from both
+	// sides (those in the last level) are the vertices of shortest paths at
+	// that distance from u. Shortest paths are traced back from them to
+	// both ends, and the path is chosen from u onwards, taking the first
+	// out edge which follows some shortest path at each step (which is
+	// what the bfs tree does).
+
+	bool Kb::shortest_path(Kb::vertex_descriptor u, Kb::vertex_descriptor v,
+						   std::vector<Kb::vertex_descriptor> & path,
+						   PathWorkspace & ws) const {
+
+		path.clear();
+		if (u == v) {
+			path.push_back(u);
+			return true;
+		}
+		// v not reachable from u. Otherwise the search would go through
+		// all the vertices reachable from u (or which reach v).
+		if (landmark_lower(u, v) == landmark_inf) return false;
+
+		ws.new_search(num_vertices(*m_g));
+		unsigned int s = ws.search;
+		ws.fwd_seen[u] = s;
+		ws.fwd_depth[u] = 0;
+		ws.fwd_front.push_back(u);
+		ws.bwd_seen[v] = s;
+		ws.bwd_depth[v] = 0;
+		ws.bwd_front.push_back(v);
+		while(ws.meet.empty()) {
+			if (ws.fwd_front.empty() || ws.bwd_front.empty()) return false;
+			bool backward = ws.bwd_front.size() < ws.fwd_front.size();
+			path_expand(backward, ws);
+		}
+		unsigned int D = ws.fwd_d + ws.bwd_d;
+
+		// Trace back the shortest paths through the meeting vertices
+		vector<Kb::vertex_descriptor> & Q = ws.next_front;
+		Q.clear();
+		for(size_t i = 0; i < ws.meet.size(); ++i) {
+			Kb::vertex_descriptor w = ws.meet[i];
+			ws.on_path[w] = s;
+			ws.path_depth[w] = ws.fwd_depth[w];
+			Q.push_back(w);
+		}
+		for(size_t i = 0; i < Q.size(); ++i) {
+			Kb::vertex_descriptor x = Q[i];
+			unsigned int d = ws.path_depth[x];
+			if (ws.fwd_seen[x] == s && ws.fwd_depth[x] == d && d) {
+				// towards u
+				graph_traits<Kb::boost_graph_t>::in_edge_iterator it, end;
+				for(tie(it, end) = in_edges(x, *m_g); it != end; ++it) {
+					Kb::vertex_descriptor y = source(*it, *m_g);
+					if (ws.on_path[y] == s || ws.fwd_seen[y] != s || ws.fwd_depth[y] != d - 1) continue;
+					ws.on_path[y] = s;
+					ws.path_depth[y] = d - 1;
+					Q.push_back(y);
+				}
+			}
+			if (ws.bwd_seen[x] == s && ws.bwd_depth[x] == D - d && d != D) {
+				// towards v
+				graph_traits<Kb::boost_graph_t>::out_edge_iterator it, end;
+				for(tie(it, end) = out_edges(x, *m_g); it != end; ++it) {
+					Kb::vertex_descriptor y = target(*it, *m_g);
+					if (ws.on_path[y] == s || ws.bwd_seen[y] != s || ws.bwd_depth[y] != D - d - 1) continue;
+					ws.on_path[y] = s;
+					ws.path_depth[y] = d + 1;
+					Q.push_back(y);
+				}
+			}
+		}
+
+		path.push_back(u);
+		for(unsigned int d = 1; d <= D; ++d) {
+			graph_traits<Kb::boost_graph_t>::out_edge_iterator it, end;
+			for(tie(it, end) = out_edges(path.back(), *m_g); it != end; ++it) {
+				Kb::vertex_descriptor y = target(*it, *m_g);
+				if (ws.on_path[y] == s && ws.path_depth[y] == d) break;
+			}
+			assert(it != end);
+			path.push_back(target(*it, *m_g));
+		}
+		return true;
+	}
+
+	void DfsWorkspace::new_search(size_t m) {
+		if (visited.size() != m || search == std::numeric_limits<unsigned int>::max()) {
+			// new graph, or search numbers exhausted
+			vector<unsigned int>(m, 0).swap(visited);
+			vector<unsigned int>(m, 0).swap(target);
+			search = 0;
+		}
+		++search;
+		path.clear();
+		stack.clear();
+	}
+
+	std::vector<DfsWorkspace> & DfsWorkspace::local(size_t n) {
+		static boost::thread_specific_ptr<std::vector<DfsWorkspace> > ws;
+		if (!ws.get()) ws.reset(new std::vector<DfsWorkspace>);
+		if (ws->size() < n) ws->resize(n);
+		return *ws;
+	}
+
+	size_t Kb::dfs(Kb::vertex_descriptor src,
+				   const std::vector<Kb::vertex_descriptor> & targets,
+				   DfsWorkspace & ws, size_t max_depth,
+				   std::vector<Kb::edge_descriptor> & E) const {
+
+		ws.new_search(num_vertices(*m_g));
+		unsigned int s = ws.search;
+		for(vector<Kb::vertex_descriptor>::const_iterator it = targets.begin(), end = targets.end();
+			it != end; ++it) {
+			ws.target[*it] = s;
+		}
+
+		// Same visiting order as depth_first_visit. ws.stack has the out
+		// edges left of every vertex in the path, ws.path the edges of the
+		// path. Vertices at max_depth get no out edges.
+		size_t reached = 0;
+		ws.visited[src] = s;
+		ws.stack.push_back(out_edges(src, *m_g));
+		while(!ws.stack.empty()) {
+			std::pair<Kb::out_edge_iterator, Kb::out_edge_iterator> & edges = ws.stack.back();
+			if (edges.first == edges.second) {
+				// vertex finished
+				ws.stack.pop_back();
+				if (!ws.path.empty()) ws.path.pop_back();
+				continue;
+			}
+			Kb::edge_descriptor e = *edges.first;
+			++edges.first;
+			Kb::vertex_descriptor v = target(e, *m_g);
+			if (ws.visited[v] == s) continue;
+			ws.visited[v] = s;
+			ws.path.push_back(e);
+			if (ws.target[v] == s) {
+				E.insert(E.end(), ws.path.begin(), ws.path.end());
+				++reached;
+			}
+			if (max_depth && ws.path.size() >= max_depth) {
+				ws.path.pop_back();
+				continue;
+			}
+			ws.stack.push_back(out_edges(v, *m_g));
+		}
+		return reached;
+	}
+
+	void MsBfsWorkspace::new_search(const Kb * kb, size_t n) {
+		size_t m = num_vertices(*kb->m_g);
+		if (seen.size() != m) {
+			// new graph
+			vector<mask_t>(m, 0).swap(seen);
+			vector<mask_t>(m, 0).swap(visit);
+			vector<mask_t>(m, 0).swap(next);
+			vector<mask_t>(m, 0).swap(target);
+		} else {
+			for(vector<Kb::vertex_descriptor>::const_iterator it = touched.begin(), end = touched.end();
+				it != end; ++it) {
+				seen[*it] = 0;
+			}
+		}
+		touched.clear();
+		if (depths.size() < m * n) depths.resize(m * n);
+		width = n;
+		m_kb = kb;
+		frontier.clear();
+		next_frontier.clear();
+		m_trees.resize(n);
+		for(size_t i = 0; i < n; ++i) m_trees[i].clear();
+	}
+
+	MsBfsWorkspace & MsBfsWorkspace::local() {
+		return local(1)[0];
+	}
+
+	std::vector<MsBfsWorkspace> & MsBfsWorkspace::local(size_t n) {
+		static boost::thread_specific_ptr<std::vector<MsBfsWorkspace> > ws;
+		if (!ws.get()) ws.reset(new std::vector<MsBfsWorkspace>);
+		if (ws->size() < n) ws->resize(n);
+		return *ws;
+	}
+
+	// In a bfs from a single source, a vertex v at depth d is found by the
+	// first vertex at depth d - 1 in the bfs queue with an edge to v. The
+	// queue has the vertices of each depth ordered by the position of their
+	// parents, and then by the index of the edge from the parent.
+
+	const MsBfsWorkspace::tree_node_t & MsBfsWorkspace::tree_node(size_t i, Kb::vertex_descriptor v) {
+		tree_t::iterator it = m_trees[i].find(v);
+		if (it != m_trees[i].end()) return it->second;
+		const Kb::boost_graph_t & g = graph();
+		size_t d = depth(i, v);
+		tree_node_t node;
+		node.parent = v;
+		node.edge = 0;
+		if (d) {
+			bool found = false;
+			graph_traits<Kb::boost_graph_t>::in_edge_iterator e_it, e_end;
+			for(tie(e_it, e_end) = in_edges(v, g); e_it != e_end; ++e_it) {
+				Kb::vertex_descriptor u = source(*e_it, g);
+				if (!reached(i, u) || depth(i, u) + 1 != d) continue;
+				if (found && (u == node.parent || !before(i, u, node.parent))) continue;
+				node.parent = u;
+				found = true;
+			}
+			graph_traits<Kb::boost_graph_t>::out_edge_iterator o_it, o_end;
+			for(tie(o_it, o_end) = out_edges(node.parent, g); boost::target(*o_it, g) != v; ++o_it) {
+				++node.edge;
+			}
+		}
+		return m_trees[i].insert(make_pair(v, node)).first->second;
+	}
+
+	// whether u comes before v in the bfs queue of search i (both at the
+	// same depth)
+
+	bool MsBfsWorkspace::before(size_t i, Kb::vertex_descriptor u, Kb::vertex_descriptor v) {
+		while(u != v) {
+			const tree_node_t & nu = tree_node(i, u);
+			const tree_node_t & nv = tree_node(i, v);
+			if (nu.parent == nv.parent) return nu.edge < nv.edge;
+			u = nu.parent;
+			v = nv.parent;
+		}
+		return false;
+	}
+
+	Kb::vertex_descriptor MsBfsWorkspace::parent(size_t i, Kb::vertex_descriptor v) {
+		if (!reached(i, v) || v == m_srcs[i]) return v;
+		return tree_node(i, v).parent;
+	}
+
+	// index of the lowest bit set in m (m != 0)
+
+	static inline size_t lowest_bit(MsBfsWorkspace::mask_t m) {
+#ifdef __GNUC__
+		return __builtin_ctzll(m);
+#else
+		size_t i = 0;
+		while(!(m & 1)) { m >>= 1; ++i; }
+		return i;
+#endif
+	}
+
+	void Kb::bfs(const std::vector<Kb::vertex_descriptor> & srcs,
+				 const std::vector<const std::vector<Kb::vertex_descriptor> *> & targets,
+				 MsBfsWorkspace & ws, size_t max_depth) const {
+
+		typedef MsBfsWorkspace::mask_t mask_t;
+
+		size_t n = srcs.size();
+		if (n > MsBfsWorkspace::max_sources)
+			throw std::runtime_error("[E] Kb::bfs: too many sources");
+		ws.new_search(this, n);
+		ws.m_srcs = srcs;
+		if (!max_depth || max_depth > MsBfsWorkspace::max_depth) max_depth = MsBfsWorkspace::max_depth;
+
+		vector<size_t> left(n, 0); // targets not reached yet
+		mask_t active = 0;         // searches still running
+		for(size_t i = 0; i < n; ++i) {
+			mask_t bit = mask_t(1) << i;
+			for(vector<Kb::vertex_descriptor>::const_iterator it = targets[i]->begin(), end = targets[i]->end();
+				it != end; ++it) {
+				if (ws.target[*it] & bit) continue;
+				ws.target[*it] |= bit;
+				++left[i];
+			}
+			Kb::vertex_descriptor u = srcs[i];
+			if (!ws.seen[u]) {
+				ws.touched.push_back(u);
+				ws.frontier.push_back(u);
+			}
+			ws.seen[u] |= bit;
+			ws.visit[u] |= bit;
+			ws.depths[u * n + i] = 0;
+			if (ws.target[u] & bit) --left[i];
+			if (left[i]) active |= bit;
+		}
+
+		size_t depth = 0;
+		while(active && ws.frontier.size() && depth < max_depth) {
+			for(vector<Kb::vertex_descriptor>::const_iterator f_it = ws.frontier.begin(), f_end = ws.frontier.end();
+				f_it != f_end; ++f_it) {
+				Kb::vertex_descriptor u = *f_it;
+				mask_t m = ws.visit[u] & active;
+				ws.visit[u] = 0;
+				if (!m) continue;
+				graph_traits<Kb::boost_graph_t>::out_edge_iterator it, end;
+				for(tie(it, end) = out_edges(u, *m_g); it != end; ++it) {
+					Kb::vertex_descriptor v = target(*it, *m_g);
+					mask_t cand = m & ~ws.seen[v];
+					if (!cand) continue;
+					if (!ws.next[v]) ws.next_frontier.push_back(v);
+					ws.next[v] |= cand;
+				}
+			}
+			++depth;
+			for(vector<Kb::vertex_descriptor>::const_iterator it = ws.next_frontier.begin(), end = ws.next_frontier.end();
+				it != end; ++it) {
+				Kb::vertex_descriptor v = *it;
+				mask_t m = ws.next[v];
+				if (!ws.seen[v]) ws.touched.push_back(v);
+				ws.seen[v] |= m;
+				ws.visit[v] = m;
+				ws.next[v] = 0;
+				for(mask_t b = m; b; b &= b - 1) {
+					ws.depths[v * n + lowest_bit(b)] = depth;
+				}
+				for(mask_t b = m & ws.target[v]; b; b &= b - 1) {
+					size_t i = lowest_bit(b);
+					if (!--left[i]) active &= ~(mask_t(1) << i);
+				}
+			}
+			ws.frontier.swap(ws.next_frontier);
+			ws.next_frontier.clear();
+		}
+
+		for(vector<Kb::vertex_descriptor>::const_iterator it = ws.frontier.begin(), end = ws.frontier.end();
+			it != end; ++it) {
+			ws.visit[*it] = 0;
+		}
+		for(size_t i = 0; i < n; ++i) {
+			for(vector<Kb::vertex_descriptor>::const_iterator it = targets[i]->begin(), end = targets[i]->end();
+				it != end; ++it) {
+				ws.target[*it] = 0;
+			}
+		}
+	}
+
 	bool Kb::dijkstra (Kb::vertex_descriptor src,
 					   std::vector<Kb::vertex_descriptor> & parents) const {
 
@@ -238,89 +1019,197 @@ namespace ukb {
 		return true;
 	}
 
-	////////////////////////////////////////////////////////////////////////////////
-	// Get shortest subgraphs
-
-	class bfs_subg_terminate : public std::exception {};
-
-	struct subg {
-		vector<Kb::vertex_descriptor> V;
-		vector<vector<Kb::vertex_descriptor> > E;
-	};
+	void DijkstraWorkspace::new_search(size_t m) {
+		if (visited.size() != m || search == std::numeric_limits<unsigned int>::max()) {
+			// new graph, or search numbers exhausted
+			vector<unsigned int>(m, 0).swap(visited);
+			vector<unsigned int>(m, 0).swap(finished);
+			vector<unsigned int>(m, 0).swap(target);
+			dist.resize(m);
+			parents.resize(m);
+			heap_index.resize(m);
+			search = 0;
+		}
+		++search;
+	}
 
+	DijkstraWorkspace & DijkstraWorkspace::local() {
+		static boost::thread_specific_ptr<DijkstraWorkspace> ws;
+		if (!ws.get()) ws.reset(new DijkstraWorkspace);
+		return *ws;
+	}
 
-	class bfs_subg_visitor : public default_bfs_visitor {
+	size_t Kb::dijkstra(Kb::vertex_descriptor src,
+						const std::vector<Kb::vertex_descriptor> & targets,
+						const std::vector<float> & ranks,
+						DijkstraWorkspace & ws) const {
 
-	public:
-		bfs_subg_visitor(subg & s_, Kb::vertex_descriptor u, int limit)
-			: m_sg(s_), m_idx(), m_i(0), m_t(0), m_max(limit) {
-			add_v(u);
+		ws.new_search(num_vertices(*m_g));
+		unsigned int s = ws.search;
+		size_t targetN = 0;
+		for(vector<Kb::vertex_descriptor>::const_iterator it = targets.begin(), end = targets.end();
+			it != end; ++it) {
+			if (ws.target[*it] == s) continue;
+			ws.target[*it] = s;
+			++targetN;
 		}
 
-		void tree_edge(Kb::edge_descriptor e, const Kb::boost_graph_t & g)
-		{
-
-			Kb::vertex_descriptor u = source(e,g);
-			Kb::vertex_descriptor v = target(e,g);
-
-			// vertex v is new, but yet undiscovered
-			int v_i = add_v(v);
-			if (v_i == -1) return; // max limit reached.
-			int u_i = get_v(u);
-			add_e(u_i, v_i);
+		// Same heap, relaxing and visiting order as dijkstra_shortest_paths
+		// (so ties are broken the same way). A vertex is finished when
+		// popped, and its path is known then.
+		typedef boost::iterator_property_map<vector<float>::iterator,
+			boost::identity_property_map> dist_map_t;
+		typedef boost::iterator_property_map<vector<size_t>::iterator,
+			boost::identity_property_map> index_map_t;
+		dist_map_t dist(ws.dist.begin());
+		boost::d_ary_heap_indirect<Kb::vertex_descriptor, 4, index_map_t, dist_map_t, std::less<float> >
+			Q(dist, index_map_t(ws.heap_index.begin()));
+		const float inf = std::numeric_limits<float>::max();
+
+		ws.visited[src] = s;
+		ws.dist[src] = 0.0f;
+		ws.parents[src] = src;
+		Q.push(src);
+		size_t left = targetN;
+		while(left && !Q.empty()) {
+			Kb::vertex_descriptor u = Q.top();
+			Q.pop();
+			ws.finished[u] = s;
+			if (ws.target[u] == s && !--left) break;
+			float d_u = ws.dist[u];
+			graph_traits<Kb::boost_graph_t>::out_edge_iterator it, end;
+			for(tie(it, end) = out_edges(u, *m_g); it != end; ++it) {
+				Kb::vertex_descriptor v = target(*it, *m_g);
+				if (ws.finished[v] == s) continue;
+				float w = ranks[v];
+				float d = (d_u == inf || w == inf) ? inf : d_u + w;
+				if (ws.visited[v] != s) {
+					ws.visited[v] = s;
+					ws.dist[v] = inf;
+					ws.parents[v] = v;
+					if (d < inf) {
+						ws.dist[v] = d;
+						ws.parents[v] = u;
+					}
+					Q.push(v);
+				} else if (d < ws.dist[v]) {
+					ws.dist[v] = d;
+					ws.parents[v] = u;
+					Q.update(v);
+				}
+			}
+		}
+		return targetN - left;
+	}
 
-			Kb::edge_descriptor aux;
-			bool existsP;
-			tie(aux, existsP) = edge(v, u, g);
-			if (existsP) add_e(v_i, u_i); // as this edge is no more traversed.
+	////////////////////////////////////////////////////////////////////////////////
+	// Subgraphs
+
+	void SubgraphWorkspace::new_search(size_t m) {
+		if (visited.size() != m || search == std::numeric_limits<unsigned int>::max()) {
+			// new graph, or search numbers exhausted
+			vector<unsigned int>(m, 0).swap(visited);
+			idx.resize(m);
+			search = 0;
 		}
+		++search;
+	}
 
-		void non_tree_edge(Kb::edge_descriptor e, const Kb::boost_graph_t & g)
-		{
-			// cross edge. source is previously stored for sure. target probably
-			// is, unless max limit was reached
-			int v_i = get_v(target(e,g));
-			if (v_i == -1) return; // target vertex not stored because max limit.
-			int u_i = get_v(source(e,g));
+	SubgraphWorkspace & SubgraphWorkspace::local() {
+		static boost::thread_specific_ptr<SubgraphWorkspace> ws;
+		if (!ws.get()) ws.reset(new SubgraphWorkspace);
+		return *ws;
+	}
 
-			add_e(u_i, v_i);
+	void Kb::khop_subgraph(const std::vector<Kb::vertex_descriptor> & seeds, size_t k,
+						   KbSubgraph & sg, SubgraphWorkspace & ws,
+						   size_t max_vertices) const {
+
+		const boost_graph_t & g = *m_g;
+		size_t m = num_vertices(g);
+		if (!max_vertices || max_vertices > m) max_vertices = m;
+
+		ws.new_search(m);
+		unsigned int s = ws.search;
+
+		// sg.vertices is the bfs queue
+		vector<Kb::vertex_descriptor> & V = sg.vertices;
+		vector<unsigned int> & depth = sg.depth;
+		V.clear();
+		depth.clear();
+		for(vector<Kb::vertex_descriptor>::const_iterator it = seeds.begin(), end = seeds.end();
+			it != end && V.size() < max_vertices; ++it) {
+			Kb::vertex_descriptor u = *it;
+			if (ws.visited[u] == s) continue; // repeated seed
+			ws.visited[u] = s;
+			ws.idx[u] = V.size();
+			V.push_back(u);
+			depth.push_back(0);
 		}
-
-		void discover_vertex(Kb::vertex_descriptor u, const Kb::boost_graph_t & g)
-		{
-			if (m_t == m_max) throw bfs_subg_terminate();
-			++m_t;
+		for(size_t i = 0; i < V.size() && V.size() < max_vertices; ++i) {
+			unsigned int d = depth[i];
+			if (k && d == k) break; // so are all vertices left in the queue
+			Kb::out_edge_iterator it, end;
+			for(tie(it, end) = out_edges(V[i], g); it != end; ++it) {
+				Kb::vertex_descriptor v = target(*it, g);
+				if (ws.visited[v] == s) continue;
+				ws.visited[v] = s;
+				ws.idx[v] = V.size();
+				V.push_back(v);
+				depth.push_back(d + 1);
+				if (V.size() == max_vertices) break;
+			}
 		}
 
-		int add_v(Kb::vertex_descriptor v)
-		{
-			if(m_i == m_max) return -1;
-			m_sg.V.push_back(v);
-			m_idx[v] = m_i;
-			m_sg.E.push_back(vector<Kb::vertex_descriptor>());
-			int res = m_i;
-			++m_i;
-			return res;
+		// all the edges among the vertices
+		size_t n = V.size();
+		sg.rowstart.resize(n + 1);
+		sg.column.clear();
+		sg.edges.clear();
+		sg.rowstart[0] = 0;
+		for(size_t i = 0; i < n; ++i) {
+			Kb::out_edge_iterator it, end;
+			for(tie(it, end) = out_edges(V[i], g); it != end; ++it) {
+				Kb::vertex_descriptor v = target(*it, g);
+				if (ws.visited[v] != s) continue;
+				sg.column.push_back(ws.idx[v]);
+				sg.edges.push_back(it->idx);
+			}
+			sg.rowstart[i + 1] = sg.column.size();
 		}
+	}
 
-		int get_v(Kb::vertex_descriptor v) {
-			map<Kb::vertex_descriptor, int>::iterator it=m_idx.find(v);
-			if(it == m_idx.end()) return -1;
-			return it->second;
+	Kb::version_t Kb::subgraph_kb(const KbSubgraph & sg) const {
+
+		size_t n = sg.size();
+		vector<pair<size_t, size_t> > E;
+		vector<edge_prop_t> eProp;
+		E.reserve(sg.edge_size());
+		eProp.reserve(sg.edge_size());
+		for(size_t i = 0; i < n; ++i) {
+			for(size_t j = sg.rowstart[i], jm = sg.rowstart[i + 1]; j != jm; ++j) {
+				E.push_back(make_pair(i, size_t(sg.column[j])));
+				eProp.push_back((*m_g)[sg.kb_edge(i, j)]);
+			}
 		}
 
-		void add_e(int u_i, int v_i) {
-			m_sg.E[u_i].push_back(m_sg.V[v_i]);
+		version_t kb(create(), &Kb::destroy);
+		kb->m_g.reset(new boost_graph_t(boost::edges_are_unsorted_multi_pass,
+										E.begin(), E.end(),
+										eProp.begin(),
+										n));
+		for(size_t i = 0; i < n; ++i) {
+			const string & name = (*m_g)[sg.vertices[i]].name;
+			(*kb->m_g)[i].name = name;
+			kb->m_synsetMap.insert(make_pair(name, i));
 		}
-
-	private:
-		subg & m_sg;
-		map<Kb::vertex_descriptor, int> m_idx;
-		int m_i; // num of inserted vertices
-		int m_t; // time
-		int m_max;
-	};
-
+		kb->m_vertexN = num_vertices(*kb->m_g);
+		kb->m_edgeN = num_edges(*kb->m_g);
+		kb->m_relsSource = m_relsSource;
+		kb->m_rtypes = m_rtypes; // so edge types are the same
+		kb->m_notes = m_notes;
+		return kb;
+	}
 
 	void Kb::get_subgraph(const string & src,
 						  vector<string> & V,
@@ -332,23 +1221,21 @@ namespace ukb {
 		tie(u,aux) = get_vertex_by_name(src);
 		if(!aux) return;
 
-		subg sg;
-		bfs_subg_visitor vis(sg, u, limit);
-
-		try {
-			breadth_first_search(*m_g, u, boost::visitor(vis));
-		} catch (bfs_subg_terminate & ) {}
+		KbSubgraph sg;
+		khop_subgraph(vector<Kb::vertex_descriptor>(1, u), 0, sg,
+					  SubgraphWorkspace::local(), limit);
 
-		size_t N = sg.V.size();
+		size_t N = sg.size();
 		vector<string>(N).swap(V);
 		vector<vector<string> >(N).swap(E);
 
 		for(size_t i=0; i < N; ++i) {
-			V[i] = (*m_g)[sg.V[i]].name;
-			size_t m = sg.E[i].size();
+			V[i] = (*m_g)[sg.vertices[i]].name;
+			size_t b = sg.rowstart[i];
+			size_t m = sg.rowstart[i + 1] - b;
 			vector<string> l(m);
 			for(size_t j=0; j < m; ++j) {
-				l[j] =  (*m_g)[sg.E[i].at(j)].name;
+				l[j] = (*m_g)[sg.vertices[sg.column[b + j]]].name;
 			}
 			E[i].swap(l);
 		}
@@ -357,29 +1244,30 @@ namespace ukb {
 	bool Kb::get_shortest_paths(const std::string & src,
 								const std::vector<std::string> & targets,
 								std::vector<std::vector<std::string> > & paths) {
-		vector<Kb::vertex_descriptor> parents;
+		PathWorkspace & ws = PathWorkspace::local();
+		vector<Kb::vertex_descriptor> tgts;
 		Kb::vertex_descriptor u;
 		bool aux;
 		tie(u,aux) = get_vertex_by_name(src);
 		if(!aux) return false;
 		std::vector<std::vector<std::string> >().swap(paths);
-		this->bfs(u, parents);
 		for(std::vector<std::string>::const_iterator it = targets.begin(), end = targets.end();
 			it != end; ++it) {
 			Kb::vertex_descriptor v;
 			tie(v,aux) = get_vertex_by_name(*it);
-			if (!aux) continue;
-			if (parents[v] == v) continue; // either (u == v) or v is not connected to u.
+			if (aux) tgts.push_back(v);
+		}
+		vector<Kb::vertex_descriptor> path;
+		for(vector<Kb::vertex_descriptor>::const_iterator it = tgts.begin(), end = tgts.end();
+			it != end; ++it) {
+			Kb::vertex_descriptor v = *it;
+			if (v == u) continue;
+			if (!shortest_path(u, v, path, ws)) continue; // v is not connected to u.
 			paths.push_back(vector<string>());
 			vector<string> & P = paths.back();
-			// iterate until source is met
-			P.push_back(get_vertex_name(v));
-			while(1) {
-				v = parents[v];
-				P.push_back(get_vertex_name(v));
-				if (v == u) break;
+			for(size_t i = 0; i < path.size(); ++i) {
+				P.push_back(get_vertex_name(path[i]));
 			}
-			std::reverse(P.begin(), P.end());
 		}
 		return paths.size();
 	}
@@ -482,18 +1370,27 @@ namespace ukb {
 	////////////////////////////////////////////////////////////////////////////////
 	// Get static pageRank vector
 
-	const std::vector<float> & Kb::static_prank() const {
-		if (m_static_ppv.size()) return m_static_ppv;
+	void Kb::init_static_prank() {
+		if (m_vertexN == 0) return; // empty graph
+		vector<float> pv(m_vertexN, 1.0/static_cast<float>(m_vertexN));
+		vector<float> ranks;
+		pageRank_ppv(pv, ranks);
+		m_static_ppv.swap(ranks);
+	}
 
+	const std::vector<float> & Kb::static_prank() const {
 		// Hack to remove const-ness
 		Kb & me = const_cast<Kb &>(*this);
-
-		if (m_vertexN == 0) return m_static_ppv; // empty graph
-		vector<float> pv(m_vertexN, 1.0/static_cast<float>(m_vertexN));
-		me.pageRank_ppv(pv, me.m_static_ppv);
+		boost::call_once(me.m_static_once, boost::bind(&Kb::init_static_prank, &me));
 		return m_static_ppv;
 	}
 
+	void Kb::warm_caches() const {
+		Kb & me = const_cast<Kb &>(*this);
+		boost::call_once(me.m_out_coefs_once, boost::bind(&Kb::init_out_coefs, &me));
+		static_prank();
+	}
+
 	////////////////////////////////////////////////////////////////////////////////
 	// Random
 
@@ -688,6 +1585,9 @@ namespace ukb {
 			writeV(o, m_rtypes.m_strtypes);
 			o << endl;
 		}
+		if (m_landmarks.size()) {
+			o << "Landmark index: " << m_landmarks.size() << " landmarks" << endl;
+		}
 	}
 
 
@@ -766,59 +1666,212 @@ namespace ukb {
 	// PageRank in KB
 
 
-	// PPV version
+	// Out-degree coefficients. Computed once per Kb (see pageRank_ppv and
+	// warm_caches).
 
-	void Kb::pageRank_ppv(const vector<float> & ppv_map,
-						  vector<float> & ranks) {
+	void Kb::init_out_coefs() {
 
 		typedef graph_traits<Kb::boost_graph_t>::edge_descriptor edge_descriptor;
 		property_map<Kb::boost_graph_t, float edge_prop_t::*>::type weight_map = get(&edge_prop_t::weight, *m_g);
 		prank::constant_property_map <edge_descriptor, float> cte_weight(1.0); // always return 1
 
-		if (0 == m_out_coefs.size()) {
-			vector<float>(m_vertexN, 0.0f).swap(m_out_coefs);
+		vector<float> coefs(m_vertexN, 0.0f);
+		if (m_vertexN) {
 			if (glVars::prank::use_weight) {
-				prank::init_out_coefs(*m_g,  &m_out_coefs[0], weight_map);
+				prank::init_out_coefs(*m_g,  &coefs[0], weight_map);
 			} else {
-				prank::init_out_coefs(*m_g,  &m_out_coefs[0], cte_weight);
+				prank::init_out_coefs(*m_g,  &coefs[0], cte_weight);
 			}
 		}
-		if (m_vertexN == ranks.size()) {
-			std::fill(ranks.begin(), ranks.end(), 0.0);
-		} else {
+		m_out_coefs.swap(coefs);
+	}
+
+	void PrankWorkspace::check_kb(const Kb & kb) {
+		if (kb_generation == kb.generation()) return;
+		rank_tmp.clear();
+		batch_tmp1.clear();
+		batch_tmp2.clear();
+		kb_generation = kb.generation();
+	}
+
+	PrankWorkspace & PrankWorkspace::local() {
+		static boost::thread_specific_ptr<PrankWorkspace> ws;
+		if (!ws.get()) ws.reset(new PrankWorkspace);
+		return *ws;
+	}
+
+	double prank_clock_us() {
+		static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+		return (boost::posix_time::microsec_clock::universal_time() - epoch).total_microseconds();
+	}
+
+	// Initialize out coefficients and rank vector before pageRank.
+	//
+	// Note: ranks is not zero-filled, as all solvers overwrite the whole
+	// vector.
+
+	void Kb::init_ranks(vector<float> & ranks) {
+		boost::call_once(m_out_coefs_once, boost::bind(&Kb::init_out_coefs, this));
+		if (m_vertexN != ranks.size()) {
 			vector<float>(m_vertexN, 0.0).swap(ranks); // Initialize rank vector
 		}
-		vector<float> rank_tmp(m_vertexN, 0.0);    // auxiliary rank vector
+	}
+
+	// Power method. ppv_map is either a dense vector or a prank::sparse_pv_map
+
+	template<typename ppvMap_t>
+	void Kb::pageRank_pm(ppvMap_t ppv_map, vector<float> & ranks, PrankWorkspace & ws) {
+
+		typedef graph_traits<Kb::boost_graph_t>::edge_descriptor edge_descriptor;
+		property_map<Kb::boost_graph_t, float edge_prop_t::*>::type weight_map = get(&edge_prop_t::weight, *m_g);
+		prank::constant_property_map <edge_descriptor, float> cte_weight(1.0); // always return 1
+
+		// auxiliary rank vector. do_pageRank never writes the elements of
+		// isolated vertices, so they stay zero when the vector is reused.
+		ws.check_kb(*this);
+		vector<float> & rank_tmp = ws.rank_tmp;
+		if (rank_tmp.size() != m_vertexN) {
+			vector<float>(m_vertexN, 0.0).swap(rank_tmp);
+		}
 
+		int iters;
+		if (glVars::prank::use_weight) {
+			iters = prank::do_pageRank(*m_g, m_vertexN, ppv_map,
+									   weight_map, &ranks[0], &rank_tmp[0],
+									   glVars::prank::num_iterations,
+									   glVars::prank::threshold,
+									   glVars::prank::damping,
+									   m_out_coefs);
+		} else {
+			iters = prank::do_pageRank(*m_g, m_vertexN, ppv_map,
+									   cte_weight, &ranks[0], &rank_tmp[0],
+									   glVars::prank::num_iterations,
+									   glVars::prank::threshold,
+									   glVars::prank::damping,
+									   m_out_coefs);
+		}
+		ws.stats.iterations += iters;
+	}
+
+	// PPV version
+
+	void Kb::pageRank_ppv(const vector<float> & ppv_map,
+						  vector<float> & ranks) {
+		pageRank_ppv(ppv_map, ranks, PrankWorkspace::local());
+	}
+
+	void Kb::pageRank_ppv(const vector<float> & ppv_map,
+						  vector<float> & ranks,
+						  PrankWorkspace & ws) {
+
+		double t0 = prank_clock_us();
+		init_ranks(ranks);
 		switch(glVars::prank::impl) {
 		  case glVars::pm:
-			  if (glVars::prank::use_weight) {
-				  prank::do_pageRank(*m_g, m_vertexN, &ppv_map[0],
-									 weight_map, &ranks[0], &rank_tmp[0],
-									 glVars::prank::num_iterations,
-									 glVars::prank::threshold,
-									 glVars::prank::damping,
-									 m_out_coefs);
-			  } else {
-				  prank::do_pageRank(*m_g, m_vertexN, &ppv_map[0],
-									 cte_weight, &ranks[0], &rank_tmp[0],
-									 glVars::prank::num_iterations,
-									 glVars::prank::threshold,
-									 glVars::prank::damping,
-									 m_out_coefs);
+			  pageRank_pm(&ppv_map[0], ranks, ws);
+			  break;
+		  case glVars::nibble:
+			  {
+				  sparse_pv_t ppv;
+				  for(size_t i = 0, m = ppv_map.size(); i != m; ++i) {
+					  if (ppv_map[i] != 0.0) ppv.push_back(make_pair(i, ppv_map[i]));
+				  }
+				  prank::pageRank_nibble_lazy(*m_g, ppv.begin(), ppv.end(), m_out_coefs, glVars::prank::damping, glVars::prank::nibble_epsilon, ranks, ws.residual);
 			  }
 			  break;
+		default:
+			cerr << "Error! undefined method for PageRank calculation.\n";
+			exit(1);
+			break;
+		}
+		ws.stats.solves++;
+		ws.stats.prank_us += prank_clock_us() - t0;
+	}
+
+	// Sparse PPV version. The teleport term is only applied to the vertices
+	// in ppv.
+
+	void Kb::pageRank_ppv(const sparse_pv_t & ppv,
+						  vector<float> & ranks) {
+		pageRank_ppv(ppv, ranks, PrankWorkspace::local());
+	}
+
+	void Kb::pageRank_ppv(const sparse_pv_t & ppv,
+						  vector<float> & ranks,
+						  PrankWorkspace & ws) {
+
+		double t0 = prank_clock_us();
+		init_ranks(ranks);
+		switch(glVars::prank::impl) {
+		  case glVars::pm:
+			  pageRank_pm(prank::sparse_pv_map<sparse_pv_t::const_iterator>(ppv.begin(), ppv.end()), ranks, ws);
+			  break;
 		  case glVars::nibble:
-			  prank::pageRank_nibble_lazy(*m_g, ppv_map, m_out_coefs, glVars::prank::damping, glVars::prank::nibble_epsilon, ranks);
+			  prank::pageRank_nibble_lazy(*m_g, ppv.begin(), ppv.end(), m_out_coefs, glVars::prank::damping, glVars::prank::nibble_epsilon, ranks, ws.residual);
 			  break;
 		default:
 			cerr << "Error! undefined method for PageRank calculation.\n";
 			exit(1);
 			break;
 		}
+		ws.stats.solves++;
+		ws.stats.prank_us += prank_clock_us() - t0;
 	}
 
 
+	void Kb::pageRank_ppv_batch(const vector<const sparse_pv_t *> & ppvs,
+								const vector<vector<float> *> & ranks,
+								PrankWorkspace & ws) {
+
+		size_t B = ppvs.size();
+		if (B == 1 || glVars::prank::impl != glVars::pm) {
+			for(size_t b = 0; b < B; ++b)
+				pageRank_ppv(*ppvs[b], *ranks[b], ws);
+			return;
+		}
+		if (!B) return;
+
+		double t0 = prank_clock_us();
+		typedef graph_traits<Kb::boost_graph_t>::edge_descriptor edge_descriptor;
+		property_map<Kb::boost_graph_t, float edge_prop_t::*>::type weight_map = get(&edge_prop_t::weight, *m_g);
+		prank::constant_property_map <edge_descriptor, float> cte_weight(1.0); // always return 1
+
+		vector<pair<sparse_pv_t::const_iterator, sparse_pv_t::const_iterator> > pvs;
+		vector<float *> out;
+		for(size_t b = 0; b < B; ++b) {
+			init_ranks(*ranks[b]);
+			pvs.push_back(make_pair(ppvs[b]->begin(), ppvs[b]->end()));
+			out.push_back(&(*ranks[b])[0]);
+		}
+		if (!m_vertexN) return;
+		ws.check_kb(*this);
+		if (ws.batch_tmp1.size() != m_vertexN * B) {
+			vector<float>(m_vertexN * B, 0.0).swap(ws.batch_tmp1);
+			// elements of isolated vertices must be zero (see do_pageRank_batch)
+			vector<float>(m_vertexN * B, 0.0).swap(ws.batch_tmp2);
+		}
+
+		int iters;
+		if (glVars::prank::use_weight) {
+			iters = prank::do_pageRank_batch(*m_g, m_vertexN, pvs,
+											 weight_map, ws.batch_tmp1, ws.batch_tmp2, out,
+											 glVars::prank::num_iterations,
+											 glVars::prank::threshold,
+											 glVars::prank::damping,
+											 m_out_coefs);
+		} else {
+			iters = prank::do_pageRank_batch(*m_g, m_vertexN, pvs,
+											 cte_weight, ws.batch_tmp1, ws.batch_tmp2, out,
+											 glVars::prank::num_iterations,
+											 glVars::prank::threshold,
+											 glVars::prank::damping,
+											 m_out_coefs);
+		}
+		ws.stats.solves += B;
+		ws.stats.iterations += iters;
+		ws.stats.prank_us += prank_clock_us() - t0;
+	}
+
 	////////////////////////////////////////////////////////////////////////////////
 	// Debug
 
@@ -851,6 +1904,7 @@ namespace ukb {
 	static const size_t magic_id_v1 = 0x070201;
 	static const size_t magic_id = 0x080826;
 	static const size_t magic_id_csr = 0x110501;
+	static const size_t magic_id_landmarks = 0x240601;
 
 	// CSR read
 
@@ -928,6 +1982,26 @@ namespace ukb {
 				throw runtime_error("Invalid id after reading graph");
 			}
 			read_vector_from_stream(is, m_notes);
+
+			// Optional landmark index (older files end here)
+			vector<Kb::vertex_descriptor>().swap(m_landmarks);
+			vector<boost::uint16_t>().swap(m_lm_from);
+			vector<boost::uint16_t>().swap(m_lm_to);
+			if (is.peek() != std::char_traits<char>::eof()) {
+				read_atom_from_stream(is, id);
+				if (id != magic_id_landmarks) {
+					throw runtime_error("Invalid id before landmark index");
+				}
+				read_vector_from_stream(is, m_landmarks);
+				read_vector_from_stream(is, m_lm_from);
+				read_vector_from_stream(is, m_lm_to);
+				read_atom_from_stream(is, id);
+				if (id != magic_id_landmarks ||
+					m_lm_from.size() != vertex_n * m_landmarks.size() ||
+					m_lm_to.size() != vertex_n * m_landmarks.size()) {
+					throw runtime_error("Invalid landmark index");
+				}
+			}
 		} catch (std::exception & e) {
 			throw runtime_error(string("Error when reading serialized graph: ") + e.what());
 		}
@@ -1000,6 +2074,14 @@ namespace ukb {
 		write_atom_to_stream(o, magic_id_csr);
 
 		write_vector_to_stream(o, m_notes);
+
+		if (m_landmarks.size()) {
+			write_atom_to_stream(o, magic_id_landmarks);
+			write_vector_to_stream(o, m_landmarks);
+			write_vector_to_stream(o, m_lm_from);
+			write_vector_to_stream(o, m_lm_to);
+			write_atom_to_stream(o, magic_id_landmarks);
+		}
 		return o;
 	}
 
@@ -1016,21 +2098,37 @@ namespace ukb {
 
 	// text write
 
+	static void write_txt_edge(ostream & o, const string & u_str, const string & v_str,
+							   const vector<string> & r) {
+		if (r.size()) {
+			for(vector<string>::const_iterator rit = r.begin(), rend = r.end();
+				rit != rend; ++rit) {
+				o << "u:" << u_str << " v:" << v_str << " s:" << *rit << " d:1\n";
+			}
+		} else {
+			o << "u:" << u_str << " v:" << v_str << " d:1\n";
+		}
+	}
+
 	ostream & Kb::write_to_textstream(ostream & o) const {
 
 		graph_traits<Kb::boost_graph_t>::edge_iterator it, end;
 		tie(it, end) = edges(*m_g);
 		for(;it != end; ++it) {
-			const string & u_str = (*m_g)[source(*it, *m_g)].name;
-			const string & v_str = (*m_g)[target(*it, *m_g)].name;
-			vector<string> r = edge_reltypes(*it);
-			if (r.size()) {
-				for(vector<string>::const_iterator rit = r.begin(), rend = r.end();
-					rit != rend; ++rit) {
-					o << "u:" << u_str << " v:" << v_str << " s:" << *rit << " d:1\n";
-				}
-			} else {
-				o << "u:" << u_str << " v:" << v_str << " d:1\n";
+			write_txt_edge(o, (*m_g)[source(*it, *m_g)].name,
+						   (*m_g)[target(*it, *m_g)].name,
+						   edge_reltypes(*it));
+		}
+		return o;
+	}
+
+	ostream & Kb::write_subgraph_txt(ostream & o, const KbSubgraph & sg) const {
+
+		for(size_t i = 0, n = sg.size(); i < n; ++i) {
+			const string & u_str = (*m_g)[sg.vertices[i]].name;
+			for(size_t j = sg.rowstart[i], jm = sg.rowstart[i + 1]; j != jm; ++j) {
+				write_txt_edge(o, u_str, (*m_g)[sg.vertices[sg.column[j]]].name,
+							   edge_reltypes(sg.kb_edge(i, j)));
 			}
 		}
 		return o;
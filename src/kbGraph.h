@@ -29,6 +29,13 @@
 
 #include <boost/graph/properties.hpp>
 
+#include <boost/thread/once.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <list>
+
 using boost::compressed_sparse_row_graph;
 using boost::graph_traits;
 using boost::property;
@@ -40,6 +47,16 @@ using boost::edge_weight;
 
 namespace ukb {
 
+	struct PrankWorkspace; // forward declaration
+	struct BfsWorkspace;   // forward declaration
+	struct MsBfsWorkspace; // forward declaration
+	struct DfsWorkspace;   // forward declaration
+	struct DijkstraWorkspace; // forward declaration
+	struct PathWorkspace;     // forward declaration
+	struct SubgraphWorkspace; // forward declaration
+	struct KbSubgraph;        // forward declaration
+
+
 
 	class Kb {
 
@@ -55,9 +72,36 @@ namespace ukb {
 		typedef graph_traits<boost_graph_t>::out_edge_iterator out_edge_iterator;
 		typedef graph_traits<boost_graph_t>::in_edge_iterator in_edge_iterator;
 
+		// Sparse personalization vector: (vertex, weight) pairs sorted by
+		// vertex, without repeated vertices.
+		typedef std::vector<std::pair<vertex_descriptor, float> > sparse_pv_t;
+
 		// Singleton
 		static Kb & instance();
 
+		// Versions of the KB (hot reload).
+		//
+		// instance() returns the current version, unless the calling
+		// thread pinned another one. A new version is loaded with
+		// load_binfile and made current with set_current. Old versions are
+		// freed once no one holds them, so threads which pin a version (and
+		// hold it) may keep on using it safely. Servers pin a version for
+		// the whole request (see KbDictPin in wdict.h).
+
+		typedef boost::shared_ptr<Kb> version_t;
+
+		static version_t current();
+		static void set_current(const version_t & kb);
+		static version_t load_binfile(const std::string & fname);
+
+		// instance() returns kb in the calling thread (the current version
+		// again if kb is null). The caller holds kb while pinned. Returns
+		// the previously pinned version.
+		static Kb * pin(Kb * kb);
+
+		// Versions loaded so far get increasing generation numbers
+		size_t generation() const { return m_generation; }
+
 
 		// 2 functions for creating Kb graphs
 		//
@@ -164,6 +208,13 @@ namespace ukb {
 
 		const std::vector<float> & static_prank() const;
 
+		// Initialize the lazily computed caches (out-degree coefficients and
+		// static pageRank). Caches are filled at most once, so it is safe to
+		// call concurrently; servers call it at startup to avoid the first
+		// requests paying for it.
+
+		void warm_caches() const;
+
 		// Given a previously calculated rank vector, output 2 vector, probably
 		// filtering the nodes.
 		//
@@ -213,15 +264,117 @@ namespace ukb {
 
 		bool bfs (vertex_descriptor source_synset, std::vector<vertex_descriptor> & synv) const ;
 
+		// Targeted bfs. Same search tree as above, but the search stops as
+		// soon as all targets are reached, or when no vertex is closer than
+		// max_depth edges to src (0 means no limit). Parents are left in ws
+		// (see BfsWorkspace::parent). Returns the number of (different)
+		// targets reached.
+
+		size_t bfs (vertex_descriptor src, const std::vector<vertex_descriptor> & targets,
+					BfsWorkspace & ws, size_t max_depth = 0) const;
+
+		// Bfs from src (the targeted bfs, without targets) which stops
+		// after visiting max_vertices vertices (0 means no limit). The
+		// visited vertices are left in ws.queue, in visiting order.
+		// Returns true if the search visited every vertex reachable from
+		// src (up to max_depth edges away).
+
+		bool bfs_tree (vertex_descriptor src, BfsWorkspace & ws,
+					   size_t max_depth, size_t max_vertices) const;
+
+		// Shortest path from u to v, with a bidirectional bfs. The path is
+		// the one in the search tree of the bfs from u, that is, among
+		// shortest paths, the one whose sequence of out edges (by their
+		// position in the out edge list) is lexicographically smallest.
+		// Returns false if v is not reachable from u, which the landmark
+		// index (see build_landmarks) usually tells without searching.
+
+		bool shortest_path (vertex_descriptor u, vertex_descriptor v,
+							std::vector<vertex_descriptor> & path, PathWorkspace & ws) const;
+
+		// Multi-source bfs. The targeted bfs above from every srcs[i]
+		// towards *targets[i], all at once (up to
+		// MsBfsWorkspace::max_sources sources). The search trees are the
+		// same as with separate searches. Parents are left in ws (see
+		// MsBfsWorkspace::parent).
+
+		void bfs (const std::vector<vertex_descriptor> & srcs,
+				  const std::vector<const std::vector<vertex_descriptor> *> & targets,
+				  MsBfsWorkspace & ws, size_t max_depth = 0) const;
+
+		// Depth limited dfs from src. Every vertex is visited once, and
+		// vertices max_depth edges away from src are not expanded (0 means
+		// no limit). The edges of the path from src to each target (but
+		// src) are appended to E, once per target. The search tree is the
+		// same as with depth_first_visit over the dfsa adaptor (dfsa.h).
+		// Returns the number of (different) targets reached.
+
+		size_t dfs (vertex_descriptor src, const std::vector<vertex_descriptor> & targets,
+					DfsWorkspace & ws, size_t max_depth,
+					std::vector<edge_descriptor> & E) const;
+
 		bool dijkstra (vertex_descriptor src, std::vector<vertex_descriptor> & parents) const;
 
+		// Dijkstra from src, the cost of every edge being the rank of its
+		// target. Same search tree as dijkstra() after ppv_weights(ranks),
+		// but the KB is left untouched, and the search stops as soon as
+		// the paths to all targets are known. Parents are left in ws (see
+		// DijkstraWorkspace::parent). Returns the number of (different)
+		// targets reached.
+
+		size_t dijkstra (vertex_descriptor src, const std::vector<vertex_descriptor> & targets,
+						 const std::vector<float> & ranks, DijkstraWorkspace & ws) const;
+
 		void pageRank_ppv(const std::vector<float> & ppv_map,
 						  std::vector<float> & ranks);
 
+		void pageRank_ppv(const sparse_pv_t & ppv,
+						  std::vector<float> & ranks);
+
+		// Same, but use the scratch vectors of ws
+
+		void pageRank_ppv(const std::vector<float> & ppv_map,
+						  std::vector<float> & ranks,
+						  PrankWorkspace & ws);
+
+		void pageRank_ppv(const sparse_pv_t & ppv,
+						  std::vector<float> & ranks,
+						  PrankWorkspace & ws);
+
+		// PageRank of a batch of sparse PPVs; ranks[i] gets the ranks of
+		// ppvs[i]. With the power method, each iteration is a single pass
+		// over the graph for the whole batch. Results are the same as with
+		// pageRank_ppv.
+
+		void pageRank_ppv_batch(const std::vector<const sparse_pv_t *> & ppvs,
+								const std::vector<std::vector<float> *> & ranks,
+								PrankWorkspace & ws);
+
 		void ppv_weights(const std::vector<float> & ppv);
 
+		// Landmark index (ALT). The hop distances d(L, v) and d(v, L)
+		// between every vertex v and a few landmark vertices L. By the
+		// triangle inequality, they give lower bounds of the distance
+		// between any two vertices, and tell whether there is no path at
+		// all. The index is stored in the binary file.
+		//
+		// Landmarks are the vertices with highest degree
+		// (landmarks_degree), or, after the first, the vertices farthest
+		// from the landmarks already chosen (landmarks_farthest).
+
+		enum landmark_method_t { landmarks_degree, landmarks_farthest };
+		static const unsigned int landmark_inf = 0xFFFF; // no path
+
+		void build_landmarks(size_t k, landmark_method_t method = landmarks_degree);
+		size_t landmarks() const { return m_landmarks.size(); }
+
+		// Lower bound of d(u, v), landmark_inf if there is no path from u
+		// to v (0 without index).
+
+		unsigned int landmark_lower(vertex_descriptor u, vertex_descriptor v) const;
+
 		// given a source node and a limit (100) return a subgraph by performing a
-		// bfs over the graph.
+		// bfs over the graph (see khop_subgraph).
 		// Output:
 		//  V -> a vector of subgraph nodes
 		//  E -> a map representing subgraph edges
@@ -231,6 +384,22 @@ namespace ukb {
 						  std::vector<std::vector<std::string> > & E,
 						  size_t limit = 100);
 
+		// k-hop neighbourhood of seeds. The vertices at most k edges away
+		// from some seed (0 means no limit), in the order of a bfs from all
+		// seeds at once, up to max_vertices vertices (0 means no limit),
+		// and all the edges among them.
+
+		void khop_subgraph(const std::vector<vertex_descriptor> & seeds, size_t k,
+						   KbSubgraph & sg, SubgraphWorkspace & ws,
+						   size_t max_vertices = 0) const;
+
+		// Write sg in txt format (as write_to_textstream)
+		std::ostream & write_subgraph_txt(std::ostream & o, const KbSubgraph & sg) const;
+
+		// A KB of its own with the vertices and edges of sg (the vertex
+		// ids of sg), which may be written with write_to_binfile, etc.
+		version_t subgraph_kb(const KbSubgraph & sg) const;
+
 		// given a source node and a set of targets, compute the shortest paths from
 		// source to each target
 		// Output:
@@ -247,18 +416,31 @@ namespace ukb {
 		static void create_from_kbgraph16(Kb16 & kbg) ;
 
 	private:
+		friend struct MsBfsWorkspace;
+
 		// Singleton
 		static Kb * p_instance;
 		static Kb * create();
+		static void destroy(Kb * kb) { delete kb; }
+		static void set_current(Kb * kb);
 
 		// Private methods
-		Kb() : m_g(NULL), m_vertexN(0), m_edgeN(0) {};
+		Kb();
 		Kb(const Kb &) {};
 		Kb &operator=(const Kb &);
 		~Kb() {};
 
 		vertex_descriptor InsertNode(const std::string & name, unsigned char flags);
 
+		void init_out_coefs();
+		void init_ranks(std::vector<float> & ranks);
+		template<typename ppvMap_t>
+		void pageRank_pm(ppvMap_t ppv_map, std::vector<float> & ranks, PrankWorkspace & ws);
+		void init_static_prank();
+
+		// One more level of a side of the search in shortest_path
+		void path_expand(bool backward, PathWorkspace & ws) const;
+
 		void read_from_stream (std::istream & o);
 		std::ostream & write_to_stream(std::ostream & o) const;
 		// Private members
@@ -272,13 +454,352 @@ namespace ukb {
 
 		std::vector<std::string> m_notes;        // Command line which created the graph
 
+		// Landmark index. Distances of vertex v are in [v*k, (v+1)*k), k
+		// being the number of landmarks.
+
+		std::vector<vertex_descriptor> m_landmarks;
+		std::vector<boost::uint16_t> m_lm_from;  // d(landmark, v)
+		std::vector<boost::uint16_t> m_lm_to;    // d(v, landmark)
+
 		// Aux variables
 
 		std::vector<float> m_out_coefs;          // aux. vector of out-degree coefficients
 		size_t m_vertexN;                        // Number of vertices
 		size_t m_edgeN;                          // Number of edges
 		std::vector<float> m_static_ppv;         // aux. vector with static prank computation
+		boost::once_flag m_out_coefs_once;       // guards m_out_coefs initialization
+		boost::once_flag m_static_once;          // guards m_static_ppv initialization
+		size_t m_generation;
 	};
+
+	// Scratch vectors for PageRank computations.
+	//
+	// Every solve needs some auxiliary vectors of |V| elements. A workspace
+	// keeps them across solves, so that they are not allocated (and
+	// zero-filled) again on each call. A workspace can not be shared among
+	// threads; PrankWorkspace::local() returns the workspace of the calling
+	// thread, which is what the functions without a workspace argument use.
+
+	struct PrankWorkspace {
+		std::vector<float> rank_tmp;     // auxiliary rank vector (power method)
+		std::vector<float> residual;     // residual vector (nibble)
+		Kb::sparse_pv_t pv;              // personalization vector of a context
+		std::vector<float> ranks;        // ranks of a context (for callers)
+		std::vector<float> dgraph_pv;    // personalization vector in dgraph
+		std::vector<float> dgraph_coefs; // out coefficients of dgraph
+		std::vector<float> dgraph_tmp;   // auxiliary rank vector in dgraph
+		std::vector<float> batch_tmp1;   // interleaved rank vectors (batches)
+		std::vector<float> batch_tmp2;
+		std::vector<Kb::sparse_pv_t> batch_pv;            // for callers
+		std::vector<std::vector<float> > batch_ranks;     // for callers
+
+		// Solvers rely on the contents of the auxiliary vectors of previous
+		// solves over the same KB. Drop them if the KB changed.
+		void check_kb(const Kb & kb);
+		size_t kb_generation;
+
+		// Counters of the computations done with the workspace. They are
+		// never reset; callers (e.g. the server statistics) look at the
+		// difference before and after a computation.
+		struct stats_t {
+			size_t solves;     // PageRank computations
+			size_t iterations; // power method iterations
+			double pv_us;      // microseconds building personalization vectors
+			double prank_us;   // microseconds running PageRank
+			stats_t() : solves(0), iterations(0), pv_us(0.0), prank_us(0.0) {}
+		};
+		stats_t stats;
+
+		PrankWorkspace() : kb_generation(0) {}
+
+		static PrankWorkspace & local();
+	};
+
+	// Scratch vectors for targeted bfs (see Kb::bfs).
+	//
+	// Vertices are marked as visited (or as targets) with the number of the
+	// current search, so that a new search does not need to reset |V|
+	// elements, and its cost only depends on the part of the graph it
+	// explores. As with PrankWorkspace, a workspace can not be shared among
+	// threads.
+
+	struct BfsWorkspace {
+		std::vector<unsigned int> visited;          // search number of visited vertices
+		std::vector<unsigned int> target;           // search number of target vertices
+		std::vector<Kb::vertex_descriptor> parents; // only valid for visited vertices
+		std::vector<Kb::vertex_descriptor> queue;   // vertices in visiting order
+		unsigned int search;                        // number of current search
+
+		BfsWorkspace() : search(0) {}
+
+		// Start a new search over a graph of m vertices
+		void new_search(size_t m);
+
+		bool reached(Kb::vertex_descriptor v) const { return visited[v] == search; }
+
+		// Parent of v in the last search tree. As with Kb::bfs, the parent of
+		// both the source and the vertices not reached is themselves.
+		Kb::vertex_descriptor parent(Kb::vertex_descriptor v) const {
+			return reached(v) ? parents[v] : v;
+		}
+
+		static BfsWorkspace & local();
+	};
+
+	// Bfs tree from src, truncated to the first vertices in visiting order
+	// (see Kb::bfs_tree), with their parents. Parents are the same as in
+	// the (targeted) bfs from src.
+
+	struct BfsTree {
+		typedef std::pair<Kb::vertex_descriptor, Kb::vertex_descriptor> vp_t;
+
+		Kb::vertex_descriptor src;
+		size_t max_depth;            // of the search (0 means no limit)
+		bool complete;               // every vertex reachable is in the tree
+		std::vector<vp_t> parents;   // (vertex, parent), sorted by vertex
+
+		BfsTree(const Kb & kb, Kb::vertex_descriptor src, size_t max_depth,
+				size_t max_vertices, BfsWorkspace & ws);
+
+		bool contains(Kb::vertex_descriptor v) const;
+
+		// As with Kb::bfs, the parent of both src and the vertices not in
+		// the tree is themselves.
+		Kb::vertex_descriptor operator[](Kb::vertex_descriptor v) const;
+
+		// Whether the search from src towards targets would give the same
+		// parents to all targets
+		bool covers(const std::vector<Kb::vertex_descriptor> & targets) const;
+
+		size_t bytes() const;
+	};
+
+	// BfsTreeCache
+	//
+	// LRU cache of truncated bfs trees, keyed by source, shared by all
+	// threads. Trees of up to max_vertices vertices are kept until they
+	// take more than capacity bytes altogether (zero disables the cache).
+	// Only sources asked for more than once get a tree, as building it
+	// costs more than a (targeted) search. Trees of older KB versions are
+	// dropped.
+
+	class BfsTreeCache {
+
+	public:
+		typedef boost::shared_ptr<const BfsTree> tree_t;
+
+		BfsTreeCache(size_t capacity = 0, size_t max_vertices = 0);
+
+		size_t capacity() const { return m_capacity; }
+
+		// Tree of the bfs from src over kb, built (with ws) if not cached.
+		// Null if src was not asked for recently.
+		tree_t get(const Kb & kb, Kb::vertex_descriptor src, size_t max_depth,
+				   BfsWorkspace & ws);
+
+		// Drop all trees, e.g. those of the old KB after a reload (get()
+		// would drop them at the first lookup on the new one, anyway)
+		void clear();
+
+		// write counters, one "name value" pair per line
+		void stats(std::ostream & o, const std::string & prefix);
+
+	private:
+
+		void shrink();
+
+		static const size_t seen_max = 1 << 16;
+
+		typedef std::list<tree_t> list_t; // most recent first
+		typedef boost::unordered_map<Kb::vertex_descriptor, list_t::iterator> map_t;
+
+		list_t m_lru;
+		map_t m_map;
+		boost::unordered_set<Kb::vertex_descriptor> m_seen; // sources asked for, without tree
+		size_t m_capacity;
+		size_t m_max_vertices;
+		size_t m_bytes;
+		size_t m_kb_generation;
+		size_t m_hits;
+		size_t m_misses;
+		boost::mutex m_mutex;
+	};
+
+	// Scratch vectors for the bidirectional search of Kb::shortest_path.
+	// As with BfsWorkspace, marks are search numbers.
+
+	struct PathWorkspace {
+		std::vector<unsigned int> fwd_seen;         // seen from the source
+		std::vector<unsigned int> bwd_seen;         // seen from the target
+		std::vector<unsigned int> fwd_depth;
+		std::vector<unsigned int> bwd_depth;
+		std::vector<unsigned int> on_path;          // in some shortest path
+		std::vector<unsigned int> path_depth;       // and its distance to the source
+		std::vector<Kb::vertex_descriptor> fwd_front;
+		std::vector<Kb::vertex_descriptor> bwd_front;
+		std::vector<Kb::vertex_descriptor> next_front;
+		std::vector<Kb::vertex_descriptor> meet;    // seen from both sides
+		unsigned int fwd_d;                         // depth of each side
+		unsigned int bwd_d;
+		unsigned int search;                        // number of current search
+
+		PathWorkspace() : fwd_d(0), bwd_d(0), search(0) {}
+
+		// Start a new search over a graph of m vertices
+		void new_search(size_t m);
+
+		static PathWorkspace & local();
+	};
+
+	// Subgraph of a KB (see Kb::khop_subgraph), in CSR form over its own
+	// vertex ids 0 ... size() - 1. Vertex i is vertices[i] in the KB, whose
+	// name is kb.get_vertex_name(vertices[i]).
+
+	struct KbSubgraph {
+		std::vector<Kb::vertex_descriptor> vertices; // KB vertex of each vertex
+		std::vector<unsigned int> depth;             // edges away from the closest seed
+		std::vector<size_t> rowstart;                // out edges of i are [rowstart[i], rowstart[i+1])
+		std::vector<unsigned int> column;            // target of each edge
+		std::vector<size_t> edges;                   // KB edge index of each edge
+
+		size_t size() const { return vertices.size(); }
+		size_t edge_size() const { return column.size(); }
+
+		// KB edge of edge j, an out edge of vertex i
+		Kb::edge_descriptor kb_edge(size_t i, size_t j) const {
+			return Kb::edge_descriptor(vertices[i], edges[j]);
+		}
+	};
+
+	// Scratch vectors for Kb::khop_subgraph. As with BfsWorkspace, marks
+	// are search numbers.
+
+	struct SubgraphWorkspace {
+		std::vector<unsigned int> visited;          // search number of visited vertices
+		std::vector<unsigned int> idx;              // subgraph id, only valid for visited vertices
+		unsigned int search;                        // number of current search
+
+		SubgraphWorkspace() : search(0) {}
+
+		// Start a new search over a graph of m vertices
+		void new_search(size_t m);
+
+		bool reached(Kb::vertex_descriptor v) const { return visited[v] == search; }
+
+		static SubgraphWorkspace & local();
+	};
+
+	// Scratch vectors for depth limited dfs (see Kb::dfs). As with
+	// BfsWorkspace, marks are search numbers.
+
+	struct DfsWorkspace {
+		std::vector<unsigned int> visited;       // search number of visited vertices
+		std::vector<unsigned int> target;        // search number of target vertices
+		std::vector<Kb::edge_descriptor> path;   // edges from src to the current vertex
+		std::vector<std::pair<Kb::out_edge_iterator, Kb::out_edge_iterator> > stack; // edges left, per path vertex
+		unsigned int search;                     // number of current search
+
+		DfsWorkspace() : search(0) {}
+
+		// Start a new search over a graph of m vertices
+		void new_search(size_t m);
+
+		// n workspaces for the calling thread (the calling thread may use
+		// the first one, and hand the others to helper threads)
+		static std::vector<DfsWorkspace> & local(size_t n);
+	};
+
+	// Scratch vectors for Dijkstra with rank costs (see Kb::dijkstra). As
+	// with BfsWorkspace, marks are search numbers.
+
+	struct DijkstraWorkspace {
+		std::vector<unsigned int> visited;          // search number of discovered vertices
+		std::vector<unsigned int> finished;         // search number of finished vertices
+		std::vector<unsigned int> target;           // search number of target vertices
+		std::vector<float> dist;                    // only valid for visited vertices
+		std::vector<Kb::vertex_descriptor> parents; // only valid for visited vertices
+		std::vector<size_t> heap_index;             // position of vertices in the heap
+		unsigned int search;                        // number of current search
+
+		DijkstraWorkspace() : search(0) {}
+
+		// Start a new search over a graph of m vertices
+		void new_search(size_t m);
+
+		bool reached(Kb::vertex_descriptor v) const { return finished[v] == search; }
+
+		// Parent of v in the last search tree. The parent of both the
+		// source and the vertices not reached is themselves.
+		Kb::vertex_descriptor parent(Kb::vertex_descriptor v) const {
+			return reached(v) ? parents[v] : v;
+		}
+
+		static DijkstraWorkspace & local();
+	};
+
+	// Scratch vectors for multi-source bfs (see Kb::bfs).
+	//
+	// Every vertex keeps a bitmask with the searches which reached it, so
+	// that the edges of a vertex are scanned once per level for all the
+	// searches, and the depth of the vertex in each search. Parents are not
+	// kept during the search, as that takes a cache line per (search,
+	// vertex) pair. parent() finds them afterwards, from the depths, for
+	// the vertices in the paths which are asked for. Only the vertices
+	// reached in the previous call are reset.
+
+	struct MsBfsWorkspace {
+		typedef boost::uint64_t mask_t;
+		typedef boost::uint16_t depth_t;
+		static const size_t max_sources = 64;
+		static const size_t max_depth = 0xFFFF; // deeper vertices are not reached
+
+		std::vector<mask_t> seen;    // searches which reached each vertex
+		std::vector<mask_t> visit;   // searches with each vertex in the current level
+		std::vector<mask_t> next;    // searches which reach each vertex in the next level
+		std::vector<mask_t> target;  // searches with each vertex as target
+		std::vector<depth_t> depths; // depth of vertex v in search i at v * width + i
+		std::vector<Kb::vertex_descriptor> touched;        // vertices with seen != 0
+		std::vector<Kb::vertex_descriptor> frontier;       // current level
+		std::vector<Kb::vertex_descriptor> next_frontier;  // next level
+
+		MsBfsWorkspace() : width(0), m_kb(0) {}
+
+		bool reached(size_t i, Kb::vertex_descriptor v) const { return (seen[v] >> i) & 1; }
+		size_t depth(size_t i, Kb::vertex_descriptor v) const { return depths[v * width + i]; }
+
+		// Parent of v in the tree of search i, the same as with a bfs from
+		// srcs[i] alone. As with Kb::bfs, the parent of both the source and
+		// the vertices not reached is themselves.
+		Kb::vertex_descriptor parent(size_t i, Kb::vertex_descriptor v);
+
+		static MsBfsWorkspace & local();
+		// n workspaces for the calling thread (as DfsWorkspace::local)
+		static std::vector<MsBfsWorkspace> & local(size_t n);
+
+	private:
+		friend class Kb;
+
+		// Start n searches over kb
+		void new_search(const Kb * kb, size_t n);
+		const Kb::boost_graph_t & graph() const { return *m_kb->m_g; }
+
+		// parents found so far
+		struct tree_node_t {
+			Kb::vertex_descriptor parent;
+			size_t edge; // index of the edge from parent among its out edges
+		};
+		typedef boost::unordered_map<Kb::vertex_descriptor, tree_node_t> tree_t;
+		const tree_node_t & tree_node(size_t i, Kb::vertex_descriptor v);
+		bool before(size_t i, Kb::vertex_descriptor u, Kb::vertex_descriptor v);
+
+		size_t width;                // number of searches
+		const Kb * m_kb;
+		std::vector<Kb::vertex_descriptor> m_srcs;
+		std::vector<tree_t> m_trees; // parents found so far, per search
+	};
+
+	// Wall clock, in microseconds (for PrankWorkspace::stats)
+	double prank_clock_us();
 }
 
 #endif
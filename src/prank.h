@@ -50,6 +50,31 @@ namespace ukb {
 			V store;
 		};
 
+		//
+		// a view of a sparse personalization vector, given as a range of
+		// (vertex, weight) pairs sorted by vertex. Vertices not in the range
+		// have zero weight.
+		//
+		// Note: vertices must be accessed in increasing order. update_pRank
+		// does so, and gets a fresh copy of the map on every iteration.
+		//
+
+		template<typename It>
+		class sparse_pv_map {
+		public:
+			sparse_pv_map(It begin, It end) : m_it(begin), m_end(end) {}
+
+			template<typename K>
+			inline float operator[](const K & v) {
+				while(m_it != m_end && m_it->first < v) ++m_it;
+				if (m_it != m_end && m_it->first == v) return m_it->second;
+				return 0.0f;
+			}
+		private:
+			It m_it;
+			It m_end;
+		};
+
 		////////////////////////////////
 		//
 		// Init out_coefs so that out_coefs[v] has the sum of weights of
@@ -148,7 +173,7 @@ namespace ukb {
 		//
 
 		template<typename G, typename ppvMap_t, typename wMap_t, typename map1_t, typename map2_t>
-		void do_pageRank(G & g,
+		int do_pageRank(G & g,
 						 size_t N,
 						 ppvMap_t ppv_V,
 						 wMap_t & wmap,
@@ -159,7 +184,7 @@ namespace ukb {
 						 float damping,
 						 const std::vector<float> & out_coef) {
 
-			if (N == 0) return;
+			if (N == 0) return 0;
 			if (iterations == 0 && threshold == 0.0)
 				throw std::runtime_error("prank error: iterations and threshold are set to zero!\n");
 			if (!iterations) iterations = std::numeric_limits<int>::max();
@@ -180,7 +205,9 @@ namespace ukb {
 
 			bool to_map_2 = true;
 			float residual = 0.0;
+			int done = 0; // number of iterations
 			while(iterations--) {
+				++done;
 				// Update to the appropriate rank map
 				if (to_map_2)
 					residual = update_pRank(g, V, damping, ppv_V, out_coef, wmap, rank_map1, rank_map2);
@@ -199,9 +226,119 @@ namespace ukb {
 					rank_map1[*v] = rank_map2[*v];
 				}
 			}
+			return done;
 		}
 
 
+		//
+		// Power method for a batch of (sparse) personalization vectors.
+		//
+		// Ranks are interleaved, R[v * B + b] being the rank of vertex v for
+		// vector b, so that every in-edge is loaded once per iteration for
+		// the whole batch. Each vector goes through exactly the same
+		// computation as with do_pageRank, and stops iterating when it
+		// converges. The final ranks of vector b are copied to ranks[b].
+		//
+		// R2 must have zeros in the elements of isolated vertices, as the
+		// auxiliary vector of do_pageRank. Returns the number of iterations
+		// of the whole batch (that of the slowest vector).
+		//
+
+		template<typename G, typename ppvIt_t, typename wMap_t>
+		int do_pageRank_batch(G & g,
+							   size_t N,
+							   const std::vector<std::pair<ppvIt_t, ppvIt_t> > & ppvs,
+							   wMap_t & wmap,
+							   std::vector<float> & R1,
+							   std::vector<float> & R2,
+							   const std::vector<float *> & ranks,
+							   int iterations,
+							   float threshold,
+							   float damping,
+							   const std::vector<float> & out_coef) {
+
+			typedef typename graph_traits<G>::vertex_descriptor vertex_descriptor;
+
+			if (N == 0) return 0;
+			if (iterations == 0 && threshold == 0.0)
+				throw std::runtime_error("prank error: iterations and threshold are set to zero!\n");
+			if (!iterations) iterations = std::numeric_limits<int>::max();
+
+			const size_t B = ppvs.size();
+			const size_t nv = num_vertices(g);
+			std::pair<typename graph_traits<G>::vertex_iterator,
+					  typename graph_traits<G>::vertex_iterator> V = vertices(g);
+
+			const float init_value = 1.0f/static_cast<float>(N);
+			std::fill(R1.begin(), R1.begin() + nv * B, init_value);
+
+			std::vector<size_t> active(B); // vectors still iterating
+			for(size_t b = 0; b < B; ++b) active[b] = b;
+			std::vector<float> acc(B);
+			std::vector<float> norm(B);
+			std::vector<sparse_pv_map<ppvIt_t> > ppv_V;
+
+			bool to_map_2 = true;
+			int done = 0; // number of iterations
+			while(iterations-- && active.size()) {
+				++done;
+				std::vector<float> & from = to_map_2 ? R1 : R2;
+				std::vector<float> & to = to_map_2 ? R2 : R1;
+				const size_t A = active.size();
+				ppv_V.clear();
+				for(size_t k = 0; k < A; ++k) {
+					ppv_V.push_back(sparse_pv_map<ppvIt_t>(ppvs[active[k]].first, ppvs[active[k]].second));
+					norm[k] = 0.0;
+				}
+				typename graph_traits<G>::vertex_iterator v_it = V.first;
+				for (; v_it != V.second; ++v_it) {
+					vertex_descriptor v(*v_it);
+					if (-1.0 == out_coef[v]) continue;
+					for(size_t k = 0; k < A; ++k) acc[k] = 0.0;
+					typename graph_traits<G>::in_edge_iterator e, e_end;
+					boost::tie(e, e_end) = in_edges(v, g);
+					for(; e != e_end; ++e) {
+						vertex_descriptor u = source(*e, g);
+						const float w = wmap[*e];
+						const float c = out_coef[u];
+						const float *r1 = &from[u * B];
+						for(size_t k = 0; k < A; ++k)
+							acc[k] += r1[active[k]] * w * c;
+					}
+					for(size_t k = 0; k < A; ++k) {
+						size_t i = v * B + active[k];
+						float dangling_factor = 0.0;
+						if (0.0 == out_coef[v]) {
+							// dangling link
+							dangling_factor = damping * from[i];
+						}
+						to[i] = damping * acc[k] + (dangling_factor + 1.0 - damping ) * ppv_V[k][v];
+						norm[k] += fabs(to[i] - from[i]);
+					}
+				}
+				// copy out converged vectors
+				size_t j = 0;
+				for(size_t k = 0; k < A; ++k) {
+					size_t b = active[k];
+					if (norm[k] < threshold) {
+						for(size_t i = 0; i < nv; ++i) ranks[b][i] = to[i * B + b];
+					} else {
+						active[j++] = b;
+					}
+				}
+				active.resize(j);
+				to_map_2 = !to_map_2;
+			}
+
+			// vectors stopped by the number of iterations
+			const std::vector<float> & last = to_map_2 ? R1 : R2;
+			for(size_t k = 0; k < active.size(); ++k) {
+				size_t b = active[k];
+				for(size_t i = 0; i < nv; ++i) ranks[b][i] = last[i * B + b];
+			}
+			return done;
+		}
+
 		/////////////////////////////////////////////////////////////////
 		// PageRank iteration
 		//
@@ -255,33 +392,37 @@ namespace ukb {
 		// node. This implementation extends the original algorithm so that it
 		// takes any personalized vector as input (in original formulation all
 		// mass of the pv is concentrated in a single node, the seed node).
+		// The pv is given as a range of (vertex, weight) pairs sorted by
+		// vertex, so only the nonzero entries are visited. r is scratch space
+		// for the residual vector.
 		//
 		// See: Local Graph Partitioning using PageRank Vectors by R. Andersen, F. Chung and K. Lang
 		// URL: http://www.math.ucsd.edu/~fan/wp/localpartition.pdf
 
 
-		template<class G>
+		template<class G, typename ppvIt_t>
 		void pageRank_nibble(G & g,
-							 const std::vector<float> & ppv_map,
+							 ppvIt_t ppv_it,
+							 ppvIt_t ppv_end,
 							 const std::vector<float> & out_coefs,
 							 float damping,
 							 float epsilon,
-							 std::vector<float> & p) {
+							 std::vector<float> & p,
+							 std::vector<float> & r) {
 
 			typedef typename boost::graph_traits<G>::vertex_descriptor vertex_descriptor;
 			typedef typename boost::graph_traits<G>::adjacency_iterator adjacency_iterator;
-			typedef typename boost::graph_traits<G>::vertex_iterator vertex_iterator;
 
 			boost::unordered_set<vertex_descriptor> S;
 			std::queue<vertex_descriptor> Q;
-			std::vector<float> r(ppv_map);
+			r.assign(num_vertices(g), 0.0f);
 			std::fill(p.begin(), p.end(), 0.0f);
 
-			vertex_iterator it, end;
-			boost::tie(it, end) = vertices(g);
-			for(; it != end; ++it) {
-				if (r[*it] * out_coefs[*it] >= epsilon) {
-					S.insert(*it); Q.push(*it);
+			for(; ppv_it != ppv_end; ++ppv_it) {
+				vertex_descriptor v = ppv_it->first;
+				r[v] = ppv_it->second;
+				if (r[v] * out_coefs[v] >= epsilon) {
+					S.insert(v); Q.push(v);
 				}
 			}
 			while(Q.size()) {
@@ -311,28 +452,29 @@ namespace ukb {
 		// the main difference is that this version uses a lazy random walk model
 
 
-		template<class G>
+		template<class G, typename ppvIt_t>
 		void pageRank_nibble_lazy(G & g,
-								  const std::vector<float> & ppv_map,
+								  ppvIt_t ppv_it,
+								  ppvIt_t ppv_end,
 								  const std::vector<float> & out_coefs,
 								  float damping,
 								  float epsilon,
-								  std::vector<float> & p) {
+								  std::vector<float> & p,
+								  std::vector<float> & r) {
 
 			typedef typename boost::graph_traits<G>::vertex_descriptor vertex_descriptor;
 			typedef typename boost::graph_traits<G>::adjacency_iterator adjacency_iterator;
-			typedef typename boost::graph_traits<G>::vertex_iterator vertex_iterator;
 
 			boost::unordered_set<vertex_descriptor> S;
 			std::queue<vertex_descriptor> Q;
-			std::vector<float> r(ppv_map);
+			r.assign(num_vertices(g), 0.0f);
 			std::fill(p.begin(), p.end(), 0.0f);
 
-			vertex_iterator it, end;
-			boost::tie(it, end) = vertices(g);
-			for(; it != end; ++it) {
-				if (r[*it] * out_coefs[*it] >= epsilon) {
-					S.insert(*it); Q.push(*it);
+			for(; ppv_it != ppv_end; ++ppv_it) {
+				vertex_descriptor v = ppv_it->first;
+				r[v] = ppv_it->second;
+				if (r[v] * out_coefs[v] >= epsilon) {
+					S.insert(v); Q.push(v);
 				}
 			}
 			while(Q.size()) {
@@ -357,28 +499,29 @@ namespace ukb {
 			}
 		}
 
-		template<class G>
+		template<class G, typename ppvIt_t>
 		void pageRank_nibble_snap(G & g,
-								  const std::vector<float> & ppv_map,
+								  ppvIt_t ppv_it,
+								  ppvIt_t ppv_end,
 								  const std::vector<float> & out_coefs,
 								  float damping,
 								  float epsilon,
-								  std::vector<float> & p) {
+								  std::vector<float> & p,
+								  std::vector<float> & r) {
 
 			typedef typename boost::graph_traits<G>::vertex_descriptor vertex_descriptor;
 			typedef typename boost::graph_traits<G>::adjacency_iterator adjacency_iterator;
-			typedef typename boost::graph_traits<G>::vertex_iterator vertex_iterator;
 
 			boost::unordered_set<vertex_descriptor> S;
 			std::queue<vertex_descriptor> Q;
-			std::vector<float> r(ppv_map);
+			r.assign(num_vertices(g), 0.0f);
 			std::fill(p.begin(), p.end(), 0.0f);
 
-			vertex_iterator it, end;
-			boost::tie(it, end) = vertices(g);
-			for(; it != end; ++it) {
-				if (r[*it] * out_coefs[*it] >= epsilon) {
-					S.insert(*it); Q.push(*it);
+			for(; ppv_it != ppv_end; ++ppv_it) {
+				vertex_descriptor v = ppv_it->first;
+				r[v] = ppv_it->second;
+				if (r[v] * out_coefs[v] >= epsilon) {
+					S.insert(v); Q.push(v);
 				}
 			}
 			while(Q.size()) {
@@ -1,23 +1,41 @@
 #ifdef UKB_SERVER
 
 #include "ukbServer.h"
+#include "globalVars.h"
 // for deamon
 #include <iostream>
 #include <syslog.h>
 #include <unistd.h>
+#include <climits>
+#include <csignal>
+#include <ctime>
+#include <map>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <boost/asio/signal_set.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/array.hpp>
 #include <vector>
+#include <cstring>
+#include <algorithm>
 
 namespace ukb {
 
-int start_no_daemon(unsigned int port, void (*load_kb_dict)(bool), bool (*func)(sSession &), int concurrency) {
+  std::string sEndpoint::str() const {
+	if (is_local()) return "socket " + path;
+	return "port " + boost::lexical_cast<std::string>(port);
+  }
+
+int start_no_daemon(const sEndpoint & ep, void (*load_kb_dict)(bool), sCmd_func cmd, sReq_func req,
+					int concurrency, int processes, const sBatchConfig & batch) {
 
   boost::asio::io_service io_service;
   sServer *server;
   try {
-    server = new sServer(io_service, port, func);
+    server = new sServer(io_service, ep, cmd, req, batch);
   } catch (std::exception& e) {
     std::cerr << "[E] can not start daemon: " << e.what() << std::endl;
     exit(1);
@@ -27,21 +45,7 @@ int start_no_daemon(unsigned int port, void (*load_kb_dict)(bool), bool (*func)(
 
   (*load_kb_dict)(true); // 'true' because we call it from the daemon
 
-
-  // Create a pool of threads to run all of the io_services.
-  std::vector<boost::shared_ptr<boost::thread> > threads;
-  for (int i = 0; i < (concurrency-1); ++i)
-  {
-    boost::shared_ptr<boost::thread> thread(new boost::thread(
-          boost::bind(&boost::asio::io_service::run, &io_service)));
-    threads.push_back(thread);
-  }
-
-  io_service.run(); // Use main thread as worker
-
-  // Wait for all threads in the pool to exit.
-  for (std::size_t i = 0; i < threads.size(); ++i)
-    threads[i]->join();
+  server->run_prefork(processes, concurrency);
 
   delete server;
   return 0;
@@ -49,7 +53,8 @@ int start_no_daemon(unsigned int port, void (*load_kb_dict)(bool), bool (*func)(
 
 
 
-  int start_daemon(unsigned int port, void (*load_kb_dict)(bool), bool (*func)(sSession &), int concurrency) {
+  int start_daemon(const sEndpoint & ep, void (*load_kb_dict)(bool), sCmd_func cmd, sReq_func req,
+				   int concurrency, int processes, const sBatchConfig & batch) {
 
 	// Code "borrowed" from asio daemon example (boost license).
 
@@ -63,7 +68,7 @@ int start_no_daemon(unsigned int port, void (*load_kb_dict)(bool), bool (*func)(
 	  // Initialise the server before becoming a daemon. If the process is
 	  // started from a shell, this means any errors will be reported back to the
 	  // user.
-	  server = new sServer(io_service, port, func);
+	  server = new sServer(io_service, ep, cmd, req, batch);
 
 	} catch (std::exception& e) {
 	  std::cerr << "[E] can not start daemon: " << e.what() << std::endl;
@@ -206,24 +211,7 @@ int start_no_daemon(unsigned int port, void (*load_kb_dict)(bool), bool (*func)(
 	  syslog(LOG_INFO | LOG_USER, "UKB daemon started");
 	  close(fd[1]); // close up also the ouput pipe
 
-
-      // Create a pool of threads to run all of the io_services.
-      std::vector<boost::shared_ptr<boost::thread> > threads;
-      for (int i = 0; i < (concurrency-1); ++i)
-      {
-        boost::shared_ptr<boost::thread> thread(new boost::thread(
-              boost::bind(&boost::asio::io_service::run, &io_service)));
-        threads.push_back(thread);
-      }
-
-      io_service.run(); // Use main thread as worker
-
-      // Wait for all threads in the pool to exit.
-      for (std::size_t i = 0; i < threads.size(); ++i)
-        threads[i]->join();
-
-
-
+	  server->run_prefork(processes, concurrency);
 
 	  syslog(LOG_INFO | LOG_USER, "UKB daemon stopped");
 	} catch (std::exception& e) {
@@ -235,96 +223,528 @@ int start_no_daemon(unsigned int port, void (*load_kb_dict)(bool), bool (*func)(
 
   /////////////////////////////////////////////////////////////
   // sSession class
-
-  sSession::sSession(boost::asio::io_service& io, bool (*func)(sSession &))
-	: m_func(func),
-	  m_socket(io),
-	  m_reader(m_socket),
-      m_writer(m_socket)
+  //
+  // Everything but do_work runs in the io_service thread. do_work runs in a
+  // worker thread, and only touches m_reply (through send()). At most one
+  // do_work per session is in flight (m_busy).
+
+  sSession::sSession(sServer & server)
+	: m_server(server),
+	  m_socket(server.m_io),
+	  m_cmd_seen(false),
+	  m_has_id(false),
+	  m_rid(0),
+	  m_v2_acked(false),
+	  m_busy(false),
+	  m_reading(false),
+	  m_writing(false),
+	  m_eof(false),
+	  m_closing(false),
+	  m_started(false)
   {
 
   }
 
-  boost::asio::ip::tcp::tcp::socket & sSession::socket() {
-	return m_socket;
+  sSession::~sSession() {
+	if (m_started) sStats::instance().count("sessions_active", -1);
   }
 
-  bool sSession::start() {
-	// Start synchronous operations
-	// By now, just call m_func
-    boost::asio::ip::tcp::no_delay option(true);
-    m_socket.set_option(option);
-	return (*m_func)(*this);
+  sSocket & sSession::socket() {
+	return m_socket;
   }
 
-  bool sSession::receive(std::string & result) {
-	return m_reader.read_string(result);
+  void sSession::start() {
+	if (!m_server.m_local) {
+	  boost::asio::ip::tcp::no_delay option(true);
+	  m_socket.set_option(option);
+	}
+	m_started = true;
+	sStats::instance().count("sessions_accepted");
+	sStats::instance().count("sessions_active");
+	start_read();
   }
 
   void sSession::send(const std::string & line) {
-	m_writer.write_string(line);
+	protocol::encode_string(m_decoder.version(), line, m_rid, m_reply);
+  }
+
+  void sSession::start_read() {
+	if (m_reading || m_eof || m_closing) return;
+	if (m_work.size() >= max_pending) return; // resumed by work_done
+	m_reading = true;
+	m_socket.async_read_some(boost::asio::buffer(m_buf),
+							 boost::bind(&sSession::handle_read, shared_from_this(),
+										 boost::asio::placeholders::error,
+										 boost::asio::placeholders::bytes_transferred));
+  }
+
+  void sSession::handle_read(const boost::system::error_code & error, size_t len) {
+	m_reading = false;
+	if (error) {
+	  // EOF or socket error. Finish pending requests and close.
+	  m_eof = true;
+	  maybe_close();
+	  return;
+	}
+	try {
+	  m_decoder.push(m_buf, len);
+	  std::string str;
+	  boost::uint32_t rid;
+	  while(m_decoder.next(str, rid)) {
+		if (!m_cmd_seen) {
+		  m_work.push_back(work_t(true, rid, str, std::string()));
+		  m_cmd_seen = true;
+		} else if (!m_has_id) {
+		  m_id.swap(str);
+		  m_has_id = true;
+		} else {
+		  m_work.push_back(work_t(false, rid, m_id, str));
+		  m_has_id = false;
+		  sStats::instance().count("requests_queued");
+		}
+	  }
+	  if (m_decoder.version() == 2 && !m_v2_acked) {
+		// answer protocol v2 negotiation before any reply
+		m_wqueue.push_back(boost::shared_ptr<std::string>(new std::string(protocol::v2_magic, 4)));
+		m_v2_acked = true;
+		start_write();
+	  }
+	} catch (std::exception & e) {
+	  // malformed input. Drop the connection.
+	  std::cerr << "[E] sSession: " << e.what() << std::endl;
+	  m_closing = true;
+	  drop_work();
+	  maybe_close();
+	  return;
+	}
+	dispatch();
+	start_read();
+  }
+
+  // drop received requests, not yet handled
+
+  void sSession::drop_work() {
+	long n = 0;
+	for(size_t i = 0; i < m_work.size(); ++i)
+	  if (!m_work[i].is_cmd) ++n;
+	if (n) sStats::instance().count("requests_queued", -n);
+	m_work.clear();
+  }
+
+  // Requests waiting for a worker, and their latencies, are recorded when
+  // the worker starts and ends handling them
+
+  static void stats_request_start(const boost::posix_time::ptime & received) {
+	sStats & stats = sStats::instance();
+	stats.count("requests_queued", -1);
+	stats.time("queue", (boost::posix_time::microsec_clock::universal_time() - received).total_microseconds());
+  }
+
+  static void stats_request_end(const boost::posix_time::ptime & received, bool ok) {
+	sStats & stats = sStats::instance();
+	stats.count("requests");
+	if (!ok) stats.count("request_errors");
+	stats.time("request", (boost::posix_time::microsec_clock::universal_time() - received).total_microseconds());
+  }
+
+  void sSession::dispatch() {
+	if (m_busy || m_closing || m_work.empty()) return;
+	m_busy = true;
+	if (!m_work.front().is_cmd && m_server.batching())
+	  m_server.enqueue(shared_from_this(), m_work.front());
+	else
+	  m_server.m_work_io.post(boost::bind(&sSession::do_work, shared_from_this(), m_work.front()));
+	m_work.pop_front();
+  }
+
+  void sSession::do_work(const work_t & work) {
+	bool keep = true;
+	bool ok = true;
+	m_reply.clear();
+	m_rid = work.rid;
+	if (!work.is_cmd) stats_request_start(work.received);
+	try {
+	  if (work.is_cmd)
+		keep = (*m_server.m_cmd)(*this, work.id);
+	  else
+		(*m_server.m_req)(*this, work.id, work.ctx);
+	} catch (std::exception & e) {
+	  // send error and close the session
+	  send(e.what());
+	  ok = false;
+	}
+	if (work.is_cmd) sStats::instance().count("commands");
+	else stats_request_end(work.received, ok);
+	finish_work(ok, keep);
+  }
+
+  void sSession::finish_work(bool ok, bool keep) {
+	boost::shared_ptr<std::string> reply(new std::string);
+	reply->swap(m_reply);
+	m_server.m_io.post(boost::bind(&sSession::work_done, shared_from_this(), reply, ok, keep));
+  }
+
+  void sSession::work_done(boost::shared_ptr<std::string> reply, bool ok, bool keep) {
+	m_busy = false;
+	if (!keep) {
+	  // false means finish
+	  m_server.m_stopped = true;
+	  m_server.stop();
+	  return;
+	}
+	if (reply->size()) {
+	  m_wqueue.push_back(reply);
+	  start_write();
+	}
+	if (!ok) {
+	  m_closing = true;
+	  drop_work();
+	  maybe_close();
+	  return;
+	}
+	dispatch();
+	start_read(); // in case reading was stopped because of too many pending requests
+	maybe_close();
+  }
+
+  void sSession::start_write() {
+	if (m_writing || m_wqueue.empty()) return;
+	m_writing = true;
+	boost::asio::async_write(m_socket, boost::asio::buffer(*m_wqueue.front()),
+							 boost::bind(&sSession::handle_write, shared_from_this(),
+										 boost::asio::placeholders::error));
+  }
+
+  void sSession::handle_write(const boost::system::error_code & error) {
+	m_writing = false;
+	m_wqueue.pop_front();
+	if (error) {
+	  m_closing = true;
+	  drop_work();
+	  m_wqueue.clear();
+	}
+	start_write();
+	maybe_close();
+  }
+
+  void sSession::maybe_close() {
+	if (!m_eof && !m_closing) return;
+	if (m_busy || m_writing || !m_wqueue.empty()) return;
+	if (!m_closing && !m_work.empty()) return;
+	if (!m_socket.is_open()) return;
+	boost::system::error_code ignored;
+	m_socket.shutdown(sSocket::shutdown_both, ignored);
+	m_socket.close(ignored);
+	// The session is destroyed when the last handler holding it finishes.
   }
 
   //////////////////////////////////////////////////////////////
   // sServer class
 
-  sServer::sServer(boost::asio::io_service & io, unsigned int port, bool (*func)(sSession &)) :
+  sServer::sServer(boost::asio::io_service & io, const sEndpoint & ep, sCmd_func cmd, sReq_func req,
+				   const sBatchConfig & batch) :
 	m_io(io),
-	m_func(func),
-	m_endpoint(boost::asio::ip::tcp::tcp::v4(), port),
-	m_acceptor(m_io, m_endpoint) {
+	m_cmd(cmd),
+	m_req(req),
+	m_batch(batch),
+	m_batch_timer(io),
+	m_local(ep.is_local()),
+	m_owner(true),
+	m_stopped(false),
+	m_acceptor(m_io) {
+	boost::asio::generic::stream_protocol::endpoint endpoint;
+	if (m_local) {
+	  // daemons chdir to /, so keep the absolute path for removing the file
+	  m_path = ep.path;
+	  if (m_path[0] != '/') {
+		char cwd[PATH_MAX];
+		if (!getcwd(cwd, sizeof(cwd))) throw std::runtime_error("[E] sServer: can not get current directory");
+		m_path = std::string(cwd) + "/" + m_path;
+	  }
+	  endpoint = boost::asio::local::stream_protocol::endpoint(m_path);
+	  // remove stale socket files left by servers that did not stop
+	  // cleanly, but never the socket of a running server
+	  struct stat st;
+	  if (!stat(m_path.c_str(), &st) && S_ISSOCK(st.st_mode)) {
+		sSocket probe(m_io);
+		boost::system::error_code ec;
+		probe.connect(endpoint, ec);
+		if (!ec) throw std::runtime_error("sServer: " + m_path + " is in use by another server");
+		unlink(m_path.c_str());
+	  }
+	} else {
+	  endpoint = boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), ep.port);
+	}
+	m_acceptor.open(endpoint.protocol());
+	if (!m_local) m_acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+	m_acceptor.bind(endpoint);
+	m_acceptor.listen();
 	start_accept();
   }
 
+  sServer::~sServer() {
+	boost::system::error_code ignored;
+	m_acceptor.close(ignored);
+	if (m_local && m_owner) unlink(m_path.c_str());
+  }
+
+  void sServer::run(int concurrency) {
+
+	if (concurrency < 1) concurrency = 1;
+
+	// Create the pool of worker threads. The work object keeps them alive
+	// while there is nothing to do.
+	boost::scoped_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(m_work_io));
+	std::vector<boost::shared_ptr<boost::thread> > threads;
+	for (int i = 0; i < concurrency; ++i) {
+	  boost::shared_ptr<boost::thread> thread(new boost::thread(
+		  boost::bind(&boost::asio::io_service::run, &m_work_io)));
+	  threads.push_back(thread);
+	}
+
+	m_io.run(); // Use main thread for accepting and socket operations
+
+	// Server stopped. Wait for all threads in the pool to exit.
+	work.reset();
+	m_work_io.stop();
+	for (std::size_t i = 0; i < threads.size(); ++i)
+	  threads[i]->join();
+  }
+
+  void sServer::stop() {
+	m_io.stop();
+  }
+
+  // Prefork mode. The calling process (the master) blocks the signals it
+  // waits for before forking, so that they are handled by sigwait here and
+  // not by any asio signal_set. Workers restore the default action of those
+  // signals, so that a signal_set inherited from start_daemon does not stop
+  // them cleanly, and then restore the signal mask. A worker exits with
+  // worker_stop_status only when stopped by a client.
+
+  static const int worker_stop_status = 3;
+
+  pid_t sServer::fork_worker(int concurrency, const sigset_t & worker_mask) {
+	std::cout.flush();
+	std::cerr.flush();
+	m_io.notify_fork(boost::asio::io_service::fork_prepare);
+	pid_t pid = fork();
+	if (pid < 0) {
+	  m_io.notify_fork(boost::asio::io_service::fork_parent);
+	  throw std::runtime_error("sServer: fork failed");
+	}
+	if (pid) {
+	  m_io.notify_fork(boost::asio::io_service::fork_parent);
+	  return pid;
+	}
+	// worker process
+	m_io.notify_fork(boost::asio::io_service::fork_child);
+	m_owner = false;
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	pthread_sigmask(SIG_SETMASK, &worker_mask, 0);
+	int status = 0;
+	try {
+	  run(concurrency);
+	  if (m_stopped) status = worker_stop_status;
+	} catch (std::exception & e) {
+	  std::cerr << "[E] server worker " << getpid() << ": " << e.what() << std::endl;
+	  status = 1;
+	}
+	exit(status);
+  }
+
+  void sServer::run_prefork(int processes, int concurrency) {
+
+	if (processes < 2) {
+	  run(concurrency);
+	  return;
+	}
+
+	sigset_t wait_mask, worker_mask;
+	sigemptyset(&wait_mask);
+	sigaddset(&wait_mask, SIGCHLD);
+	sigaddset(&wait_mask, SIGTERM);
+	sigaddset(&wait_mask, SIGINT);
+	sigaddset(&wait_mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &wait_mask, &worker_mask);
+
+	// pid -> start time of worker
+	std::map<pid_t, time_t> workers;
+	for (int i = 0; i < processes; ++i)
+	  workers[fork_worker(concurrency, worker_mask)] = time(0);
+
+	bool stopping = false;
+	while (!workers.empty()) {
+	  int sig;
+	  if (sigwait(&wait_mask, &sig)) continue;
+	  if (sig != SIGCHLD) stopping = true;
+	  pid_t pid;
+	  int status;
+	  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		std::map<pid_t, time_t>::iterator it = workers.find(pid);
+		if (it == workers.end()) continue;
+		time_t started = it->second;
+		workers.erase(it);
+		if (stopping) continue;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == worker_stop_status) {
+		  // worker stopped by client
+		  stopping = true;
+		} else if (time(0) - started < 1) {
+		  // do not keep on forking workers which can not start
+		  std::cerr << "[E] server worker " << pid << " died at startup, stopping server" << std::endl;
+		  stopping = true;
+		} else {
+		  std::cerr << "[W] server worker " << pid << " died, starting a new one" << std::endl;
+		  workers[fork_worker(concurrency, worker_mask)] = time(0);
+		}
+	  }
+	  if (stopping) {
+		for (std::map<pid_t, time_t>::iterator it = workers.begin(); it != workers.end(); ++it)
+		  kill(it->first, SIGTERM);
+	  }
+	}
+	pthread_sigmask(SIG_SETMASK, &worker_mask, 0);
+  }
+
+  // Batching. enqueue, handle_batch_timer and flush_batch run in the
+  // io_service thread; do_batch in a worker thread.
+
+  void sServer::enqueue(boost::shared_ptr<sSession> session, const sSession::work_t & work) {
+	m_pending.push_back(std::make_pair(session, work));
+	if (m_pending.size() >= m_batch.max_size) {
+	  flush_batch();
+	} else if (m_pending.size() == 1) {
+	  m_batch_timer.expires_from_now(boost::posix_time::microseconds(m_batch.window_us));
+	  m_batch_timer.async_wait(boost::bind(&sServer::handle_batch_timer, this,
+										   boost::asio::placeholders::error));
+	}
+  }
+
+  void sServer::handle_batch_timer(const boost::system::error_code & error) {
+	if (error == boost::asio::error::operation_aborted) return;
+	flush_batch();
+  }
+
+  void sServer::flush_batch() {
+	if (m_pending.empty()) return;
+	m_batch_timer.cancel();
+	boost::shared_ptr<batch_t> batch(new batch_t);
+	batch->swap(m_pending);
+	m_work_io.post(boost::bind(&sServer::do_batch, this, batch));
+  }
+
+  void sServer::do_batch(boost::shared_ptr<batch_t> batch) {
+	// every request belongs to a different session (sessions have at most
+	// one request in flight)
+	std::vector<sRequest> reqs(batch->size());
+	for(size_t i = 0; i < batch->size(); ++i) {
+	  sSession & session = *(*batch)[i].first;
+	  const sSession::work_t & work = (*batch)[i].second;
+	  session.m_reply.clear();
+	  session.m_rid = work.rid;
+	  stats_request_start(work.received);
+	  reqs[i].session = &session;
+	  reqs[i].id = &work.id;
+	  reqs[i].ctx = &work.ctx;
+	}
+	try {
+	  (*m_batch.func)(reqs);
+	} catch (std::exception & e) {
+	  for(size_t i = 0; i < reqs.size(); ++i)
+		if (reqs[i].error.empty()) reqs[i].error = e.what();
+	}
+	sStats::instance().count("batches");
+	sStats::instance().count("batched_requests", reqs.size());
+	for(size_t i = 0; i < reqs.size(); ++i) {
+	  bool ok = reqs[i].error.empty();
+	  // send error and close the session
+	  if (!ok) reqs[i].session->send(reqs[i].error);
+	  stats_request_end((*batch)[i].second.received, ok);
+	  reqs[i].session->finish_work(ok, true);
+	}
+  }
+
   void sServer::start_accept() {
-	sSession *new_session = new sSession(m_io, m_func);
+	boost::shared_ptr<sSession> new_session(new sSession(*this));
 	m_acceptor.async_accept(new_session->socket(),
 							boost::bind(&sServer::handle_accept, this, new_session,
 										boost::asio::placeholders::error));
   }
 
-  void sServer::handle_accept(sSession *new_session,
+  void sServer::handle_accept(boost::shared_ptr<sSession> new_session,
 							  const boost::system::error_code& error) {
-	bool status = true;
 	if (!error) {
-      try {
-        status = new_session->start(); // false means finish
-      } catch (const std::runtime_error& e) {
-        std::cerr << "Runtime error: " << e.what() << std::endl;
-      }
-	}
-	delete new_session;
-	if (!status)
-	  m_io.stop();
-	else
-	  start_accept();
+	  try {
+		new_session->start();
+	  } catch (const std::exception& e) {
+		std::cerr << "Runtime error: " << e.what() << std::endl;
+	  }
+	}
+	start_accept();
   }
 
   //////////////////////////////////////////////////////////////
   // sClient
 
-  sClient::sClient(const std::string & host, unsigned int port) :
-	m_resolver(m_io),
-	m_query(host, boost::lexical_cast<std::string>(port)), //ask the dns for this resolver
+  sClient::sClient(const sEndpoint & ep) :
+	m_version(1),
+	m_ep(ep),
 	m_socket(m_io),
 	m_reader(m_socket),
     m_writer(m_socket)
   {
+	connect();
+	if (m_error) return;
+	if (!negotiate_v2()) {
+	  // the server closes the connection if it does not know protocol v2
+	  connect();
+	}
+  }
 
-	boost::asio::ip::tcp::tcp::resolver::iterator end;
+  void sClient::connect() {
 
-	m_error = boost::asio::error::host_not_found;
-	m_endpoint_iterator = m_resolver.resolve(m_query);
-	while (m_endpoint_iterator != end) {
+	m_reader.reset();
+	if (m_ep.is_local()) {
 	  m_socket.close();
-	  m_socket.connect(*m_endpoint_iterator, m_error);
-      if (!m_error) {
-          boost::asio::ip::tcp::no_delay option(true);
-          m_socket.set_option(option);
-          break;
-      }
-	  m_endpoint_iterator++;
+	  m_socket.connect(boost::asio::local::stream_protocol::endpoint(m_ep.path), m_error);
+	  return;
 	}
+
+	boost::asio::ip::tcp::resolver resolver(m_io);
+	boost::asio::ip::tcp::resolver::query query(m_ep.host, boost::lexical_cast<std::string>(m_ep.port)); //ask the dns for this resolver
+	boost::asio::ip::tcp::resolver::iterator it, end;
+	boost::system::error_code ec;
+	it = resolver.resolve(query, ec);
+	m_error = ec ? ec : boost::asio::error::host_not_found;
+	//iterate if multiple answers for a given name
+	for(; it != end; ++it) {
+	  m_socket.close();
+	  m_socket.connect(boost::asio::generic::stream_protocol::endpoint(it->endpoint()), m_error);
+	  if (!m_error) {
+		boost::asio::ip::tcp::no_delay option(true);
+		m_socket.set_option(option);
+		break;
+	  }
+	}
+  }
+
+  bool sClient::negotiate_v2() {
+	char answer[4];
+	try {
+	  m_writer.write_data(protocol::v2_magic, 4);
+	  if (!m_reader.read_data(answer, 4) && !memcmp(answer, protocol::v2_magic, 4)) {
+		m_version = 2;
+		m_reader.set_version(2);
+		m_writer.set_version(2);
+		return true;
+	  }
+	} catch (std::exception & e) {
+	  // any error means no v2
+	}
+	m_reader.reset();
+	return false;
   }
 
   boost::system::error_code sClient::error() const { return m_error; }
@@ -336,10 +756,188 @@ int start_no_daemon(unsigned int port, void (*load_kb_dict)(bool), bool (*func)(
 	return m_reader.read_string(result);
   }
 
-  void sClient::send(const std::string & line) {
+  bool sClient::receive(std::string & result, boost::uint32_t & rid) {
+	if (this->error())
+	  throw std::runtime_error(std::string("[E] sClient receive: ") + this->error_str());
+	return m_reader.read_string(result, rid);
+  }
+
+  void sClient::send(const std::string & line, boost::uint32_t rid) {
 	if (this->error())
 	  throw std::runtime_error(std::string("[E] sClient send: ") + this->error_str());
-	m_writer.write_string(line);
+	m_writer.write_string(line, rid);
+  }
+
+  //////////////////////////////////////////////////////////////
+  // sPipeline
+
+  sPipeline::sPipeline(sClient & client, size_t window, const std::string & end_marker) :
+	m_client(client),
+	m_window(window ? window : 1),
+	m_end(end_marker),
+	m_next_rid(1),
+	m_n(0),
+	m_start(boost::posix_time::microsec_clock::universal_time()) {}
+
+  void sPipeline::send(const std::string & id, const std::string & ctx) {
+	req_t req;
+	req.rid = m_next_rid++;
+	if (!m_next_rid) m_next_rid = 1; // 0 is the command
+	req.id = id;
+	req.done = false;
+	m_client.send(id, req.rid);
+	m_client.send(ctx, req.rid);
+	m_inflight.push_back(req);
+  }
+
+  bool sPipeline::receive(std::string & id, std::string & reply) {
+	if (m_inflight.empty()) return false;
+	std::string str;
+	boost::uint32_t rid;
+	while(!m_inflight.front().done) {
+	  if (!m_client.receive(str, rid)) {
+		// The server sends errors as a single string and closes the session.
+		throw std::runtime_error(std::string("[E] sPipeline: connection closed by server. ") + m_inflight.front().reply);
+	  }
+	  // requests ids are consecutive
+	  size_t i = m_client.version() == 2 ? static_cast<boost::uint32_t>(rid - m_inflight.front().rid) : 0;
+	  if (i >= m_inflight.size())
+		throw std::runtime_error(std::string("[E] sPipeline: unexpected request id ") + boost::lexical_cast<std::string>(rid));
+	  req_t & req = m_inflight[i];
+	  if (m_end.empty()) {
+		req.reply.swap(str);
+		req.done = true;
+	  } else if (str == m_end) {
+		req.done = true;
+	  } else {
+		req.reply += str;
+	  }
+	}
+	id.swap(m_inflight.front().id);
+	reply.swap(m_inflight.front().reply);
+	m_inflight.pop_front();
+	++m_n;
+	return true;
+  }
+
+  void sPipeline::report(std::ostream & o) const {
+	boost::posix_time::time_duration d = boost::posix_time::microsec_clock::universal_time() - m_start;
+	double secs = d.total_microseconds() / 1000000.0;
+	o << m_n << " contexts in " << secs << " secs";
+	if (secs > 0.0) o << " (" << m_n / secs << " contexts/sec)";
+	o << "\n";
+  }
+
+  //////////////////////////////////////////////////////////////
+  // sStats
+
+  sStats & sStats::instance() {
+	static sStats stats;
+	return stats;
+  }
+
+  sStats::sStats() : m_start(boost::posix_time::microsec_clock::universal_time()) {}
+
+  sStats::hist_t::hist_t() : n(0), total_us(0.0), max_us(0.0) {
+	std::fill(buckets, buckets + num_buckets, 0);
+  }
+
+  void sStats::count(const std::string & name, long n) {
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_counters[name] += n;
+  }
+
+  void sStats::time(const std::string & name, double us, size_t n) {
+	if (!n) return;
+	size_t b = 0;
+	while (b < num_buckets - 1 && us >= static_cast<double>(1UL << b)) ++b;
+	boost::mutex::scoped_lock lock(m_mutex);
+	hist_t & h = m_hists[name];
+	h.n += n;
+	h.total_us += us * n;
+	if (us > h.max_us) h.max_us = us;
+	h.buckets[b] += n;
+  }
+
+  // upper bound of the bucket holding the p-th fraction of the samples
+
+  double sStats::percentile(const hist_t & h, double p) const {
+	size_t rank = static_cast<size_t>(p * h.n);
+	size_t acc = 0;
+	for(size_t b = 0; b < num_buckets; ++b) {
+	  acc += h.buckets[b];
+	  if (acc > rank) return std::min(static_cast<double>(1UL << b), h.max_us);
+	}
+	return h.max_us;
+  }
+
+  void sStats::print(std::ostream & o) const {
+	boost::mutex::scoped_lock lock(m_mutex);
+	boost::posix_time::time_duration up = boost::posix_time::microsec_clock::universal_time() - m_start;
+	o << "pid " << getpid() << "\n";
+	o << "uptime_secs " << up.total_seconds() << "\n";
+	for(std::map<std::string, long>::const_iterator it = m_counters.begin(); it != m_counters.end(); ++it)
+	  o << it->first << " " << it->second << "\n";
+	for(std::map<std::string, hist_t>::const_iterator it = m_hists.begin(); it != m_hists.end(); ++it) {
+	  const std::string & name = it->first;
+	  const hist_t & h = it->second;
+	  if (!h.n) continue;
+	  o << name << "_count " << h.n << "\n"
+		<< name << "_mean_us " << h.total_us / h.n << "\n"
+		<< name << "_p50_us " << percentile(h, 0.5) << "\n"
+		<< name << "_p90_us " << percentile(h, 0.9) << "\n"
+		<< name << "_p99_us " << percentile(h, 0.99) << "\n"
+		<< name << "_max_us " << h.max_us << "\n";
+	  // non empty buckets, as upper_bound:samples
+	  o << name << "_hist_us";
+	  for(size_t b = 0; b < num_buckets; ++b)
+		if (h.buckets[b]) o << " " << (1UL << b) << ":" << h.buckets[b];
+	  o << "\n";
+	}
+  }
+
+  void stats_phases(const PrankWorkspace::stats_t & before, const PrankWorkspace::stats_t & after,
+					size_t n, double run_us) {
+	if (!n) return;
+	sStats & stats = sStats::instance();
+	double pv_us = after.pv_us - before.pv_us;
+	double prank_us = after.prank_us - before.prank_us;
+	stats.time("phase_pv", pv_us / n, n);
+	stats.time("phase_pagerank", prank_us / n, n);
+	if (run_us >= 0.0)
+	  stats.time("phase_disamb", std::max(0.0, run_us - pv_us - prank_us) / n, n);
+	stats.count("pagerank_solves", after.solves - before.solves);
+	stats.count("pagerank_iterations", after.iterations - before.iterations);
+  }
+
+  //////////////////////////////////////////////////////////////
+  // hot reload
+
+  static boost::mutex reload_mutex;
+  static bool reload_running = false;
+
+  static void run_reload(void (*reload)()) {
+	sStats & stats = sStats::instance();
+	try {
+	  syslog(LOG_INFO | LOG_USER, "Reloading KB %s", glVars::kb::fname.c_str());
+	  reload();
+	  stats.count("reloads");
+	  syslog(LOG_INFO | LOG_USER, "KB and dictionary reloaded");
+	} catch (std::exception & e) {
+	  stats.count("reload_errors");
+	  syslog(LOG_ERR | LOG_USER, "[E] reload: %s", e.what());
+	}
+	boost::mutex::scoped_lock lock(reload_mutex);
+	reload_running = false;
+  }
+
+  std::string start_reload(void (*reload)(), size_t prefork) {
+	if (prefork > 1) return "[E] reload: not available with --prefork\n";
+	boost::mutex::scoped_lock lock(reload_mutex);
+	if (reload_running) return "[E] reload: already reloading\n";
+	reload_running = true;
+	boost::thread(boost::bind(&run_reload, reload)).detach();
+	return "reloading KB and dictionary (see kb_generation in stats)\n";
   }
 
   //////////////////////////////////////////////////////////////
@@ -347,19 +945,62 @@ int start_no_daemon(unsigned int port, void (*load_kb_dict)(bool), bool (*func)(
 
   namespace protocol {
 
+	const char v2_magic[4] = {'U', 'K', 'B', '2'};
+
+	size_t encode_header(int version, size_t N, boost::uint32_t rid, char *hdr) {
+	  if (version == 2) {
+		if (N > 0xffffffffUL)
+		  throw std::runtime_error(std::string("[E] protocol: string too long"));
+		put_le32(static_cast<boost::uint32_t>(N), hdr);
+		put_le32(rid, hdr + 4);
+		return v2_header_size;
+	  }
+	  std::string str = boost::lexical_cast<std::string>(N);
+	  hdr[0] = static_cast<char>('0' + str.size());
+	  memcpy(hdr + 1, str.data(), str.size());
+	  return 1 + str.size();
+	}
+
+	void encode_string(int version, const std::string & line, boost::uint32_t rid, std::string & out) {
+	  size_t N = line.size();
+	  if(!N) return;
+	  char hdr[24];
+	  size_t h = encode_header(version, N, rid, hdr);
+	  out.append(hdr, h);
+	  out += line;
+	}
+
 	//////////////////////////////////////////////////////////////
 	// sRead class
 
-	sRead::sRead(boost::asio::ip::tcp::tcp::socket & socket) :
+	sRead::sRead(sSocket & socket) :
 	  m_socket(socket),
 	  m_left(&m_buf[0]),
-	  m_right(m_left) {}
-
+	  m_right(m_left),
+	  m_version(1) {}
 
 	bool sRead::read_string(std::string & out) {
+	  boost::uint32_t rid;
+	  return read_string(out, rid);
+	}
+
+	bool sRead::read_string(std::string & out, boost::uint32_t & rid) {
 	  std::string().swap(out); // empty line
-	  size_t N = read_size(); // get string size
-	  if (!N) return false; // EOF
+	  rid = 0;
+	  size_t N;
+	  if (m_version == 2) {
+		char hdr[v2_header_size];
+		size_t left = read_data(hdr, v2_header_size);
+		if (left == v2_header_size) return false; // EOF
+		if (left)
+		  throw std::runtime_error(std::string("[E] read_string: Connection unexpectedly closed by peer.\n"));
+		N = get_le32(hdr);
+		rid = get_le32(hdr + 4);
+		if (!N) return true;
+	  } else {
+		N = read_size(); // get string size
+		if (!N) return false; // EOF
+	  }
 	  if (read_nstring(out, N)) {
 		// Connection unexpectedly closed by peer.
 		throw std::runtime_error(std::string("[E] read_string: Connection unexpectedly closed by peer.\n"));
@@ -379,20 +1020,35 @@ int start_no_daemon(unsigned int port, void (*load_kb_dict)(bool), bool (*func)(
 	  return true;
 	}
 
-	size_t sRead::read_nstring(std::string & out, size_t N) {
-	  size_t k = 0;
-	  std::string(N, ' ').swap(out);
+	size_t sRead::read_data(char *dst, size_t N) {
 	  while(1) {
-		while(N and m_left < m_right) {
-		  out[k++] = *m_left++;
-		  --N;
-		}
+		size_t k = std::min(N, static_cast<size_t>(m_right - m_left));
+		memcpy(dst, m_left, k);
+		m_left += k;
+		dst += k;
+		N -= k;
 		if (!N) break;
+		if (N >= buff_size) {
+		  // big strings are read directly into place
+		  size_t len = m_socket.read_some(boost::asio::buffer(dst, N), m_error);
+		  if (m_error == boost::asio::error::eof) break;
+		  else if (m_error)
+			throw std::runtime_error(std::string("Socket error: ") + m_error.message());
+		  dst += len;
+		  N -= len;
+		  if (!N) break;
+		  continue;
+		}
 		if (!read_packet()) break; // EOF
 	  }
 	  return N; // number of characters left
 	}
 
+	size_t sRead::read_nstring(std::string & out, size_t N) {
+	  out.resize(N);
+	  return read_data(&out[0], N);
+	}
+
 	// A return value of zero size means EOF (since we don't allow zero-sized strings to be sent around)
 	size_t sRead::read_size() {
 	  std::string aux;
@@ -410,14 +1066,23 @@ int start_no_daemon(unsigned int port, void (*load_kb_dict)(bool), bool (*func)(
 	//////////////////////////////////////////////////////////////
 	// sWrite class
 
-	sWrite::sWrite(boost::asio::ip::tcp::tcp::socket & socket) :
-	  m_socket(socket) {}
+	sWrite::sWrite(sSocket & socket) :
+	  m_socket(socket),
+	  m_version(1) {}
 
-	void sWrite::write_string(const std::string & line) {
+	void sWrite::write_string(const std::string & line, boost::uint32_t rid) {
 	  size_t N = line.size();
 	  if(!N) return;
-	  this->write_size(N);               // send string size
-	  this->write_data(line.c_str(), N); // send string
+	  // header and string are sent with a single write
+	  char hdr[24];
+	  size_t h = encode_header(m_version, N, rid, hdr);
+	  boost::array<boost::asio::const_buffer, 2> bufs = {{
+		  boost::asio::buffer(hdr, h),
+		  boost::asio::buffer(line) }};
+	  boost::system::error_code error;
+	  boost::asio::write(m_socket, bufs, boost::asio::transfer_all(), error); //send
+	  if (error)
+		throw std::runtime_error(std::string("[E] sWrite send_data: ") + error.message());
 	}
 
 	void sWrite::write_data(const char *buff, size_t len) {
@@ -428,12 +1093,58 @@ int start_no_daemon(unsigned int port, void (*load_kb_dict)(bool), bool (*func)(
 		throw std::runtime_error(std::string("[E] sWrite send_data: ") + error.message());
 	}
 
-	void sWrite::write_size(size_t N) {
-	  std::string str = boost::lexical_cast<std::string>(N);
-	  size_t m = str.size();
-	  std::string size = boost::lexical_cast<std::string>(m);
-	  write_data(&size[0], 1);
-	  write_data(str.c_str(), m);
+	//////////////////////////////////////////////////////////////
+	// sDecoder class
+
+	sDecoder::sDecoder() : m_data(), m_pos(0), m_version(0) {}
+
+	void sDecoder::push(const char *buf, size_t len) {
+	  // drop already decoded data
+	  if (m_pos && m_pos >= m_data.size() / 2) {
+		m_data.erase(0, m_pos);
+		m_pos = 0;
+	  }
+	  m_data.append(buf, len);
+	}
+
+	bool sDecoder::next(std::string & out, boost::uint32_t & rid) {
+	  size_t avail = m_data.size() - m_pos;
+	  if (!avail) return false;
+	  if (!m_version) {
+		// protocol negotiation
+		if (m_data[m_pos] != v2_magic[0]) {
+		  m_version = 1;
+		} else {
+		  if (avail < 4) return false;
+		  if (memcmp(&m_data[m_pos], v2_magic, 4))
+			throw std::runtime_error(std::string("[E] sDecoder: bad protocol magic"));
+		  m_version = 2;
+		  m_pos += 4;
+		  avail -= 4;
+		}
+	  }
+	  if (m_version == 2) {
+		if (avail < v2_header_size) return false;
+		size_t N = get_le32(&m_data[m_pos]);
+		if (avail < v2_header_size + N) return false;
+		rid = get_le32(&m_data[m_pos + 4]);
+		out.assign(m_data, m_pos + v2_header_size, N);
+		m_pos += v2_header_size + N;
+		return true;
+	  }
+	  rid = 0;
+	  char c = m_data[m_pos];
+	  if (c < '1' || c > '9')
+		throw std::runtime_error(std::string("[E] sDecoder: bad string size"));
+	  size_t m = c - '0';
+	  if (avail < 1 + m) return false;
+	  size_t N = boost::lexical_cast<size_t>(m_data.substr(m_pos + 1, m));
+	  if (!N)
+		throw std::runtime_error(std::string("[E] sDecoder: zero sized string"));
+	  if (avail < 1 + m + N) return false;
+	  out.assign(m_data, m_pos + 1 + m, N);
+	  m_pos += 1 + m + N;
+	  return true;
 	}
   } // end of namespace protocol
 }
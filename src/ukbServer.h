@@ -6,18 +6,96 @@
 #ifdef UKB_SERVER
 
 #include <string>
+#include <deque>
+#include <vector>
+#include <list>
+#include <map>
+#include <ostream>
+#include <signal.h>
+#include <boost/cstdint.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include "kbGraph.h"
 
 // Class to handle client/server operation in ukb
 
 namespace ukb {
 
   class sSession;
+  class sServer;
 
-  int start_no_daemon(unsigned int port, void (*pre)(bool), bool (*func)(sSession &), int concurrency);
-  int start_daemon(unsigned int port, void (*pre)(bool), bool (*func)(sSession &), int concurrency);
+  // Server callbacks. They are defined inside the main file (ukb_wsd or
+  // ukb_ppv) and are run by the worker threads.
+  //
+  // - sCmd_func is called with the first string the client sends (the
+  //   command). Returning false stops the server.
+  //
+  // - sReq_func is called for every request of the session, that is, for
+  //   every pair of strings (context id and context) the client sends after
+  //   the command.
+  //
+  // Replies are sent through session.send(). If the callbacks throw, the
+  // exception message is sent to the client and the session is closed.
+
+  typedef bool (*sCmd_func)(sSession & session, const std::string & cmd);
+  typedef void (*sReq_func)(sSession & session, const std::string & id, const std::string & ctx);
+
+  // Batches of requests. A batch holds requests of different sessions,
+  // which sBatch_func handles as sReq_func would, sending the replies
+  // through each session. Failed requests are marked by setting their error
+  // message.
+
+  struct sRequest {
+	sSession * session;
+	const std::string * id;
+	const std::string * ctx;
+	std::string error;
+  };
+
+  typedef void (*sBatch_func)(std::vector<sRequest> & batch);
+
+  // Requests arriving within window_us microseconds, up to max_size, are
+  // handled together by func. No batching if func is null or max_size < 2.
+
+  struct sBatchConfig {
+	sBatch_func func;
+	size_t max_size;
+	unsigned int window_us;
+	sBatchConfig() : func(0), max_size(1), window_us(1000) {}
+  };
+
+  // Where the server listens and clients connect to. Either a TCP port
+  // (and, for clients, a host), or a unix domain socket if path is not
+  // empty. Unix domain sockets avoid the TCP stack and the name resolution
+  // when client and server run in the same machine.
+
+  struct sEndpoint {
+	std::string host;
+	unsigned int port;
+	std::string path;
+	sEndpoint(unsigned int p = 10000, const std::string & h = "localhost") : host(h), port(p) {}
+	bool is_local() const { return !path.empty(); }
+	std::string str() const; // "port N" or "socket PATH", for messages
+  };
+
+  // Start the server, calling pre once the server is listening (it loads
+  // the KB and dictionary). Requests are handled by 'concurrency' threads in
+  // each of 'processes' worker processes (see sServer::run_prefork).
+
+  int start_no_daemon(const sEndpoint & ep, void (*pre)(bool), sCmd_func cmd, sReq_func req,
+					  int concurrency, int processes, const sBatchConfig & batch = sBatchConfig());
+  int start_daemon(const sEndpoint & ep, void (*pre)(bool), sCmd_func cmd, sReq_func req,
+				   int concurrency, int processes, const sBatchConfig & batch = sBatchConfig());
+
+  // Sockets are either TCP or unix domain (stream) sockets
+  typedef boost::asio::generic::stream_protocol::socket sSocket;
+  typedef boost::asio::basic_socket_acceptor<boost::asio::generic::stream_protocol> sAcceptor;
 
   namespace protocol {
 	// Protocol is as follows:
@@ -32,14 +110,52 @@ namespace ukb {
 	// - first, a byte with value 2
 	// - then a string with value "16"
 	// - finally, a string with value "This is a string"
+	//
+	// Version 2 of the protocol is negotiated by the client, which sends the
+	// 4 bytes in v2_magic before anything else. The server answers with the
+	// same 4 bytes and from then on both sides send frames with:
+	//
+	// - 4 bytes with N, as an unsigned little endian integer.
+	// - 4 bytes with the request id, as an unsigned little endian integer.
+	// - a string of length N with the actual data.
+	//
+	// The command has request id 0. The two strings of a request (context id
+	// and context) carry the request id chosen by the client, and the server
+	// tags all the strings of the reply with it. Servers not knowing v2 fail
+	// to parse the magic and close the connection, and clients fall back to
+	// version 1.
+
+	extern const char v2_magic[4];
+	static const size_t v2_header_size = 8;
+
+	// little endian encoding of 32 bit integers, also used by binary payloads
+
+	inline void put_le32(boost::uint32_t n, char *p) {
+	  p[0] = static_cast<char>(n & 0xff);
+	  p[1] = static_cast<char>((n >> 8) & 0xff);
+	  p[2] = static_cast<char>((n >> 16) & 0xff);
+	  p[3] = static_cast<char>((n >> 24) & 0xff);
+	}
+
+	inline boost::uint32_t get_le32(const char *p) {
+	  const unsigned char *q = reinterpret_cast<const unsigned char *>(p);
+	  return static_cast<boost::uint32_t>(q[0]) | (static_cast<boost::uint32_t>(q[1]) << 8) |
+		(static_cast<boost::uint32_t>(q[2]) << 16) | (static_cast<boost::uint32_t>(q[3]) << 24);
+	}
 
 	// sRead
 	// read strings from socket following protocol
 	class sRead {
 
 	public:
-	  sRead(boost::asio::ip::tcp::tcp::socket & socket);
+	  sRead(sSocket & socket);
 	  bool read_string(std::string & out);
+	  bool read_string(std::string & out, boost::uint32_t & rid);
+	  // read exactly N bytes. Return the number of bytes left unread on EOF
+	  size_t read_data(char *dst, size_t N);
+
+	  void set_version(int v) { m_version = v; }
+	  void reset() { m_left = m_right = &m_buf[0]; } // drop buffered data
 
 	private:
 	  bool read_packet();
@@ -49,9 +165,10 @@ namespace ukb {
 
 	  static const unsigned int buff_size  = 16384; //size of the send buffer
 	  char m_buf[buff_size];
-	  boost::asio::ip::tcp::tcp::socket & m_socket;
+	  sSocket & m_socket;
 	  boost::system::error_code m_error;
 	  char *m_left, *m_right; // actual range
+	  int m_version;
 
 	};
 
@@ -61,40 +178,118 @@ namespace ukb {
 
 	public:
 
-	  sWrite(boost::asio::ip::tcp::tcp::socket & socket);
-	  void write_string(const std::string & line);
+	  sWrite(sSocket & socket);
+	  void write_string(const std::string & line, boost::uint32_t rid = 0);
+	  void write_data(const char *buff, size_t len);
+
+	  void set_version(int v) { m_version = v; }
 
 	private:
-	  boost::asio::ip::tcp::tcp::socket & m_socket;
+	  sSocket & m_socket;
+	  int m_version;
+	};
 
-	  void write_data(const char *buff, size_t len);
-	  void write_size(size_t N);
+	// Encode the header of a string of size N into hdr, returning the header
+	// size. hdr must hold at least v2_header_size bytes (v1 headers are at
+	// most 1 + 20 bytes).
+	size_t encode_header(int version, size_t N, boost::uint32_t rid, char *hdr);
+
+	// append the encoding of line to out
+	void encode_string(int version, const std::string & line, boost::uint32_t rid, std::string & out);
+
+	// sDecoder
+	// extract strings following protocol from data received asynchronously.
+	// The protocol version is detected from the first bytes.
+	class sDecoder {
+
+	public:
+	  sDecoder();
+	  void push(const char *buf, size_t len); // append received data
+	  // get next complete string. Return false if more data is needed.
+	  bool next(std::string & out, boost::uint32_t & rid);
+	  int version() const { return m_version; } // 0 if not known yet
+
+	private:
+	  std::string m_data;
+	  size_t m_pos; // start of not yet decoded data
+	  int m_version;
 	};
   }
 
-  // A server session. Create socket and communicate through it.
+  // A server session.
   //
-  // func is a callback function responsible of dealing with server side
-  // communication. It is typically defined inside the main file (ukb_wsd or
-  // ukb_ppv)
+  // All socket operations are asynchronous and run in the io_service thread.
+  // Each request is handed to the worker pool as soon as it is completely
+  // received, so idle connections do not hold any worker. The requests of a
+  // session are handled one after the other, and replies are written in the
+  // same order.
 
-  class sSession {
+  class sSession : public boost::enable_shared_from_this<sSession> {
 
   public:
-	sSession(boost::asio::io_service& io, bool (*func)(sSession &));
+	sSession(sServer & server);
+	~sSession();
 
-	boost::asio::ip::tcp::tcp::socket & socket();
-	bool start();
-	bool receive(std::string & result);
+	sSocket & socket();
+	void start();
+
+	// Send a string to the client. Only to be called from the server
+	// callbacks.
 	void send(const std::string & line);
 
+	// Per session data of the server callbacks, usually set by the command
+	// callback. Only to be used from the server callbacks.
+	boost::shared_ptr<void> & data() { return m_data; }
+
   private:
 
-	bool (*m_func)(sSession &);
-	boost::asio::ip::tcp::tcp::socket m_socket;
-	protocol::sRead m_reader;
-	protocol::sWrite m_writer;
+	friend class sServer;
+
+	struct work_t {
+	  bool is_cmd;
+	  boost::uint32_t rid; // request id (protocol v2)
+	  std::string id;  // command or context id
+	  std::string ctx;
+	  boost::posix_time::ptime received; // for latency statistics
+	  work_t(bool c, boost::uint32_t r, const std::string & i, const std::string & x)
+		: is_cmd(c), rid(r), id(i), ctx(x),
+		  received(boost::posix_time::microsec_clock::universal_time()) {}
+	};
 
+	void start_read();
+	void handle_read(const boost::system::error_code & error, size_t len);
+	void dispatch();
+	void do_work(const work_t & work);
+	void finish_work(bool ok, bool keep);
+	void work_done(boost::shared_ptr<std::string> reply, bool ok, bool keep);
+	void start_write();
+	void handle_write(const boost::system::error_code & error);
+	void maybe_close();
+	void drop_work();
+
+	// Stop reading from the client when this many requests are pending
+	static const size_t max_pending = 64;
+	static const unsigned int buff_size  = 16384; // size of the receive buffer
+
+	sServer & m_server;
+	sSocket m_socket;
+	char m_buf[buff_size];
+	protocol::sDecoder m_decoder;
+	bool m_cmd_seen;      // first string (command) received
+	bool m_has_id;        // context id received, waiting for context
+	std::string m_id;
+	std::deque<work_t> m_work;  // received requests, not yet handled
+	std::string m_reply;  // reply of the current request (worker side)
+	boost::uint32_t m_rid; // request id of the current request (worker side)
+	boost::shared_ptr<void> m_data;
+	bool m_v2_acked;      // protocol v2 answer sent
+	std::deque<boost::shared_ptr<std::string> > m_wqueue; // pending writes
+	bool m_busy;          // a worker is handling a request
+	bool m_reading;
+	bool m_writing;
+	bool m_eof;           // client closed the connection
+	bool m_closing;       // close after pending writes (error)
+	bool m_started;       // connection accepted (for statistics)
   };
 
   // Server main class. Accept connections asyncronously, create a session and
@@ -103,19 +298,59 @@ namespace ukb {
   class sServer {
 
   public:
-	sServer(boost::asio::io_service & io, unsigned int port, bool (*func)(sSession &));
+	// Listen to ep. A stale unix domain socket file at ep.path is replaced,
+	// and removed again when the server is destroyed.
+	sServer(boost::asio::io_service & io, const sEndpoint & ep, sCmd_func cmd, sReq_func req,
+			const sBatchConfig & batch = sBatchConfig());
+	~sServer();
+
+	// Run the server. The calling thread runs the io_service, and
+	// 'concurrency' worker threads handle the requests. Returns when the
+	// server is stopped.
+	void run(int concurrency);
+	void stop();
+
+	// Prefork mode. Fork 'processes' worker processes which share the
+	// listening socket and run() the server, while the calling process
+	// waits for them. Workers share the loaded KB and dictionary
+	// copy-on-write, so call it once everything is loaded and the caches
+	// are warm. Workers which exit or are killed are replaced. The server
+	// stops when a worker stops because of a "stop" command or the calling
+	// process gets SIGTERM, SIGINT or SIGHUP. With a single process, same as
+	// run().
+	void run_prefork(int processes, int concurrency);
 
   private:
 
+	friend class sSession;
+
+	pid_t fork_worker(int concurrency, const sigset_t & worker_mask);
+
 	void start_accept();
-	void handle_accept(sSession *new_session,
+	void handle_accept(boost::shared_ptr<sSession> new_session,
 					   const boost::system::error_code& error);
 
+	// request batching
+	typedef std::vector<std::pair<boost::shared_ptr<sSession>, sSession::work_t> > batch_t;
+	bool batching() const { return m_batch.func && m_batch.max_size > 1; }
+	void enqueue(boost::shared_ptr<sSession> session, const sSession::work_t & work);
+	void handle_batch_timer(const boost::system::error_code & error);
+	void flush_batch();
+	void do_batch(boost::shared_ptr<batch_t> batch);
+
 	// Connection stuff
 	boost::asio::io_service & m_io; //main asio object
-	bool (*m_func)(sSession &);
-	boost::asio::ip::tcp::tcp::endpoint m_endpoint;
-	boost::asio::ip::tcp::tcp::acceptor m_acceptor;
+	boost::asio::io_service m_work_io; // worker pool
+	sCmd_func m_cmd;
+	sReq_func m_req;
+	sBatchConfig m_batch;
+	boost::asio::deadline_timer m_batch_timer;
+	batch_t m_pending;  // requests waiting for the batch to be complete
+	bool m_local;       // unix domain socket
+	std::string m_path; // absolute path of the unix domain socket
+	bool m_owner;       // process in charge of removing the socket file
+	bool m_stopped;     // stopped by a client ("stop" command)
+	sAcceptor m_acceptor;
 
   };
 
@@ -127,26 +362,235 @@ namespace ukb {
   class sClient {
 
   public:
-	// Connects to host:port. Sets error on failure.
-	sClient(const std::string & host, unsigned int port);
+	// Connects to ep and negotiates protocol v2, falling back to v1 if the
+	// server does not know it. Sets error on failure.
+	sClient(const sEndpoint & ep);
 
 	boost::system::error_code error() const;
 	std::string error_str() const;
+	int version() const { return m_version; }
 
 	bool receive(std::string & result);
-	void send(const std::string & line);
+	// rid is the request id of the string (always 0 with protocol v1)
+	bool receive(std::string & result, boost::uint32_t & rid);
+	void send(const std::string & line, boost::uint32_t rid = 0);
   private:
 
+	void connect();
+	bool negotiate_v2();
+
+	int m_version;
+
 	boost::system::error_code m_error; // zero if connection is succesful
 	boost::asio::io_service m_io; //asio main object
-	boost::asio::ip::tcp::tcp::resolver m_resolver;
-	boost::asio::ip::tcp::tcp::resolver::query m_query;
-	boost::asio::ip::tcp::tcp::resolver::iterator m_endpoint_iterator; //iterator if multiple answers for a given name
-	boost::asio::ip::tcp::tcp::socket m_socket;
+	sEndpoint m_ep;
+	sSocket m_socket;
 
 	protocol::sRead m_reader;
 	protocol::sWrite m_writer;
   };
+
+  // sCache
+  //
+  // Bounded LRU cache of request results, shared by the worker threads.
+  // Values should be cheap to copy (e.g. shared pointers). A capacity of
+  // zero disables the cache. Hit and miss counters survive clear(), which
+  // is to be called whenever the results could change (e.g. the KB or the
+  // dictionary are reloaded).
+
+  template<typename V>
+  class sCache {
+
+  public:
+	explicit sCache(size_t capacity = 0) : m_capacity(capacity), m_hits(0), m_misses(0) {}
+
+	size_t capacity() const { return m_capacity; }
+	void set_capacity(size_t n) {
+	  boost::mutex::scoped_lock lock(m_mutex);
+	  m_capacity = n;
+	  shrink();
+	}
+
+	bool get(const std::string & key, V & value) {
+	  boost::mutex::scoped_lock lock(m_mutex);
+	  typename map_t::iterator it = m_map.find(key);
+	  if (it == m_map.end()) {
+		++m_misses;
+		return false;
+	  }
+	  m_lru.splice(m_lru.begin(), m_lru, it->second); // most recent
+	  value = it->second->second;
+	  ++m_hits;
+	  return true;
+	}
+
+	void put(const std::string & key, const V & value) {
+	  boost::mutex::scoped_lock lock(m_mutex);
+	  if (!m_capacity) return;
+	  typename map_t::iterator it = m_map.find(key);
+	  if (it != m_map.end()) {
+		it->second->second = value;
+		m_lru.splice(m_lru.begin(), m_lru, it->second);
+		return;
+	  }
+	  m_lru.push_front(std::make_pair(key, value));
+	  m_map[key] = m_lru.begin();
+	  shrink();
+	}
+
+	void clear() {
+	  boost::mutex::scoped_lock lock(m_mutex);
+	  m_map.clear();
+	  m_lru.clear();
+	}
+
+	// write counters, one "name value" pair per line
+	void stats(std::ostream & o, const std::string & prefix) {
+	  boost::mutex::scoped_lock lock(m_mutex);
+	  o << prefix << "_hits " << m_hits << "\n"
+		<< prefix << "_misses " << m_misses << "\n"
+		<< prefix << "_size " << m_map.size() << "\n"
+		<< prefix << "_capacity " << m_capacity << "\n";
+	}
+
+  private:
+
+	void shrink() {
+	  while(m_map.size() > m_capacity) {
+		m_map.erase(m_lru.back().first);
+		m_lru.pop_back();
+	  }
+	}
+
+	typedef std::list<std::pair<std::string, V> > list_t; // most recent first
+	typedef boost::unordered_map<std::string, typename list_t::iterator> map_t;
+
+	list_t m_lru;
+	map_t m_map;
+	size_t m_capacity;
+	size_t m_hits;
+	size_t m_misses;
+	boost::mutex m_mutex;
+  };
+
+  // sStats
+  //
+  // Server metrics, shared by all the threads of the process: counters
+  // (which may also go down, e.g. active sessions) and latency histograms.
+  // The server itself records sessions, requests and their latencies;
+  // server callbacks may add their own (e.g. the time of each phase of a
+  // request). Histograms have power of two buckets, in microseconds.
+
+  class sStats {
+
+  public:
+	static sStats & instance();
+
+	void count(const std::string & name, long n = 1);
+	// add n samples of us microseconds each to histogram name
+	void time(const std::string & name, double us, size_t n = 1);
+
+	// write all metrics, one "name value" pair per line
+	void print(std::ostream & o) const;
+
+  private:
+	sStats();
+	sStats(const sStats &);
+	sStats & operator=(const sStats &);
+
+	static const size_t num_buckets = 32; // up to 2^31 microseconds
+
+	struct hist_t {
+	  size_t n;
+	  double total_us;
+	  double max_us;
+	  size_t buckets[num_buckets]; // bucket i: samples below 2^i microseconds
+	  hist_t();
+	};
+
+	double percentile(const hist_t & h, double p) const;
+
+	std::map<std::string, long> m_counters;
+	std::map<std::string, hist_t> m_hists;
+	boost::posix_time::ptime m_start;
+	mutable boost::mutex m_mutex;
+  };
+
+  // Record the time spent building personalization vectors and running
+  // PageRank for n contexts, given the PageRank workspace counters before
+  // and after. If run_us (the total time) is given, the rest goes to
+  // phase_disamb.
+
+  void stats_phases(const PrankWorkspace::stats_t & before, const PrankWorkspace::stats_t & after,
+					size_t n, double run_us = -1.0);
+
+  // Hot reload ("reload" command). Run reload (see reload_kb_dict in
+  // wdict.h) in a background thread, counting reloads and reload_errors.
+  // Requests already running go on with the old KB and dictionary.
+  // Returns the answer to the command. Not available with more than one
+  // (preforked) server process.
+
+  std::string start_reload(void (*reload)(), size_t prefork);
+
+  // Microseconds elapsed since construction or the last lap
+
+  class sTimer {
+
+  public:
+	sTimer() : m_start(boost::posix_time::microsec_clock::universal_time()) {}
+	double lap_us() {
+	  boost::posix_time::ptime now(boost::posix_time::microsec_clock::universal_time());
+	  double us = (now - m_start).total_microseconds();
+	  m_start = now;
+	  return us;
+	}
+  private:
+	boost::posix_time::ptime m_start;
+  };
+
+  // sPipeline
+  //
+  // Pipelined requests over a client connection. Up to 'window' requests are
+  // sent without waiting for their replies, and replies are returned in the
+  // order their requests were sent (matched by request id with protocol v2,
+  // by arrival order with protocol v1).
+  //
+  // If end_marker is empty the reply to a request is a single string.
+  // Otherwise it is the concatenation of all the strings received up to
+  // end_marker (not included).
+
+  class sPipeline {
+
+  public:
+	sPipeline(sClient & client, size_t window, const std::string & end_marker = std::string());
+
+	bool full() const { return m_inflight.size() >= m_window; }
+	void send(const std::string & id, const std::string & ctx);
+
+	// get the reply of the oldest request in flight. Return false if there
+	// are no requests in flight.
+	bool receive(std::string & id, std::string & reply);
+
+	// write number of contexts and contexts/sec since construction
+	void report(std::ostream & o) const;
+
+  private:
+
+	struct req_t {
+	  boost::uint32_t rid;
+	  std::string id;
+	  std::string reply;
+	  bool done;
+	};
+
+	sClient & m_client;
+	size_t m_window;
+	std::string m_end;
+	boost::uint32_t m_next_rid;
+	size_t m_n;  // replies received
+	std::deque<req_t> m_inflight;  // in sending order
+	boost::posix_time::ptime m_start;
+  };
 }
 
 #endif // UKB_SERVER
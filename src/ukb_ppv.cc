@@ -9,11 +9,13 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <cstring>
 #include <syslog.h>
 
 // Program options
 
 #include <boost/program_options.hpp>
+#include <boost/tokenizer.hpp>
 
 // timer
 
@@ -44,6 +46,11 @@ static float trunc_ppv = 0.0;
 static bool opt_nozero = false;
 static string ppv_prefix;
 static string cmdline("!! -v ");
+static size_t opt_window = 32;
+static size_t opt_batch_size = 1;
+static unsigned int opt_batch_window = 1000;
+static int opt_prefork = 1;
+static size_t opt_cache_size = 0;
 
 // - sort all concepts according to their ppv weight, then scan the
 // resulting sequence of concetps with a sliding window of length 100,
@@ -204,8 +211,7 @@ void compute_sentence_vectors(istream & is, string & out_dir) {
 		try {
 			CSentence cs(cid, ctx);
 			if(ctx.size()) {
-				vector<float> ranks;
-				// Initialize rank vector
+				vector<float> & ranks = PrankWorkspace::local().ranks;
 				if (!compute_cs_ppv(cs, ranks)) {
 					cerr << "[W] Error when calculating ranks for csentence " << cs.id() << endl;
 					continue;
@@ -246,95 +252,404 @@ void compute_static_ppv() {
 // Sends PPV vector through socket
 #ifdef UKB_SERVER
 
+// Per session options of the ppv server, set with the session command:
+//
+//   ppv [format=text|dense|sparse] [topk=K] [threshold=T]
+//
+// - text: "concept\trank" lines, as in ppv files (default).
+// - dense: the rank of every KB vertex, as little endian float32 values.
+// - sparse: (vertex id, rank) pairs, as little endian uint32 and float32.
+//
+// topk and threshold only send the top K ranks, or the ranks not below T
+// (the rest are sent as zeros in dense format). Ranks are not renormalized.
+//
+// If any option is given the server answers the command with the same
+// string. The whole PPV is sent as a single string, followed by
+// "--END--PPV".
+
+enum ppv_format_t { ppv_text, ppv_dense, ppv_sparse };
+
+struct ppv_session_t {
+	ppv_format_t format;
+	size_t topk;     // 0 means all
+	float threshold;
+	bool status;     // a status line precedes every PPV (see send_ppv_status)
+	ppv_session_t() : format(ppv_text), topk(0), threshold(0.0f), status(false) {}
+};
+
+static string ppv_command(const ppv_session_t & opts) {
+	string cmd("ppv");
+	if (opts.format == ppv_dense) cmd += " format=dense";
+	if (opts.format == ppv_sparse) cmd += " format=sparse";
+	if (opts.topk) cmd += " topk=" + lexical_cast<string>(opts.topk);
+	if (opts.threshold > 0.0f) cmd += " threshold=" + lexical_cast<string>(opts.threshold);
+	if (opts.status) cmd += " status";
+	return cmd;
+}
+
+static void parse_ppv_command(const string & cmd, ppv_session_t & opts) {
+	vector<string> fields;
+	char_separator<char> sep(" ");
+	tokenizer<char_separator<char> > tok(cmd, sep);
+	copy(tok.begin(), tok.end(), back_inserter(fields));
+	if (!fields.size() || fields[0] != "ppv")
+		throw std::runtime_error("[E] unknown command " + cmd);
+	for(size_t i = 1; i < fields.size(); ++i) {
+		string::size_type eq = fields[i].find('=');
+		string key = fields[i].substr(0, eq);
+		string val = eq == string::npos ? string() : fields[i].substr(eq + 1);
+		if (key == "format" && val == "text") opts.format = ppv_text;
+		else if (key == "format" && val == "dense") opts.format = ppv_dense;
+		else if (key == "format" && val == "sparse") opts.format = ppv_sparse;
+		else if (key == "topk") opts.topk = lexical_cast<size_t>(val);
+		else if (key == "threshold") opts.threshold = lexical_cast<float>(val);
+		else if (key == "status" && val.empty()) opts.status = true;
+		else throw std::runtime_error("[E] bad ppv option " + fields[i]);
+	}
+}
+
+// Indices of the ranks to be sent, in vertex order
+
+static void select_ranks(const vector<float> & ranks, const ppv_session_t & opts,
+						 vector<int> & idx) {
+	idx.clear();
+	for(size_t i = 0, m = ranks.size(); i < m; ++i) {
+		if (opt_nozero && ranks[i] == 0.0) continue;
+		if (opts.threshold > 0.0f && ranks[i] < opts.threshold) continue;
+		idx.push_back(i);
+	}
+	if (opts.topk && idx.size() > opts.topk) {
+		nth_element(idx.begin(), idx.begin() + opts.topk, idx.end(), CWSort(ranks));
+		idx.resize(opts.topk);
+		sort(idx.begin(), idx.end());
+	}
+}
+
+static void append_le32(string & out, boost::uint32_t n) {
+	char buf[4];
+	protocol::put_le32(n, buf);
+	out.append(buf, 4);
+}
+
+static void append_float(string & out, float f) {
+	boost::uint32_t n;
+	memcpy(&n, &f, 4);
+	append_le32(out, n);
+}
+
+static float get_float(const char *p) {
+	boost::uint32_t n = protocol::get_le32(p);
+	float f;
+	memcpy(&f, &n, 4);
+	return f;
+}
+
 static void output_ppv_stream_socket(vector<float> & ranks,
+									 const ppv_session_t & opts,
 									 sSession & session) {
 	Kb & kb = Kb::instance();
 
 	post_process_ranks(ranks);
-	if (output_control_line) {
-		session.send(cmdline + "\n");
-	}
-	for(size_t i = 0, m = ranks.size(); i < m; ++i) {
-		string sname = kb.get_vertex_name(i);
-		if (opt_nozero && ranks[i] == 0.0) continue;
+	vector<int> idx;
+	string out;
+	if (opts.format == ppv_dense) {
+		if (opts.topk || opts.threshold > 0.0f) {
+			select_ranks(ranks, opts, idx);
+			vector<float> sel(ranks.size(), 0.0f);
+			for(size_t i = 0; i < idx.size(); ++i) sel[idx[i]] = ranks[idx[i]];
+			sel.swap(ranks);
+		}
+		out.reserve(4 * ranks.size());
+		for(size_t i = 0, m = ranks.size(); i < m; ++i)
+			append_float(out, ranks[i]);
+	} else if (opts.format == ppv_sparse) {
+		select_ranks(ranks, opts, idx);
+		out.reserve(8 * idx.size());
+		for(size_t i = 0; i < idx.size(); ++i) {
+			append_le32(out, idx[i]);
+			append_float(out, ranks[idx[i]]);
+		}
+	} else {
+		select_ranks(ranks, opts, idx);
 		ostringstream oss;
-		oss << sname << "\t" << ranks[i];
-		if (output_variants_ppv) {
-			oss << "\t" << WDict::instance().variant(sname);
+		if (output_control_line) {
+			oss << cmdline << "\n";
+		}
+		for(size_t i = 0; i < idx.size(); ++i) {
+			string sname = kb.get_vertex_name(idx[i]);
+			oss << sname << "\t" << ranks[idx[i]];
+			if (output_variants_ppv) {
+				oss << "\t" << WDict::instance().variant(sname);
+			}
+			oss << "\n";
 		}
-		oss << "\n";
+		out = oss.str();
+	}
+	session.send(out);
+}
+
+// Status line of a context, sent before its PPV in sessions with the status
+// option. The PPV may be empty (e.g. when no rank is above the threshold),
+// so clients can not tell failures from empty replies otherwise. Sessions
+// without it get no PPV at all on failure, as always.
+
+static const char ppv_status_ok[] = "ok\n";
+
+static void send_ppv_status(sSession & session, const string & ctx_id, bool ok) {
+	if (!static_pointer_cast<ppv_session_t>(session.data())->status) return;
+	if (ok) session.send(ppv_status_ok);
+	else session.send("[E] no ranks could be calculated for " + ctx_id + "\n");
+}
+
+// Cache of context PPVs (--cache_size), as computed by compute_cs_ppv. Keys
+// are canonical contexts prefixed with the settings of the daemon.
+
+typedef boost::shared_ptr<const vector<float> > cached_ppv_t;
+static sCache<cached_ppv_t> ppv_cache;
+static string ppv_cache_prefix;
+
+// Empty the cache. Called whenever KB or dictionary are (re)loaded.
+
+static void reset_ppv_cache() {
+	ppv_cache.clear();
+	ppv_cache.set_capacity(opt_cache_size);
+	ppv_cache_prefix = ppr_settings_key() + "\n";
+}
+
+// Return the cached PPV of cs, if any. key gets the cache key.
+
+static cached_ppv_t ppv_cache_get(const CSentence & cs, string & key) {
+	cached_ppv_t hit;
+	if (!ppv_cache.capacity()) return hit;
+	// PPVs depend on the KB version, too
+	key = ppv_cache_prefix + lexical_cast<string>(Kb::instance().generation()) + "\n" + cs.canonical_key();
+	ppv_cache.get(key, hit);
+	return hit;
+}
+
+static void ppv_cache_put(const string & key, const vector<float> & ranks) {
+	if (!ppv_cache.capacity()) return;
+	ppv_cache.put(key, cached_ppv_t(new vector<float>(ranks)));
+}
+
+// Hot reload ("reload" command, see start_reload)
+
+static void warm_ppv(Kb & kb, WDict * dict) {
+	if (dict && output_variants_ppv) dict->warm_variants();
+}
+
+static void reload_ppv() {
+	reload_kb_dict(&warm_ppv);
+	ppv_cache.clear(); // entries of old versions are never used again
+}
+
+// First string of the session. Return FALSE means kill server
+
+bool handle_server_cmd(sSession & session, const string & cmd) {
+	if (cmd == "stop") return false;
+	KbDictPin pin;
+	if (cmd == "stats") {
+		ostringstream oss;
+		sStats::instance().print(oss);
+		oss << "kb_generation " << Kb::instance().generation() << "\n";
+		ppv_cache.stats(oss, "cache");
 		session.send(oss.str());
+		return true;
+	}
+	if (cmd == "reload") {
+		session.send(start_reload(&reload_ppv, opt_prefork));
+		return true;
 	}
+	boost::shared_ptr<ppv_session_t> opts(new ppv_session_t);
+	parse_ppv_command(cmd, *opts);
+	session.data() = opts;
+	if (cmd != "ppv") session.send(cmd); // acknowledge options
+	return true;
 }
 
-// Return FALSE means kill server
+// Compute and send the PPV of one context. Errors are sent to the client by
+// the server, which closes the session (the server is still alive for new
+// connections).
+
+void handle_server_ctx(sSession & session, const string & ctx_id, const string & ctx) {
+	KbDictPin pin;
+	sStats & stats = sStats::instance();
+	sTimer timer;
+	CSentence cs(ctx_id, ctx);
+	stats.time("phase_parse", timer.lap_us());
+	PrankWorkspace & ws = PrankWorkspace::local();
+	vector<float> & ranks = ws.ranks;
+	string key;
+	cached_ppv_t hit = ppv_cache_get(cs, key);
+	bool ok = true;
+	if (hit) {
+		ranks = *hit;
+	} else {
+		PrankWorkspace::stats_t before = ws.stats;
+		ok = compute_cs_ppv(cs, ranks);
+		stats_phases(before, ws.stats, 1);
+		if (ok) ppv_cache_put(key, ranks);
+	}
+	timer.lap_us();
+	send_ppv_status(session, ctx_id, ok);
+	if (ok) {
+		const ppv_session_t & opts = *static_pointer_cast<ppv_session_t>(session.data());
+		output_ppv_stream_socket(ranks, opts, session);
+	}
+	// Clients wait for the end mark of every context.
+	session.send("--END--PPV");
+	stats.time("phase_output", timer.lap_us());
+}
 
-bool handle_server_read(sSession & session) {
-	string ctx_id;
-	string ctx;
-	try {
-		session.receive(ctx);
-		if (ctx == "stop") return false;
-		// TODO Check command is ppv
-		while(1) {
-			if (!session.receive(ctx_id)) break;
-			if (!session.receive(ctx)) break;
-			CSentence cs(ctx_id, ctx);
-			vector<float> ranks;
-			if (!compute_cs_ppv(cs, ranks)) {
-				// throw "Error when calculating ranks for csentence " << cs.id() << endl;
-				// throw std::runtime_error(std::string("[E] when calculating ranks for csentence ") + cs.id() + ":" + this->error_str());
+// Batched handle_server_ctx. The PageRank of all the contexts is computed
+// at once.
+
+void handle_server_batch(vector<sRequest> & batch) {
+
+	KbDictPin pin;
+
+	sStats & stats = sStats::instance();
+	sTimer timer;
+	vector<boost::shared_ptr<CSentence> > css;
+	vector<const CSentence *> css_p;
+	vector<size_t> idx; // request of each context
+	vector<string> keys;
+	for(size_t i = 0; i < batch.size(); ++i) {
+		try {
+			boost::shared_ptr<CSentence> cs(new CSentence(*batch[i].id, *batch[i].ctx));
+			stats.time("phase_parse", timer.lap_us());
+			string key;
+			cached_ppv_t hit = ppv_cache_get(*cs, key);
+			if (hit) {
+				vector<float> ranks(*hit);
+				const ppv_session_t & opts = *static_pointer_cast<ppv_session_t>(batch[i].session->data());
+				send_ppv_status(*batch[i].session, *batch[i].id, true);
+				output_ppv_stream_socket(ranks, opts, *batch[i].session);
+				batch[i].session->send("--END--PPV");
+				stats.time("phase_output", timer.lap_us());
 				continue;
 			}
-			output_ppv_stream_socket(ranks, session);
-			session.send("--END--PPV");
+			css.push_back(cs);
+			css_p.push_back(cs.get());
+			idx.push_back(i);
+			keys.push_back(key);
+		} catch (std::exception & e) {
+			batch[i].error = e.what();
+		}
+	}
+	PrankWorkspace & ws = PrankWorkspace::local();
+	PrankWorkspace::stats_t before = ws.stats;
+	vector<bool> ok;
+	calculate_kb_ppr_batch(css_p, ws.batch_ranks, ok, ws);
+	stats_phases(before, ws.stats, css.size());
+	timer.lap_us();
+	for(size_t j = 0; j < css.size(); ++j) {
+		sRequest & r = batch[idx[j]];
+		try {
+			send_ppv_status(*r.session, *r.id, ok[j]);
+			if (ok[j]) {
+				vector<float> & ranks = ws.batch_ranks[j];
+				maybe_postproc_ranks(ranks);
+				ppv_cache_put(keys[j], ranks);
+				const ppv_session_t & opts = *static_pointer_cast<ppv_session_t>(r.session->data());
+				output_ppv_stream_socket(ranks, opts, *r.session);
+			}
+			r.session->send("--END--PPV");
+			stats.time("phase_output", timer.lap_us());
+		} catch (std::exception & e) {
+			r.error = e.what();
 		}
-	} catch (std::exception& e)	{
-		// send error and close the session.
-		// Note: the server is still alive for new connections.
-		session.send(e.what());
 	}
-	return true;
 }
 
 // Send contexts to daemon, get output ppv ranks and write to proper files
 
-static void client_copy_output(sClient & client, ostream & o) {
-	string line;
-	while(1) {
-		client.receive(line);
-		if (line == "--END--PPV") break;
-		o << line;
+// Write a PPV as received from the server. Binary formats need the KB for
+// concept names.
+
+static void write_ppv_reply(const string & reply, ppv_format_t format, ostream & os) {
+	if (format == ppv_text) {
+		os << reply;
+		return;
+	}
+	Kb & kb = Kb::instance();
+	size_t item_size = format == ppv_dense ? 4 : 8;
+	if (reply.size() % item_size)
+		throw std::runtime_error("[E] bad binary PPV received from server");
+	const char *p = reply.data();
+	for(size_t i = 0, m = reply.size() / item_size; i < m; ++i, p += item_size) {
+		size_t v = i;
+		float r;
+		if (format == ppv_dense) {
+			r = get_float(p);
+		} else {
+			v = protocol::get_le32(p);
+			r = get_float(p + 4);
+		}
+		if (v >= kb.size())
+			throw std::runtime_error("[E] vertex " + lexical_cast<string>(v) + " not in KB. Client and server KB differ");
+		if (opt_nozero && r == 0.0) continue;
+		os << kb.get_vertex_name(v) << "\t" << r << "\n";
 	}
 }
 
-bool client(istream & is, unsigned int port, const string & out_dir, bool opt_stdout) {
+bool client(istream & is, const sEndpoint & ep, const string & out_dir, bool opt_stdout,
+			ppv_session_t opts) {
 	// connect to ukb port and send data to it.
-	sClient client("localhost", port);
+	sClient client(ep);
 	string server_cmd;
-	string go("ppv");
 	if (client.error()) {
 		std::cerr << "Error when connecting: " << client.error_str() << std::endl;
 		return false;
 	}
-	string id, ctx;
+	// servers which know options know the status line, too
+	opts.status = client.version() >= 2;
+	string go(ppv_command(opts));
+	string id, ctx, out;
 	size_t l_n = 0;
 	File_elem fout("lala", out_dir, ".ppv");
 	try {
 		client.send(go);
-		// TODO Receive ack server is ppv
-		while(read_line_noblank(is, id, l_n)) {
-			if(!read_line_noblank(is, ctx, l_n)) return false;
-			client.send(id);
-			client.send(ctx);
+		if (go != "ppv") {
+			// older servers silently ignore options
+			if (client.version() < 2)
+				throw std::runtime_error("[E] server does not support ppv options");
+			client.receive(server_cmd);
+			if (server_cmd != go)
+				throw std::runtime_error("[E] server does not support ppv options: " + server_cmd);
+		}
+		// keep up to opt_window contexts in flight
+		sPipeline pipe(client, opt_window, "--END--PPV");
+		bool eof = false;
+		while(1) {
+			while(!eof && !pipe.full()) {
+				if (!read_line_noblank(is, id, l_n)) {
+					eof = true;
+					break;
+				}
+				if(!read_line_noblank(is, ctx, l_n)) return false;
+				pipe.send(id, ctx);
+			}
+			if (!pipe.receive(id, out)) break;
+			bool ok = out.size() > 0; // without status line, only failures are empty
+			if (opts.status) {
+				ok = out.compare(0, sizeof(ppv_status_ok) - 1, ppv_status_ok) == 0;
+				if (ok) out.erase(0, sizeof(ppv_status_ok) - 1);
+				else if (glVars::verbose) cerr << out.substr(0, out.find('\n')) << endl;
+			}
+			if (!ok) {
+				cerr << "[W] Error when calculating ranks for csentence " << id << endl;
+				continue;
+			}
 			if (opt_stdout) {
-				client_copy_output(client, cout);
+				write_ppv_reply(out, opts.format, cout);
 				cout << "##END_PPV\n";
 			} else {
 				boost::shared_ptr<ostream> fo(output_ppv_fname(ppv_prefix + id, fout));
-				client_copy_output(client, *fo);
+				write_ppv_reply(out, opts.format, *fo);
 			}
 		}
+		if (glVars::verbose) pipe.report(std::cerr);
 	} catch (std::exception& e)	{
 		std::cerr << e.what() << std::endl;
 		return false;
@@ -343,9 +658,28 @@ bool client(istream & is, unsigned int port, const string & out_dir, bool opt_st
 }
 
 
-bool client_stop_server(unsigned int port) {
+bool client_server_cmd(ostream & os, const sEndpoint & ep, const string & cmd) {
+	// connect to ukb port, send a command (e.g. stats) and print the answer
+	sClient client(ep);
+	if (client.error()) {
+		std::cerr << "Error when connecting: " << client.error_str() << std::endl;
+		return false;
+	}
+	string answer;
+	try {
+		client.send(cmd);
+		client.receive(answer);
+	} catch (std::exception& e)	{
+		std::cerr << e.what() << std::endl;
+		return false;
+	}
+	os << answer;
+	return answer.compare(0, 3, "[E]") != 0;
+}
+
+bool client_stop_server(const sEndpoint & ep) {
 	// connect to ukb port and tell it to stop
-	sClient client("localhost", port);
+	sClient client(ep);
 	string stop("stop");
 	if (client.error()) {
 		std::cerr << "Error when connecting: " << client.error_str() << std::endl;
@@ -375,6 +709,11 @@ void load_kb_and_dict(bool from_daemon) {
 	// - there is a dictionary name (textual or binary)
 	// - from_daemon is set
 	if (!from_daemon) return;
+	// fill KB caches before serving any request
+	Kb::instance().warm_caches();
+#ifdef UKB_SERVER
+	reset_ppv_cache();
+#endif
 	if (!(glVars::dict::text_fname.size() + glVars::dict::bin_fname.size())) return;
 	string aux("Loading Dict ");
 	aux += glVars::dict::text_fname.size() ? glVars::dict::text_fname : glVars::dict::bin_fname;
@@ -384,6 +723,8 @@ void load_kb_and_dict(bool from_daemon) {
 	if (glVars::dict::altdict_fname.size()) {
 		WDict::instance().read_alternate_file(glVars::dict::altdict_fname);
 	}
+	// fill dictionary caches before serving any request
+	if (output_variants_ppv) WDict::instance().warm_variants();
 }
 
 int main(int argc, char *argv[]) {
@@ -394,7 +735,12 @@ int main(int argc, char *argv[]) {
 	bool opt_static = false;
 	bool opt_client = false;
 	bool opt_shutdown = false;
+	bool opt_stats = false;
+	bool opt_reload = false;
 	bool opt_stdout = false;
+#ifdef UKB_SERVER
+	ppv_session_t client_opts;
+#endif
 
 	cmdline += glVars::ukb_version;
 	for (int i=0; i < argc; ++i) {
@@ -407,7 +753,7 @@ int main(int argc, char *argv[]) {
 	ifstream input_ifs;
 
 #ifdef UKB_SERVER
-	unsigned int port = 10000;
+	sEndpoint endpoint; // --port, --socket
 #endif
 	size_t iterations = 0;
 	float thresh = 0.0;
@@ -476,8 +822,19 @@ int main(int argc, char *argv[]) {
 	po_desc_server.add_options()
 		("daemon", "Start a daemon listening to port. Assumes --port")
 		("port", value<unsigned int>(), "Port to listen/send information.")
+		("socket", value<string>(), "Use the unix domain socket arg instead of a TCP port (server and client in the same machine).")
 		("client", "Use client mode to send contexts to the ukb daemon. Bare in mind that the configuration is that of the server.")
 		("shutdown", "Shutdown ukb daemon.")
+		("prefork", value<int>(), "Number of server processes, which share the KB and dictionary loaded once (default 1).")
+		("window", value<size_t>(), "Number of contexts in flight in client mode (default 32).")
+		("cache_size", value<size_t>(), "Server keeps the PPVs of the last arg different contexts (default 0, no cache).")
+		("stats", "Print statistics of the ukb daemon (see --cache_size).")
+		("reload", "Make the ukb daemon load the KB and dictionary files again, without stopping. Requests keep on being served with the old ones until loaded.")
+		("batch_size", value<size_t>(), "Server computes together up to arg contexts arriving at the same time (default 1, no batching).")
+		("batch_window", value<unsigned int>(), "Microseconds the server waits for a batch to be complete (default 1000).")
+		("ppv_format", value<string>(), "Client mode: format of PPVs sent by the server. One of text (default), dense or sparse. Binary formats (dense, sparse) need the KB (-K).")
+		("server_topK", value<size_t>(), "Client mode: server sends only the top arg nodes.")
+		("server_threshold", value<float>(), "Client mode: server sends only the nodes with rank not below arg.")
 		;
 
 	options_description po_hidden("Hidden");
@@ -667,7 +1024,16 @@ int main(int argc, char *argv[]) {
 
 		if (vm.count("port")) {
 #ifdef UKB_SERVER
-			port =  vm["port"].as<unsigned int>();
+			endpoint.port =  vm["port"].as<unsigned int>();
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("socket")) {
+#ifdef UKB_SERVER
+			endpoint.path = vm["socket"].as<string>();
 #else
 			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
 			exit(1);
@@ -683,6 +1049,111 @@ int main(int argc, char *argv[]) {
 #endif
 		}
 
+		if (vm.count("prefork")) {
+#ifdef UKB_SERVER
+			opt_prefork = vm["prefork"].as<int>();
+			if (opt_prefork < 1) {
+				cerr << "--prefork must be at least 1\n";
+				exit(1);
+			}
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("window")) {
+#ifdef UKB_SERVER
+			opt_window = vm["window"].as<size_t>();
+			if (opt_window < 1) {
+				cerr << "--window must be at least 1\n";
+				exit(1);
+			}
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("cache_size")) {
+#ifdef UKB_SERVER
+			opt_cache_size = vm["cache_size"].as<size_t>();
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("stats")) {
+#ifdef UKB_SERVER
+			opt_stats = true;
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("reload")) {
+#ifdef UKB_SERVER
+			opt_reload = true;
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("batch_size")) {
+#ifdef UKB_SERVER
+			opt_batch_size = vm["batch_size"].as<size_t>();
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("batch_window")) {
+#ifdef UKB_SERVER
+			opt_batch_window = vm["batch_window"].as<unsigned int>();
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("ppv_format")) {
+#ifdef UKB_SERVER
+			string fmt = vm["ppv_format"].as<string>();
+			if (fmt == "text") client_opts.format = ppv_text;
+			else if (fmt == "dense") client_opts.format = ppv_dense;
+			else if (fmt == "sparse") client_opts.format = ppv_sparse;
+			else {
+				cerr << "[E] --ppv_format must be one of text, dense or sparse\n";
+				exit(1);
+			}
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("server_topK")) {
+#ifdef UKB_SERVER
+			client_opts.topk = vm["server_topK"].as<size_t>();
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("server_threshold")) {
+#ifdef UKB_SERVER
+			client_opts.threshold = vm["server_threshold"].as<float>();
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
 		if (vm.count("shutdown")) {
 #ifdef UKB_SERVER
 			opt_shutdown = true;
@@ -699,13 +1170,25 @@ int main(int argc, char *argv[]) {
 	}
 
 
+	if(opt_stats) {
+#ifdef UKB_SERVER
+		return client_server_cmd(cout, endpoint, "stats") ? 0 : 1;
+#endif
+	}
+
+	if(opt_reload) {
+#ifdef UKB_SERVER
+		return client_server_cmd(cout, endpoint, "reload") ? 0 : 1;
+#endif
+	}
+
 	if(opt_shutdown) {
 #ifdef UKB_SERVER
-		if (client_stop_server(port)) {
-			cerr << "Stopped UKB daemon on port " << lexical_cast<string>(port) << "\n";
+		if (client_stop_server(endpoint)) {
+			cerr << "Stopped UKB daemon on " << endpoint.str() << "\n";
 			return 0;
 		} else {
-			cerr << "Can not stop UKB daemon on port " << lexical_cast<string>(port) << "\n";
+			cerr << "Can not stop UKB daemon on " << endpoint.str() << "\n";
 			return 1;
 		}
 #endif
@@ -739,12 +1222,31 @@ int main(int argc, char *argv[]) {
 		}
 		// accept malformed contexts, as we don't want the daemon to die.
 		glVars::input::swallow = true;
-		cout << "Starting UKB PPV daemon on port " << lexical_cast<string>(port) << " ... ";
-        return start_daemon(port, &load_kb_and_dict, &handle_server_read, 1);
+		cout << "Starting UKB PPV daemon on " << endpoint.str() << " ... ";
+		sBatchConfig batch;
+		batch.func = &handle_server_batch;
+		batch.max_size = opt_batch_size;
+		batch.window_us = opt_batch_window;
+		return start_daemon(endpoint, &load_kb_and_dict, &handle_server_cmd, &handle_server_ctx, 1, opt_prefork, batch);
 #endif
 	}
 
 	// if not --client, load KB
+#ifdef UKB_SERVER
+	if (opt_client && client_opts.format != ppv_text) {
+		// binary PPVs need the KB for concept names
+		if (!glVars::kb::fname.size()) {
+			cerr << "Error: no KB file\n";
+			exit(1);
+		}
+		try {
+			Kb::create_from_binfile(glVars::kb::fname);
+		} catch (std::exception & e) {
+			cerr << e.what() << "\n";
+			return 1;
+		}
+	}
+#endif
 	if (!opt_client) {
 		if (!glVars::kb::fname.size()) {
 			cerr << "Error: no KB file\n";
@@ -780,7 +1282,7 @@ int main(int argc, char *argv[]) {
 
 	if (opt_client) {
 #ifdef UKB_SERVER
-		return !client(std::cin, port, out_dir, opt_stdout);
+		return !client(std::cin, endpoint, out_dir, opt_stdout, client_opts);
 #endif
 	}
 
@@ -52,7 +52,11 @@ bool opt_daemon = false;
 bool opt_nodaemon = false;
 bool opt_dump_dgraph = false;
 int opt_concurrency = 1;
-string opt_host = "localhost";
+int opt_prefork = 1;
+size_t opt_window = 32;
+size_t opt_batch_size = 1;
+unsigned int opt_batch_window = 1000;
+size_t opt_cache_size = 0;
 
 // Program options stuff
 
@@ -105,19 +109,20 @@ static void build_dgraph(CSentence & cs, DisambGraph & dgraph) {
 
 static bool rank_dgraph(const CSentence & cs,
 						DisambGraph & dg,
-						vector<float> & ranks) {
+						vector<float> & ranks,
+						PrankWorkspace & ws) {
 
 	bool ok = false;
 	switch(dgraph_rank_method) {
 	case r_ppr:
 		//ok = (opt_dmethod == m_mention) ? dgraph_mention_ppr(cs, dg, ranks) : dgraph_ppr(cs, dg, ranks);
-		ok = dgraph_ppr(cs, dg, ranks);
+		ok = dgraph_ppr(cs, dg, ranks, ws);
 	break;
 	case r_degree:
 		ok = dgraph_degree(dg, ranks);
 		break;
 	case r_static:
-		ok = dgraph_static(dg, ranks);
+		ok = dgraph_static(dg, ranks, ws);
 		break;
 	case r_ppr_w2w:
 		cerr << "rank_dgraph: [E] can't use ppr_w2w\n";
@@ -145,11 +150,12 @@ void dgraph_w2w_csent(CSentence & cs) {
 	} else {
 		DisambGraph dgraph;
 		build_dgraph(cs, dgraph);
-		vector<float> ranks;
+		PrankWorkspace & ws = PrankWorkspace::local();
+		vector<float> & ranks = ws.ranks;
 		for(CSentence::iterator cw_it = cs.ubegin(), cw_end = cs.uend();
 			cw_it != cw_end; ++cw_it) {
 			if(!cw_it->is_tgtword()) continue;
-			bool ok = dgraph_ppr(cs, dgraph, ranks, cw_it);
+			bool ok = dgraph_ppr(cs, dgraph, ranks, cw_it, ws);
 			if (!ok && glVars::debug::warning) {
 				cerr << "dgraph_w2w_csent: [W] No ranks for sentence " << cs.id() << "\n";
 				return;
@@ -175,8 +181,9 @@ void dgraph_csent(CSentence & cs) {
 	} else {
 		DisambGraph dgraph;
 		build_dgraph(cs, dgraph);
-		vector<float> ranks;
-		bool ok = rank_dgraph(cs, dgraph, ranks);
+		PrankWorkspace & ws = PrankWorkspace::local();
+		vector<float> & ranks = ws.ranks;
+		bool ok = rank_dgraph(cs, dgraph, ranks, ws);
 		if (!ok && glVars::debug::warning) {
 			cerr << "dgraph_csent: [W] No ranks for sentence " << cs.id() << "\n";
 			return;
@@ -187,8 +194,9 @@ void dgraph_csent(CSentence & cs) {
 
 void ppr_csent(CSentence & cs) {
 
-	vector<float> ranks;
-	bool ok = calculate_kb_ppr(cs,ranks);
+	PrankWorkspace & ws = PrankWorkspace::local();
+	vector<float> & ranks = ws.ranks;
+	bool ok = calculate_kb_ppr(cs, ranks, ws);
 	if (!ok && glVars::debug::warning) {
 		std::cerr << "ppr_csent: [W] Error in sentence " << cs.id() << "\n";
 		return;
@@ -204,7 +212,8 @@ void ppr_csent(CSentence & cs) {
 
 void ppr_w2w_csent(CSentence & cs) {
 
-	vector<float> ranks;
+	PrankWorkspace & ws = PrankWorkspace::local();
+	vector<float> & ranks = ws.ranks;
 	int success_n = 0;
 
 	vector<CWord>::iterator cw_it = cs.ubegin();
@@ -213,7 +222,7 @@ void ppr_w2w_csent(CSentence & cs) {
 		// Target word must be distinguished.
 		if(!cw_it->is_tgtword()) continue;
 		if (!cw_it->is_monosemous() &&
-			calculate_kb_ppr_by_word(cs, cw_it, ranks)) {
+			calculate_kb_ppr_by_word(cs, cw_it, ranks, ws)) {
 			success_n++;
 			cw_it->rank_synsets(ranks, glVars::csentence::mult_priors);
 		}
@@ -227,10 +236,7 @@ void ppr_w2w_csent(CSentence & cs) {
 
 void static_csent(CSentence &cs) {
 
-	static vector<float> ranks;
-	if (!ranks.size()) {
-		ranks = Kb::instance().static_prank();
-	}
+	const vector<float> & ranks = Kb::instance().static_prank();
 	disamb_csentence_kb(cs, ranks);
 }
 
@@ -284,38 +290,184 @@ void dispatch_run(istream & is, ostream & os) {
 ///////////////////////////////////////////////
 // Server/clien functions
 
-// Return FALSE means kill server
-
 #ifdef UKB_SERVER
-bool handle_server_read(sSession & session) {
-	string ctx_id;
-	string ctx;
-	try {
-		session.receive(ctx);
-		if (ctx == "stop") return false;
-		session.send(cmdline);
-		while(1) {
-			if (!session.receive(ctx_id)) break;
-			if (!session.receive(ctx)) break;
-			CSentence cs(ctx_id, ctx);
-			dispatch_run_cs(cs);
-			ostringstream oss;
-			cs.print_csent(oss);
-			string oss_str(oss.str());
-			if (!oss_str.length()) oss_str = "#"; // special line if not output
-			session.send(oss_str);
-		}
-	} catch (std::exception& e)	{
-		// send error and close the session.
-		// Note: the server is still alive for new connections.
-		session.send(e.what());
+
+// Cache of disambiguated contexts (--cache_size). Keys are canonical
+// contexts prefixed with the settings of the daemon.
+
+static sCache<boost::shared_ptr<const CSentence> > csent_cache;
+static string csent_cache_prefix;
+
+// Empty the cache. Called whenever KB or dictionary are (re)loaded.
+
+static void reset_csent_cache() {
+	csent_cache.clear();
+	csent_cache.set_capacity(opt_cache_size);
+	csent_cache_prefix = lexical_cast<string>(opt_dmethod) + " " + lexical_cast<string>(dgraph_rank_method)
+		+ " " + ppr_settings_key() + "\n";
+}
+
+// Return the cached results of cs, if any. key gets the cache key.
+
+static boost::shared_ptr<const CSentence> csent_cache_get(const CSentence & cs, string & key) {
+	boost::shared_ptr<const CSentence> hit;
+	if (!csent_cache.capacity()) return hit;
+	// results depend on the KB version, too
+	key = csent_cache_prefix + lexical_cast<string>(Kb::instance().generation()) + "\n" + cs.canonical_key();
+	csent_cache.get(key, hit);
+	return hit;
+}
+
+static void csent_cache_put(const string & key, const CSentence & cs) {
+	if (!csent_cache.capacity()) return;
+	csent_cache.put(key, boost::shared_ptr<const CSentence>(new CSentence(cs)));
+}
+
+// Hot reload ("reload" command, see start_reload)
+
+static void reload_wsd() {
+	reload_kb_dict(0);
+	// entries of old versions are never used again
+	csent_cache.clear();
+	dgraph_tree_cache().clear();
+}
+
+// First string of the session. Return FALSE means kill server
+
+bool handle_server_cmd(sSession & session, const string & cmd) {
+	if (cmd == "stop") return false;
+	KbDictPin pin;
+	if (cmd == "stats") {
+		ostringstream oss;
+		sStats::instance().print(oss);
+		oss << "kb_generation " << Kb::instance().generation() << "\n";
+		csent_cache.stats(oss, "cache");
+		dgraph_tree_cache().stats(oss, "dgraph_tree_cache");
+		session.send(oss.str());
+		return true;
+	}
+	if (cmd == "reload") {
+		session.send(start_reload(&reload_wsd, opt_prefork));
+		return true;
 	}
+	session.send(cmdline);
 	return true;
 }
 
-bool client(string host, istream & is, ostream & os, unsigned int port) {
+// Disambiguate one context. Errors are sent to the client by the server,
+// which closes the session (the server is still alive for new connections).
+
+static void send_csent(sSession & session, const CSentence & cs) {
+	ostringstream oss;
+	cs.print_csent(oss);
+	string oss_str(oss.str());
+	if (!oss_str.length()) oss_str = "#"; // special line if not output
+	session.send(oss_str);
+}
+
+static void send_cached_csent(sSession & session, const CSentence & hit, const string & id) {
+	CSentence cs(hit);
+	cs.set_id(id);
+	send_csent(session, cs);
+}
+
+void handle_server_ctx(sSession & session, const string & ctx_id, const string & ctx) {
+	KbDictPin pin;
+	sStats & stats = sStats::instance();
+	sTimer timer;
+	CSentence cs(ctx_id, ctx);
+	stats.time("phase_parse", timer.lap_us());
+	string key;
+	boost::shared_ptr<const CSentence> hit = csent_cache_get(cs, key);
+	if (hit) {
+		send_cached_csent(session, *hit, cs.id());
+		stats.time("phase_output", timer.lap_us());
+		return;
+	}
+	PrankWorkspace & ws = PrankWorkspace::local();
+	PrankWorkspace::stats_t before = ws.stats;
+	dispatch_run_cs(cs);
+	stats_phases(before, ws.stats, 1, timer.lap_us());
+	csent_cache_put(key, cs);
+	send_csent(session, cs);
+	stats.time("phase_output", timer.lap_us());
+}
+
+// Disambiguate a batch of contexts. With --ppr, the PageRank of all the
+// contexts is computed at once.
+
+void handle_server_batch(vector<sRequest> & batch) {
+
+	KbDictPin pin;
+
+	if (opt_dmethod != m_ppr) {
+		for(size_t i = 0; i < batch.size(); ++i) {
+			sRequest & r = batch[i];
+			try {
+				handle_server_ctx(*r.session, *r.id, *r.ctx);
+			} catch (std::exception & e) {
+				r.error = e.what();
+			}
+		}
+		return;
+	}
+
+	sStats & stats = sStats::instance();
+	sTimer timer;
+	vector<boost::shared_ptr<CSentence> > css;
+	vector<const CSentence *> css_p;
+	vector<size_t> idx; // request of each context
+	vector<string> keys;
+	for(size_t i = 0; i < batch.size(); ++i) {
+		try {
+			boost::shared_ptr<CSentence> cs(new CSentence(*batch[i].id, *batch[i].ctx));
+			stats.time("phase_parse", timer.lap_us());
+			string key;
+			boost::shared_ptr<const CSentence> hit = csent_cache_get(*cs, key);
+			if (hit) {
+				send_cached_csent(*batch[i].session, *hit, cs->id());
+				stats.time("phase_output", timer.lap_us());
+				continue;
+			}
+			css.push_back(cs);
+			css_p.push_back(cs.get());
+			idx.push_back(i);
+			keys.push_back(key);
+		} catch (std::exception & e) {
+			batch[i].error = e.what();
+		}
+	}
+	PrankWorkspace & ws = PrankWorkspace::local();
+	PrankWorkspace::stats_t before = ws.stats;
+	timer.lap_us();
+	vector<bool> ok;
+	calculate_kb_ppr_batch(css_p, ws.batch_ranks, ok, ws);
+	double run_us = timer.lap_us();
+	double output_us = 0.0;
+	for(size_t j = 0; j < css.size(); ++j) {
+		sRequest & r = batch[idx[j]];
+		CSentence & cs = *css[j];
+		try {
+			if (ok[j]) {
+				disamb_csentence_kb(cs, ws.batch_ranks[j]);
+				csent_cache_put(keys[j], cs);
+			} else if (glVars::debug::warning) {
+				std::cerr << "ppr_csent: [W] Error in sentence " << cs.id() << "\n";
+			}
+			run_us += timer.lap_us();
+			send_csent(*r.session, cs);
+			output_us += timer.lap_us();
+		} catch (std::exception & e) {
+			r.error = e.what();
+		}
+	}
+	stats_phases(before, ws.stats, css.size(), run_us);
+	if (css.size()) stats.time("phase_output", output_us / css.size(), css.size());
+}
+
+bool client(const sEndpoint & ep, istream & is, ostream & os) {
 	// connect to ukb port and send data to it.
-    sClient client(host, port);
+    sClient client(ep);
 	string server_cmd;
 	string go("go");
 	if (client.error()) {
@@ -328,15 +480,24 @@ bool client(string host, istream & is, ostream & os, unsigned int port) {
 		client.send(go);
 		client.receive(server_cmd);
 		os << server_cmd << std::endl;
-		while(read_line_noblank(is, id, l_n)) {
-			if(!read_line_noblank(is, ctx, l_n)) return false;
-			client.send(id);
-			client.send(ctx);
-			client.receive(out);
+		// keep up to opt_window contexts in flight
+		sPipeline pipe(client, opt_window);
+		bool eof = false;
+		while(1) {
+			while(!eof && !pipe.full()) {
+				if (!read_line_noblank(is, id, l_n)) {
+					eof = true;
+					break;
+				}
+				if(!read_line_noblank(is, ctx, l_n)) return false;
+				pipe.send(id, ctx);
+			}
+			if (!pipe.receive(id, out)) break;
 			if (out == "#") continue; // empty output for that context
 			os << out;
 			os.flush();
 		}
+		if (glVars::verbose) pipe.report(std::cerr);
 	} catch (std::exception& e)	{
 		std::cerr << e.what() << std::endl;
 		return false;
@@ -345,9 +506,28 @@ bool client(string host, istream & is, ostream & os, unsigned int port) {
 }
 
 
-bool client_stop_server(unsigned int port) {
+bool client_server_cmd(const sEndpoint & ep, const string & cmd, ostream & os) {
+	// connect to ukb port, send a command (e.g. stats) and print the answer
+	sClient client(ep);
+	if (client.error()) {
+		std::cerr << "Error when connecting: " << client.error_str() << std::endl;
+		return false;
+	}
+	string answer;
+	try {
+		client.send(cmd);
+		client.receive(answer);
+	} catch (std::exception& e)	{
+		std::cerr << e.what() << std::endl;
+		return false;
+	}
+	os << answer;
+	return answer.compare(0, 3, "[E]") != 0;
+}
+
+bool client_stop_server(const sEndpoint & ep) {
 	// connect to ukb port and tell it to stop
-	sClient client("localhost", port);
+	sClient client(ep);
 	string stop("stop");
 	if (client.error()) {
 		std::cerr << "client_stop_server: [E] Error when connecting: " << client.error_str() << std::endl;
@@ -377,6 +557,11 @@ void load_kb_and_dict(bool from_daemon) {
 	// - there is a dictionary name (textual or binary)
 	// - from_daemon is set
 	if (!from_daemon) return;
+	// fill KB caches before serving any request
+	Kb::instance().warm_caches();
+#ifdef UKB_SERVER
+	reset_csent_cache();
+#endif
 	if (!(glVars::dict::text_fname.size() + glVars::dict::bin_fname.size())) return;
 	string aux("Loading Dict ");
 	aux += glVars::dict::text_fname.size() ? glVars::dict::text_fname : glVars::dict::bin_fname;
@@ -412,6 +597,8 @@ int main(int argc, char *argv[]) {
 	bool opt_do_test = false;
 	bool opt_client = false;
 	bool opt_shutdown = false;
+	bool opt_stats = false;
+	bool opt_reload = false;
 
 	cmdline = string("!! -v ");
 	cmdline += glVars::ukb_version;
@@ -425,7 +612,7 @@ int main(int argc, char *argv[]) {
 	ifstream input_ifs;
 
 #ifdef UKB_SERVER
-	unsigned int port = 10000;
+	sEndpoint endpoint; // --port, --host, --socket
 #endif
 	size_t iterations = 0;
 	float thresh = 0.0;
@@ -479,6 +666,10 @@ int main(int argc, char *argv[]) {
 		("dgraph_rank", value<string>(), "Set disambiguation method for dgraphs. Options are: ppr(default), ppr_w2w, coherence, static, degree.")
 		("dgraph_maxdepth", value<size_t>(), "If --dgraph_dfs is set, specify the maximum depth (default is 6).")
 		("dgraph_nocosenses", "If --dgraph_dfs, stop DFS when finding one co-sense of target word in path.")
+		("dgraph_bfs_maxdepth", value<size_t>(), "If --dgraph_bfs is set, ignore paths longer than arg (default is 0, no limit).")
+		("dgraph_threads", value<size_t>(), "Number of threads for the BFS/DFS searches of each context when building dgraphs (default is 1).")
+		("dgraph_tree_cache", value<size_t>(), "If --dgraph_bfs is set, keep the BFS trees of frequent synsets in arg MB of memory (default is 0, no cache).")
+		("dgraph_tree_vertices", value<size_t>(), "Number of vertices of each BFS tree kept by --dgraph_tree_cache (default is 10000).")
 		("nibble_epsilon", value<float>(), "Error for approximate pageRank as computed by the nibble algorithm.")
 		;
 
@@ -508,8 +699,16 @@ int main(int argc, char *argv[]) {
 		("port", value<unsigned int>(), "Port to listen/send information.")
 		("client", "Use client mode to send contexts to the ukb daemon. Bare in mind that the configuration is that of the server.")
         ("host", value<string>(), "Host of the server.")
+		("socket", value<string>(), "Use the unix domain socket arg instead of a TCP port (server and client in the same machine).")
 		("shutdown", "Shutdown ukb daemon.")
-        ("concurrency", value<int>(), "Number of server threads")
+        ("concurrency", value<int>(), "Number of server worker threads")
+		("prefork", value<int>(), "Number of server worker processes, which share the KB and dictionary loaded once (default 1). Each process runs --concurrency threads.")
+		("window", value<size_t>(), "Number of contexts in flight in client mode (default 32).")
+		("cache_size", value<size_t>(), "Server keeps the results of the last arg different contexts (default 0, no cache).")
+		("stats", "Print statistics of the ukb daemon (see --cache_size).")
+		("reload", "Make the ukb daemon load the KB and dictionary files again, without stopping. Requests keep on being served with the old ones until loaded.")
+		("batch_size", value<size_t>(), "Server computes together up to arg contexts arriving at the same time (default 1, no batching).")
+		("batch_window", value<unsigned int>(), "Microseconds the server waits for a batch to be complete (default 1000).")
 		;
 
 	options_description po_visible(desc_header);
@@ -632,6 +831,32 @@ int main(int argc, char *argv[]) {
 			glVars::dGraph::max_depth = md;
 		}
 
+		if (vm.count("dgraph_bfs_maxdepth")) {
+			glVars::dGraph::bfs_max_depth = vm["dgraph_bfs_maxdepth"].as<size_t>();
+		}
+
+		if (vm.count("dgraph_threads")) {
+			size_t n = vm["dgraph_threads"].as<size_t>();
+			if (n == 0) {
+				cerr << "Error: invalid dgraph_threads of zero\n";
+				exit(-1);
+			}
+			glVars::dGraph::threads = n;
+		}
+
+		if (vm.count("dgraph_tree_cache")) {
+			glVars::dGraph::tree_cache = vm["dgraph_tree_cache"].as<size_t>();
+		}
+
+		if (vm.count("dgraph_tree_vertices")) {
+			size_t n = vm["dgraph_tree_vertices"].as<size_t>();
+			if (n == 0) {
+				cerr << "Error: invalid dgraph_tree_vertices of zero\n";
+				exit(-1);
+			}
+			glVars::dGraph::tree_cache_vertices = n;
+		}
+
 		if (vm.count("dgraph_nocosenses")) {
 			glVars::dGraph::stopCosenses = true;
 		}
@@ -766,6 +991,64 @@ int main(int argc, char *argv[]) {
 #endif
         }
 
+		if (vm.count("cache_size")) {
+#ifdef UKB_SERVER
+			opt_cache_size = vm["cache_size"].as<size_t>();
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("stats")) {
+#ifdef UKB_SERVER
+			opt_stats = true;
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("reload")) {
+#ifdef UKB_SERVER
+			opt_reload = true;
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("batch_size")) {
+#ifdef UKB_SERVER
+			opt_batch_size = vm["batch_size"].as<size_t>();
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("batch_window")) {
+#ifdef UKB_SERVER
+			opt_batch_window = vm["batch_window"].as<unsigned int>();
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
+		if (vm.count("prefork")) {
+#ifdef UKB_SERVER
+			opt_prefork = vm["prefork"].as<int>();
+			if (opt_prefork < 1) {
+				cerr << "--prefork must be at least 1\n";
+				exit(1);
+			}
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
         if (vm.count("concurrency")) {
 #ifdef UKB_SERVER
             opt_concurrency = vm["concurrency"].as<int>();
@@ -781,7 +1064,7 @@ int main(int argc, char *argv[]) {
 
 		if (vm.count("port")) {
 #ifdef UKB_SERVER
-            port = vm["port"].as<unsigned int>();
+            endpoint.port = vm["port"].as<unsigned int>();
 #else
 		cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
 		exit(1);
@@ -797,15 +1080,37 @@ int main(int argc, char *argv[]) {
 #endif
 		}
 
+		if (vm.count("window")) {
+#ifdef UKB_SERVER
+			opt_window = vm["window"].as<size_t>();
+			if (opt_window < 1) {
+				cerr << "--window must be at least 1\n";
+				exit(1);
+			}
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
         if (vm.count("host")) {
 #ifdef UKB_SERVER
-            opt_host = vm["host"].as<string>();
+            endpoint.host = vm["host"].as<string>();
 #else
             cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
             exit(1);
 #endif
         }
 
+		if (vm.count("socket")) {
+#ifdef UKB_SERVER
+			endpoint.path = vm["socket"].as<string>();
+#else
+			cerr << "[E] server not available (compile ukb without -DUKB_SERVER switch)\n";
+			exit(1);
+#endif
+		}
+
 		if (vm.count("shutdown")) {
 #ifdef UKB_SERVER
 			opt_shutdown = true;
@@ -825,13 +1130,25 @@ int main(int argc, char *argv[]) {
         exit(-1);
     }
 
+	if(opt_stats) {
+#ifdef UKB_SERVER
+		return !client_server_cmd(endpoint, "stats", std::cout);
+#endif
+	}
+
+	if(opt_reload) {
+#ifdef UKB_SERVER
+		return !client_server_cmd(endpoint, "reload", std::cout);
+#endif
+	}
+
 	if(opt_shutdown) {
 #ifdef UKB_SERVER
-		if (client_stop_server(port)) {
-			cerr << "Stopped UKB daemon on port " << lexical_cast<string>(port) << "\n";
+		if (client_stop_server(endpoint)) {
+			cerr << "Stopped UKB daemon on " << endpoint.str() << "\n";
 			return 0;
 		} else {
-			cerr << "Can not stop UKB daemon on port " << lexical_cast<string>(port) << "\n";
+			cerr << "Can not stop UKB daemon on " << endpoint.str() << "\n";
 			return 1;
 		}
 #endif
@@ -864,11 +1181,15 @@ int main(int argc, char *argv[]) {
 		}
 		// accept malformed contexts, as we don't want the daemon to die.
 		glVars::input::swallow = true;
-		cout << "Starting UKB WSD daemon on port " << lexical_cast<string>(port) << " ... \n";
+		cout << "Starting UKB WSD daemon on " << endpoint.str() << " ... \n";
+        sBatchConfig batch;
+        batch.func = &handle_server_batch;
+        batch.max_size = opt_batch_size;
+        batch.window_us = opt_batch_window;
         if (opt_daemon) {
-            return start_daemon(port, &load_kb_and_dict, &handle_server_read, opt_concurrency);
+            return start_daemon(endpoint, &load_kb_and_dict, &handle_server_cmd, &handle_server_ctx, opt_concurrency, opt_prefork, batch);
         } else if (opt_nodaemon) {
-            return start_no_daemon(port, &load_kb_and_dict, &handle_server_read, opt_concurrency);
+            return start_no_daemon(endpoint, &load_kb_and_dict, &handle_server_cmd, &handle_server_ctx, opt_concurrency, opt_prefork, batch);
         } else {
             cerr << "Error: --dameon or --nodaemon are not set yet server mode is enabled" << endl;
             exit(-1);
@@ -910,7 +1231,7 @@ int main(int argc, char *argv[]) {
 		// TODO :
 		// - check parameters
         // - cmdline
-        return !client(opt_host, std::cin, std::cout, port);
+        return !client(endpoint, std::cin, std::cout);
 #endif
 	}
 
@@ -6,6 +6,9 @@
 #include <iostream>
 
 #include<boost/tuple/tuple.hpp> // for "tie"
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
 
 // Tokenizer
 #include <boost/tokenizer.hpp>
@@ -349,7 +352,7 @@ namespace ukb {
 		}
 	}
 
-	WDict::WDict() : m_N(0) {
+	WDict::WDict() : m_N(0), m_variants_once(), m_inv_once() {
 		if(glVars::dict::text_fname.size() == 0 and glVars::dict::bin_fname.size() == 0)
 			throw std::runtime_error("[E] WDict: no dict file\n");
 		if (glVars::dict::text_fname.size()) read_wdict_file(glVars::dict::text_fname);
@@ -358,9 +361,93 @@ namespace ukb {
 		}
 	}
 
+	// Versions. dict_instance is the current version, owned by
+	// current_dict. The first call to instance() loads it.
+
+	static WDict * dict_instance = 0;
+	static WDict::version_t current_dict;
+	static boost::mutex current_dict_mutex;
+	static boost::once_flag first_dict_once = BOOST_ONCE_INIT;
+
+	static void no_cleanup(WDict *) {}
+	static boost::thread_specific_ptr<WDict> pinned_dict(&no_cleanup);
+
+	static void load_first_dict() {
+		if (!WDict::current()) WDict::set_current(WDict::load());
+	}
+
 	WDict & WDict::instance() {
-		static WDict inst;
-		return inst;
+		WDict *dict = pinned_dict.get();
+		if (dict) return *dict;
+		boost::call_once(first_dict_once, &load_first_dict);
+		return *dict_instance;
+	}
+
+	WDict::version_t WDict::current() {
+		boost::mutex::scoped_lock lock(current_dict_mutex);
+		return current_dict;
+	}
+
+	void WDict::set_current(const version_t & dict) {
+		boost::mutex::scoped_lock lock(current_dict_mutex);
+		current_dict = dict;
+		dict_instance = dict.get();
+	}
+
+	WDict::version_t WDict::load() {
+		return version_t(new WDict);
+	}
+
+	WDict * WDict::pin(WDict * dict) {
+		WDict *old = pinned_dict.get();
+		pinned_dict.reset(dict);
+		return old;
+	}
+
+	// KB and dictionary versions are changed and pinned together
+
+	static boost::mutex kb_dict_mutex;
+
+	void set_current_kb_dict(const Kb::version_t & kb, const WDict::version_t & dict) {
+		boost::mutex::scoped_lock lock(kb_dict_mutex);
+		Kb::set_current(kb);
+		if (dict) WDict::set_current(dict);
+	}
+
+	void reload_kb_dict(void (*warm)(Kb & kb, WDict * dict)) {
+		Kb::version_t kb = Kb::load_binfile(glVars::kb::fname);
+		WDict::version_t dict;
+		// the dictionary is loaded over the new KB
+		Kb *old = Kb::pin(kb.get());
+		try {
+			kb->warm_caches();
+			if (glVars::dict::text_fname.size() + glVars::dict::bin_fname.size()) {
+				dict = WDict::load();
+				if (glVars::dict::altdict_fname.size())
+					dict->read_alternate_file(glVars::dict::altdict_fname);
+			}
+			if (warm) warm(*kb, dict.get());
+		} catch (...) {
+			Kb::pin(old);
+			throw;
+		}
+		Kb::pin(old);
+		set_current_kb_dict(kb, dict);
+	}
+
+	KbDictPin::KbDictPin() {
+		{
+			boost::mutex::scoped_lock lock(kb_dict_mutex);
+			m_kb = Kb::current();
+			m_dict = WDict::current();
+		}
+		m_old_kb = Kb::pin(m_kb.get());
+		m_old_dict = WDict::pin(m_dict.get());
+	}
+
+	KbDictPin::~KbDictPin() {
+		Kb::pin(m_old_kb);
+		WDict::pin(m_old_dict);
 	}
 
 	size_t WDict::size() const {
@@ -368,10 +455,21 @@ namespace ukb {
 	}
 
 	size_t WDict::size_inv() const {
-		if (!m_wdict_inv.size()) create_inverse_dict();
+		warm_inverse_dict();
 		return m_wdict_inv.size();
 	}
 
+	void WDict::warm_variants() const {
+		// Remove const'ness
+		WDict & me = const_cast<WDict &>(*this);
+		boost::call_once(m_variants_once, boost::bind(&WDict::create_variant_map, &me));
+	}
+
+	void WDict::warm_inverse_dict() const {
+		WDict & me = const_cast<WDict &>(*this);
+		boost::call_once(m_inv_once, boost::bind(&WDict::create_inverse_dict, &me));
+	}
+
 	void WDict::size_bytes() {
 		long D = 0;
 		long C = 0;
@@ -471,7 +569,7 @@ namespace ukb {
 		}
 	};
 
-	void WDict::create_inverse_dict() const {
+	void WDict::create_inverse_dict() {
 
 		bool P;
 		for(wdict_t::const_iterator it = m_wdict.begin(), end = m_wdict.end();
@@ -509,7 +607,7 @@ namespace ukb {
 
 	WInvdict_entries WDict::words(Kb::vertex_descriptor u) const {
 		static winvdict_rhs_t null_entry;
-		if (!m_wdict_inv.size()) create_inverse_dict();
+		warm_inverse_dict();
 		winvdict_t::const_iterator it = m_wdict_inv.find(u);
 		if (it == m_wdict_inv.end()) return WInvdict_entries(null_entry);
 		return WInvdict_entries(it->second);
@@ -535,11 +633,7 @@ namespace ukb {
 	std::string WDict::variant(std::string & concept_id) const {
 
 		static string res("Not in Dictionary");
-		if (m_variants.size() == 0) {
-			// Remove const'ness
-			WDict & me = const_cast<WDict &>(*this);
-			me.create_variant_map();
-		}
+		warm_variants();
 		map<string, string>::const_iterator it = m_variants.find(concept_id);
 		if (it == m_variants.end())
 			return res;
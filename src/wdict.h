@@ -15,6 +15,8 @@
 #include <stdexcept>
 #include <boost/unordered_map.hpp>
 #include <boost/iterator/iterator_facade.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/shared_ptr.hpp>
 
 ////////////////////////////////////////
 
@@ -208,6 +210,19 @@ namespace ukb {
 		// Singleton
 		static WDict & instance();
 
+		// Versions of the dictionary (hot reload), as with Kb versions. A
+		// dictionary refers to the vertices of a KB, so a new KB needs a
+		// new dictionary (see set_current_kb_dict and KbDictPin below).
+
+		typedef boost::shared_ptr<WDict> version_t;
+
+		static version_t current();
+		static void set_current(const version_t & dict);
+		// Load the dictionary files in glVars::dict (but altdict) over
+		// Kb::instance()
+		static version_t load();
+		static WDict * pin(WDict * dict);
+
 		size_t size() const;
 		size_t size_inv() const;
 
@@ -227,6 +242,13 @@ namespace ukb {
 
 		void write_wdict_binfile(const std::string & fname);
 
+		// The variant map and the inverse dictionary are built on first use.
+		// Building is guarded so that concurrent first calls are safe; servers
+		// call these at startup so that requests never pay for it.
+
+		void warm_variants() const;
+		void warm_inverse_dict() const;
+
 		// Debug
 		void  size_bytes();
 
@@ -241,7 +263,7 @@ namespace ukb {
 		void read_wdict_file(const std::string & fname);
 
 		void create_variant_map();
-		void create_inverse_dict() const;
+		void create_inverse_dict();
 
 		// Streaming
 		void read_dict_from_stream (std::istream & is);
@@ -250,9 +272,11 @@ namespace ukb {
 
 	private:
 		wdict_t m_wdict;
-		mutable winvdict_t m_wdict_inv;
+		winvdict_t m_wdict_inv;
 		size_t m_N; // number of headwords
 		std::map<std::string, std::string> m_variants;
+		mutable boost::once_flag m_variants_once;
+		mutable boost::once_flag m_inv_once;
 	};
 
 	class WDictHeadwords {
@@ -281,6 +305,39 @@ namespace ukb {
 
 	float concept_priors(boost::unordered_map<Kb::vertex_descriptor, float> & P);
 
+	// Make kb and dict (loaded over kb) the current versions at once. dict
+	// may be null if there is no dictionary.
+
+	void set_current_kb_dict(const Kb::version_t & kb, const WDict::version_t & dict);
+
+	// Load the KB and dictionary files (glVars) again, the dictionary over
+	// the new KB, and make them current (hot reload). Caches of the new KB
+	// are filled, and warm (if not null) is called on both before they are
+	// made current (dict is null if there is no dictionary). Throws on
+	// error, leaving the current versions untouched.
+
+	void reload_kb_dict(void (*warm)(Kb & kb, WDict * dict));
+
+	// Pin the current KB and dictionary in the calling thread while in
+	// scope, so that Kb::instance() and WDict::instance() return them even
+	// if new versions are made current meanwhile.
+
+	class KbDictPin {
+
+	public:
+		KbDictPin();
+		~KbDictPin();
+
+	private:
+		KbDictPin(const KbDictPin &);
+		KbDictPin & operator=(const KbDictPin &);
+
+		Kb::version_t m_kb;
+		WDict::version_t m_dict;
+		Kb *m_old_kb;
+		WDict *m_old_dict;
+	};
+
 }
 
 